@@ -76,38 +76,35 @@ void BlowfishKeyPrivate::setBytes(const QByteArray &raw) {
 	cb_setkey(key, (unsigned char *) rawKey.data(), rawKey.size());
 }
 
+/* The context is only read here, so a key may be used from several
+ * threads at once. */
 QByteArray BlowfishKeyPrivate::encrypt(QByteArray data) const {
+	int block = (int) blocksize;
+	if(data.size() % block != 0)
+		data.append(QByteArray(block - data.size() % block, 0));
 
-	unsigned char *chunk = new unsigned char[blocksize];
+	QByteArray output(data.size(), 0);
 
-	QByteArray output;
+	const unsigned char *in = (const unsigned char *) data.constData();
+	unsigned char *out = (unsigned char *) output.data();
 
-	if(data.size() % blocksize != 0)
-		data.resize((data.size() / blocksize + 1) * blocksize);
-
-	for(; data.size() > 0; data = data.right(data.size() - blocksize)) {
-		cb_encrypt(key, chunk, (unsigned char *) data.data());
-
-		output += QByteArray((char *) chunk, blocksize);
-	}
-
-	delete chunk;
+	for(int i = 0; i < data.size(); i += block)
+		cb_encrypt(key, out + i, in + i);
 
 	return output;
 }
 
 QByteArray BlowfishKeyPrivate::decrypt(QByteArray data) const {
-	unsigned char *chunk = new unsigned char[blocksize];
-	
-	QByteArray output;
+	int block = (int) blocksize;
 
-	for(; data.size() > 0; data = data.right(data.size() - blocksize)) {
-		cb_decrypt(key, chunk, (unsigned char *) data.data());
+	// a trailing partial block is garbage
+	QByteArray output(data.size() - data.size() % block, 0);
 
-		output += QByteArray((char *) chunk, blocksize);
-	}
-	
-	delete chunk;
+	const unsigned char *in = (const unsigned char *) data.constData();
+	unsigned char *out = (unsigned char *) output.data();
+
+	for(int i = 0; i < output.size(); i += block)
+		cb_decrypt(key, out + i, in + i);
 
 	return output;
 }
@@ -0,0 +1,196 @@
+/*
+ * Sparkle - zero-configuration fully distributed self-organizing encrypting VPN
+ * Copyright (C) 2009 Sergey Gridassov, Peter Zotov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "Compressor.h"
+
+quint32 Compressor::read32(const uchar *p) {
+	quint32 value;
+	memcpy(&value, p, sizeof(value));
+
+	return value;
+}
+
+/* emits the continuation bytes of a length whose nibble is saturated */
+uchar *Compressor::writeLength(uchar *op, int length) {
+	while(length >= 255) {
+		*op++ = 255;
+		length -= 255;
+	}
+
+	*op++ = (uchar) length;
+
+	return op;
+}
+
+bool Compressor::compress(const QByteArray &input, QByteArray &output) {
+	int size = input.size();
+	if(size > 0xffff)
+		return false;
+
+	const uchar *src = (const uchar*) input.constData();
+
+	// worst case is all literals
+	output.resize(2 + size + size / 255 + 16);
+	uchar *dst = (uchar*) output.data(), *op = dst + 2;
+
+	dst[0] = (uchar) (size >> 8);
+	dst[1] = (uchar) (size & 0xff);
+
+	int anchor = 0, ip = 0;
+
+	if(size > MatchFindLimit) {
+		quint16 table[1 << HashLog];
+		memset(table, 0, sizeof(table));
+
+		while(ip < size - MatchFindLimit) {
+			quint32 sequence = read32(src + ip);
+			int hash = (int) ((sequence * 2654435761U) >> (32 - HashLog));
+
+			int ref = table[hash];
+			table[hash] = (quint16) ip;
+
+			if(ref >= ip || ip - ref > MaxOffset || read32(src + ref) != sequence) {
+				ip++;
+				continue;
+			}
+
+			int length = MinMatch;
+			while(ip + length < size - LastLiterals && src[ref + length] == src[ip + length])
+				length++;
+
+			int literals = ip - anchor;
+			uchar *token = op++;
+
+			if(literals >= 15) {
+				*token = 15 << 4;
+				op = writeLength(op, literals - 15);
+			} else {
+				*token = (uchar) (literals << 4);
+			}
+
+			memcpy(op, src + anchor, literals);
+			op += literals;
+
+			int offset = ip - ref;
+			*op++ = (uchar) (offset & 0xff);
+			*op++ = (uchar) (offset >> 8);
+
+			int matched = length - MinMatch;
+			if(matched >= 15) {
+				*token |= 15;
+				op = writeLength(op, matched - 15);
+			} else {
+				*token |= (uchar) matched;
+			}
+
+			ip += length;
+			anchor = ip;
+		}
+	}
+
+	int literals = size - anchor;
+	uchar *token = op++;
+
+	if(literals >= 15) {
+		*token = 15 << 4;
+		op = writeLength(op, literals - 15);
+	} else {
+		*token = (uchar) (literals << 4);
+	}
+
+	memcpy(op, src + anchor, literals);
+	op += literals;
+
+	output.resize(op - dst);
+
+	return output.size() < size;
+}
+
+bool Compressor::decompress(const QByteArray &input, QByteArray &output) {
+	if(input.size() < 2)
+		return false;
+
+	const uchar *ip = (const uchar*) input.constData(), *end = ip + input.size();
+
+	int size = (ip[0] << 8) | ip[1];
+	ip += 2;
+
+	output.resize(size);
+	uchar *base = (uchar*) output.data(), *op = base, *oend = base + size;
+
+	while(ip < end) {
+		uchar token = *ip++;
+
+		int literals = token >> 4;
+		if(literals == 15) {
+			uchar byte;
+			do {
+				if(ip >= end)
+					return false;
+
+				byte = *ip++;
+				literals += byte;
+			} while(byte == 255);
+		}
+
+		if(end - ip < literals || oend - op < literals)
+			return false;
+
+		memcpy(op, ip, literals);
+		op += literals;
+		ip += literals;
+
+		// the last sequence carries literals only
+		if(ip == end)
+			break;
+
+		if(end - ip < 2)
+			return false;
+
+		int offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+
+		if(offset == 0 || offset > op - base)
+			return false;
+
+		int length = token & 15;
+		if(length == 15) {
+			uchar byte;
+			do {
+				if(ip >= end)
+					return false;
+
+				byte = *ip++;
+				length += byte;
+			} while(byte == 255);
+		}
+
+		length += MinMatch;
+		if(oend - op < length)
+			return false;
+
+		// matches may overlap their own output
+		const uchar *ref = op - offset;
+		while(length--)
+			*op++ = *ref++;
+	}
+
+	return op == oend;
+}
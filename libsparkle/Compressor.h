@@ -0,0 +1,46 @@
+/*
+ * Sparkle - zero-configuration fully distributed self-organizing encrypting VPN
+ * Copyright (C) 2009 Sergey Gridassov, Peter Zotov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __COMPRESSOR__H__
+#define __COMPRESSOR__H__
+
+#include <QByteArray>
+
+/* LZ4 block format compressor for data packet payloads. The compressed
+ * form is prefixed with the original length (big endian, 16 bit), so
+ * payloads over 64k are never compressed. */
+class Compressor {
+public:
+	/* returns false when the result would not be smaller than the input */
+	static bool compress(const QByteArray &input, QByteArray &output);
+	static bool decompress(const QByteArray &input, QByteArray &output);
+
+private:
+	enum {
+		MinMatch	= 4,
+		HashLog		= 12,
+		LastLiterals	= 5,
+		MatchFindLimit	= 12,
+		MaxOffset	= 0xffff,
+	};
+
+	static quint32 read32(const uchar *p);
+	static uchar *writeLength(uchar *op, int length);
+};
+
+#endif
@@ -0,0 +1,286 @@
+/*
+ * Sparkle - zero-configuration fully distributed self-organizing encrypting VPN
+ * Copyright (C) 2009 Sergey Gridassov, Peter Zotov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QThread>
+#include <QWaitCondition>
+#include <QMutexLocker>
+#include <QHash>
+#include <QtAlgorithms>
+
+#include <Sparkle/BlowfishKey>
+#include <Sparkle/Log>
+
+#include "CryptoPipeline.h"
+
+namespace Sparkle {
+
+class CryptoWorker : public QThread {
+public:
+	CryptoWorker(CryptoPipeline *pipeline);
+
+	bool submit(const CryptoPipeline::job_t &job);
+	void clear();
+	void stop();
+
+protected:
+	void run();
+
+private:
+	enum {
+		QueueMax	= 1024,
+		KeyCacheSize	= 256,
+	};
+
+	const BlowfishKey *key(const QByteArray &bytes);
+
+	CryptoPipeline *pipeline;
+
+	QMutex mutex;
+	QWaitCondition wake;
+	QQueue<CryptoPipeline::job_t> jobs, controlJobs;
+	bool stopping;
+
+	// touched by the worker thread only
+	QHash<QByteArray, BlowfishKey *> keys;
+	QQueue<QByteArray> keyOrder;
+};
+
+}
+
+using namespace Sparkle;
+
+CryptoWorker::CryptoWorker(CryptoPipeline *_pipeline) : pipeline(_pipeline), stopping(false) {
+}
+
+bool CryptoWorker::submit(const CryptoPipeline::job_t &job) {
+	QMutexLocker locker(&mutex);
+
+	if(job.control) {
+		controlJobs.enqueue(job);
+	} else {
+		if(jobs.count() >= QueueMax)
+			return false;
+
+		jobs.enqueue(job);
+	}
+
+	wake.wakeOne();
+
+	return true;
+}
+
+void CryptoWorker::clear() {
+	QMutexLocker locker(&mutex);
+
+	jobs.clear();
+	controlJobs.clear();
+}
+
+void CryptoWorker::stop() {
+	{
+		QMutexLocker locker(&mutex);
+
+		stopping = true;
+		jobs.clear();
+		controlJobs.clear();
+		wake.wakeOne();
+	}
+
+	wait();
+}
+
+const BlowfishKey *CryptoWorker::key(const QByteArray &bytes) {
+	BlowfishKey *cached = keys.value(bytes, NULL);
+	if(cached != NULL)
+		return cached;
+
+	// setting a key up costs far more than a packet, so schedules are kept
+	if(keyOrder.count() >= KeyCacheSize)
+		delete keys.take(keyOrder.dequeue());
+
+	cached = new BlowfishKey();
+	cached->setBytes(bytes);
+
+	keys[bytes] = cached;
+	keyOrder.enqueue(bytes);
+
+	return cached;
+}
+
+void CryptoWorker::run() {
+	forever {
+		CryptoPipeline::job_t job;
+
+		{
+			QMutexLocker locker(&mutex);
+
+			while(jobs.isEmpty() && controlJobs.isEmpty() && !stopping)
+				wake.wait(&mutex);
+
+			if(stopping)
+				break;
+
+			if(!controlJobs.isEmpty())
+				job = controlJobs.dequeue();
+			else
+				job = jobs.dequeue();
+		}
+
+		if(job.encrypt)
+			job.data = job.prefix + key(job.key)->encrypt(job.data);
+		else
+			job.data = key(job.key)->decrypt(job.data);
+
+		pipeline->complete(job);
+	}
+
+	qDeleteAll(keys);
+	keys.clear();
+	keyOrder.clear();
+}
+
+CryptoPipeline::CryptoPipeline(QObject *parent) : QObject(parent), generation(0),
+		dropped(0), droppedReported(0), droppedReportedAt(-DropReportInterval), deliveryScheduled(false) {
+	clock.start();
+}
+
+CryptoPipeline::~CryptoPipeline() {
+	setWorkers(0);
+}
+
+void CryptoPipeline::setWorkers(int count) {
+	count = qBound(0, count, (int) WorkersMax);
+
+	foreach(CryptoWorker *worker, workerThreads) {
+		worker->stop();
+		delete worker;
+	}
+	workerThreads.clear();
+
+	clear();
+
+	for(int i = 0; i < count; i++) {
+		CryptoWorker *worker = new CryptoWorker(this);
+		worker->start();
+
+		workerThreads.append(worker);
+	}
+}
+
+int CryptoPipeline::workers() const {
+	return workerThreads.count();
+}
+
+void CryptoPipeline::encrypt(const QByteArray &key, const QByteArray &prefix, const QByteArray &data,
+			QHostAddress host, quint16 port, int flow) {
+	job_t job;
+	job.encrypt = true;
+	job.control = flow < 0;
+	job.key = key;
+	job.prefix = prefix;
+	job.data = data;
+	job.address = host.toIPv4Address();
+	job.port = port;
+	job.flow = flow;
+
+	submit(job);
+}
+
+void CryptoPipeline::decrypt(const QByteArray &key, const QByteArray &data, const Endpoint &from) {
+	job_t job;
+	job.encrypt = false;
+	// the type is not known before decryption
+	job.control = false;
+	job.key = key;
+	job.data = data;
+	job.address = from.address;
+	job.port = from.port;
+	job.flow = -1;
+
+	submit(job);
+}
+
+void CryptoPipeline::submit(job_t &job) {
+	Q_ASSERT(!workerThreads.isEmpty());
+
+	job.generation = generation;
+
+	quint32 shard = (job.address ^ (job.port * 2654435761U)) % workerThreads.count();
+	if(!workerThreads[shard]->submit(job)) {
+		dropped++;
+		reportDrops();
+	}
+}
+
+/* one line per DropReportInterval at most, however long the workers lag */
+void CryptoPipeline::reportDrops() {
+	qint64 now = clock.elapsed();
+	if(now - droppedReportedAt < DropReportInterval)
+		return;
+
+	Log::warn("crypto: %1 packets dropped on full worker queues") << dropped - droppedReported;
+
+	droppedReported = dropped;
+	droppedReportedAt = now;
+}
+
+/* called on worker threads */
+void CryptoPipeline::complete(const job_t &job) {
+	QMutexLocker locker(&resultsMutex);
+
+	results.enqueue(job);
+
+	if(!deliveryScheduled) {
+		deliveryScheduled = true;
+		QMetaObject::invokeMethod(this, "deliver", Qt::QueuedConnection);
+	}
+}
+
+void CryptoPipeline::deliver() {
+	QQueue<job_t> ready;
+
+	{
+		QMutexLocker locker(&resultsMutex);
+
+		ready = results;
+		results.clear();
+		deliveryScheduled = false;
+	}
+
+	while(!ready.isEmpty()) {
+		job_t job = ready.dequeue();
+		if(job.generation != generation)
+			continue;
+
+		if(job.encrypt)
+			emit encrypted(job.data, QHostAddress(job.address), job.port, job.flow);
+		else
+			emit decrypted(job.data, job.address, job.port);
+	}
+}
+
+void CryptoPipeline::clear() {
+	// jobs already being processed are recognized by their generation
+	generation++;
+
+	foreach(CryptoWorker *worker, workerThreads)
+		worker->clear();
+
+	QMutexLocker locker(&resultsMutex);
+	results.clear();
+}
@@ -0,0 +1,105 @@
+/*
+ * Sparkle - zero-configuration fully distributed self-organizing encrypting VPN
+ * Copyright (C) 2009 Sergey Gridassov, Peter Zotov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CRYPTO_PIPELINE__H__
+#define __CRYPTO_PIPELINE__H__
+
+#include <QObject>
+#include <QHostAddress>
+#include <QList>
+#include <QQueue>
+#include <QMutex>
+#include <QElapsedTimer>
+
+#include <Sparkle/PacketSink>
+
+namespace Sparkle {
+
+class CryptoWorker;
+
+/* Moves session cipher work off the event loop. Jobs are sharded by peer
+ * endpoint over the worker threads, so packets of one peer are processed
+ * and delivered back in order; results are emitted on the thread owning
+ * the pipeline. Outgoing control packets (flow < 0) have a queue of their
+ * own which is served first and never full: they may overtake data of the
+ * same peer, but not each other. Workers keep their own key schedules,
+ * keyed by key bytes, and never touch the keys of the link layer. */
+class CryptoPipeline : public QObject {
+	Q_OBJECT
+
+	friend class CryptoWorker;
+
+public:
+	CryptoPipeline(QObject *parent = 0);
+	virtual ~CryptoPipeline();
+
+	void setWorkers(int count);
+	int workers() const;
+
+	/* prefix is prepended to the ciphertext as is */
+	void encrypt(const QByteArray &key, const QByteArray &prefix, const QByteArray &data,
+			QHostAddress host, quint16 port, int flow);
+	void decrypt(const QByteArray &key, const QByteArray &data, const Endpoint &from);
+
+	/* forgets everything not delivered yet */
+	void clear();
+
+signals:
+	void encrypted(QByteArray packet, QHostAddress host, quint16 port, int flow);
+	void decrypted(QByteArray data, quint32 address, quint16 port);
+
+private slots:
+	void deliver();
+
+private:
+	enum {
+		WorkersMax		= 16,
+		DropReportInterval	= 10000,
+	};
+
+	struct job_t {
+		bool		encrypt;
+		bool		control;
+		QByteArray	key;
+		QByteArray	prefix;
+		QByteArray	data;
+		quint32		address;
+		quint16		port;
+		int		flow;
+		quint32		generation;
+	};
+
+	void submit(job_t &job);
+	void complete(const job_t &job);
+	void reportDrops();
+
+	QList<CryptoWorker *> workerThreads;
+	quint32 generation;
+
+	QElapsedTimer clock;
+	quint32 dropped, droppedReported;
+	qint64 droppedReportedAt;
+
+	QMutex resultsMutex;
+	QQueue<job_t> results;
+	bool deliveryScheduled;
+};
+
+}
+
+#endif
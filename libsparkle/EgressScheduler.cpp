@@ -0,0 +1,231 @@
+/*
+ * Sparkle - zero-configuration fully distributed self-organizing encrypting VPN
+ * Copyright (C) 2009 Sergey Gridassov, Peter Zotov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QTimer>
+
+#include <Sparkle/PacketTransport>
+#include <Sparkle/Log>
+
+#include "EgressScheduler.h"
+
+using namespace Sparkle;
+
+EgressScheduler::EgressScheduler(PacketTransport &_transport, QObject *parent)
+		: QObject(parent), transport(_transport), rate(0), peerRate(0), queued(0), dropped(0),
+		  droppedReported(0), droppedReportedAt(-DropReportInterval)
+{
+	drainTimer = new QTimer(this);
+	drainTimer->setSingleShot(false);
+	drainTimer->setInterval(DrainInterval);
+	connect(drainTimer, SIGNAL(timeout()), SLOT(drain()));
+
+	clock.start();
+
+	bucket.tokens = BurstBytes;
+	bucket.refilledAt = 0;
+}
+
+void EgressScheduler::setRates(int bytesPerSecond, int peerBytesPerSecond) {
+	rate = bytesPerSecond;
+	peerRate = peerBytesPerSecond;
+
+	peerBuckets.clear();
+}
+
+int EgressScheduler::queuedPackets() const {
+	return queued;
+}
+
+quint32 EgressScheduler::droppedPackets() const {
+	return dropped;
+}
+
+quint64 EgressScheduler::peerKey(QHostAddress host, quint16 port) {
+	return ((quint64) host.toIPv4Address() << 16) | port;
+}
+
+void EgressScheduler::refill(bucket_t &bucket, int rate) {
+	qint64 now = clock.elapsed();
+
+	if(rate == 0)
+		bucket.tokens = BurstBytes;
+	else
+		bucket.tokens = qMin<qint64>(BurstBytes, bucket.tokens + (now - bucket.refilledAt) * rate / 1000);
+
+	bucket.refilledAt = now;
+}
+
+/* A bucket lets a packet through while it has any tokens left, and may go
+ * into debt; packets larger than the burst would never pass otherwise. */
+bool EgressScheduler::mayPass(quint64 peer) {
+	refill(bucket, rate);
+	if(bucket.tokens <= 0)
+		return false;
+
+	if(peerRate > 0) {
+		if(!peerBuckets.contains(peer)) {
+			bucket_t fresh;
+			fresh.tokens = BurstBytes;
+			fresh.refilledAt = clock.elapsed();
+			peerBuckets[peer] = fresh;
+		}
+
+		refill(peerBuckets[peer], peerRate);
+		if(peerBuckets[peer].tokens <= 0)
+			return false;
+	}
+
+	return true;
+}
+
+void EgressScheduler::consume(quint64 peer, int size) {
+	if(rate > 0)
+		bucket.tokens -= size;
+
+	if(peerRate > 0 && peerBuckets.contains(peer))
+		peerBuckets[peer].tokens -= size;
+}
+
+void EgressScheduler::transmit(packet_t &packet) {
+	transport.sendPacket(packet.data, packet.host, packet.port);
+}
+
+void EgressScheduler::send(QByteArray &data, QHostAddress host, quint16 port, Priority priority, quint16 flow) {
+	quint64 peer = peerKey(host, port);
+
+	packet_t packet;
+	packet.data = data;
+	packet.host = host;
+	packet.port = port;
+
+	// control packets jump every queue, but still take their share of the rate
+	if(priority == Control) {
+		refill(bucket, rate);
+		consume(peer, data.size());
+		transmit(packet);
+
+		return;
+	}
+
+	if(queued == 0 && mayPass(peer)) {
+		consume(peer, data.size());
+		transmit(packet);
+
+		return;
+	}
+
+	quint64 key = (peer << 16) | flow;
+
+	flow_t& queue = flows[key];
+	if(queue.queue.count() >= FlowQueueMax) {
+		dropped++;
+		reportDrops();
+		return;
+	}
+
+	if(queue.queue.isEmpty()) {
+		queue.deficit = 0;
+		activeFlows.append(key);
+	}
+
+	queue.queue.enqueue(packet);
+	queued++;
+
+	if(!drainTimer->isActive())
+		drainTimer->start();
+}
+
+/* one line per DropReportInterval at most, however hard the queues overflow */
+void EgressScheduler::reportDrops() {
+	qint64 now = clock.elapsed();
+	if(now - droppedReportedAt < DropReportInterval)
+		return;
+
+	Log::warn("egress: %1 data packets dropped on full flow queues") << dropped - droppedReported;
+
+	droppedReported = dropped;
+	droppedReportedAt = now;
+}
+
+void EgressScheduler::drain() {
+	int stalled = 0;
+
+	while(!activeFlows.isEmpty() && stalled < activeFlows.count()) {
+		quint64 key = activeFlows.takeFirst();
+		quint64 peer = key >> 16;
+		flow_t& flow = flows[key];
+
+		bool progressed = false, limited = false;
+
+		flow.deficit += Quantum;
+		while(!flow.queue.isEmpty() && flow.queue.head().data.size() <= flow.deficit) {
+			if(!mayPass(peer)) {
+				limited = true;
+				break;
+			}
+
+			packet_t packet = flow.queue.dequeue();
+			flow.deficit -= packet.data.size();
+			queued--;
+
+			consume(peer, packet.data.size());
+			transmit(packet);
+
+			progressed = true;
+		}
+
+		if(flow.queue.isEmpty()) {
+			flows.remove(key);
+		} else {
+			// a rate-limited flow does not earn credit while it waits
+			if(limited && !progressed)
+				flow.deficit -= Quantum;
+
+			activeFlows.append(key);
+		}
+
+		stalled = progressed ? 0 : stalled + 1;
+
+		if(rate > 0 && bucket.tokens <= 0)
+			break;
+	}
+
+	if(activeFlows.isEmpty()) {
+		drainTimer->stop();
+
+		// full buckets carry no state worth keeping
+		foreach(quint64 peer, peerBuckets.keys()) {
+			refill(peerBuckets[peer], peerRate);
+			if(peerBuckets[peer].tokens >= BurstBytes)
+				peerBuckets.remove(peer);
+		}
+	}
+}
+
+void EgressScheduler::forgetPeer(QHostAddress host, quint16 port) {
+	peerBuckets.remove(peerKey(host, port));
+}
+
+void EgressScheduler::clear() {
+	drainTimer->stop();
+
+	flows.clear();
+	activeFlows.clear();
+	peerBuckets.clear();
+	queued = 0;
+}
@@ -0,0 +1,115 @@
+/*
+ * Sparkle - zero-configuration fully distributed self-organizing encrypting VPN
+ * Copyright (C) 2009 Sergey Gridassov, Peter Zotov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __EGRESS_SCHEDULER__H__
+#define __EGRESS_SCHEDULER__H__
+
+#include <QObject>
+#include <QHostAddress>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QList>
+#include <QQueue>
+
+class QTimer;
+
+namespace Sparkle {
+
+class PacketTransport;
+
+/* Sits between the link layer and the transport. Control packets are
+ * never queued; data packets are paced by token buckets (one for the whole
+ * node and one per peer) and, when they have to wait, leave in deficit
+ * round-robin order across flows. A flow is a peer endpoint together with
+ * an encapsulation. With no rates set everything is sent at once. */
+class EgressScheduler : public QObject {
+	Q_OBJECT
+
+public:
+	enum Priority {
+		Control,
+		Data
+	};
+
+	EgressScheduler(PacketTransport &transport, QObject *parent = 0);
+
+	void setRates(int bytesPerSecond, int peerBytesPerSecond);
+
+	void send(QByteArray &packet, QHostAddress host, quint16 port,
+			Priority priority = Control, quint16 flow = 0);
+
+	void forgetPeer(QHostAddress host, quint16 port);
+	void clear();
+
+	int queuedPackets() const;
+	quint32 droppedPackets() const;
+
+private slots:
+	void drain();
+
+private:
+	enum {
+		DrainInterval		= 2,
+		Quantum			= 1500,
+		BurstBytes		= 65536,
+		FlowQueueMax		= 256,
+		DropReportInterval	= 10000,
+	};
+
+	struct bucket_t {
+		qint64		tokens;
+		qint64		refilledAt;
+	};
+
+	struct packet_t {
+		QByteArray	data;
+		QHostAddress	host;
+		quint16		port;
+	};
+
+	struct flow_t {
+		QQueue<packet_t>	queue;
+		int			deficit;
+	};
+
+	static quint64 peerKey(QHostAddress host, quint16 port);
+
+	void refill(bucket_t &bucket, int rate);
+	bool mayPass(quint64 peer);
+	void consume(quint64 peer, int size);
+	void transmit(packet_t &packet);
+	void reportDrops();
+
+	PacketTransport &transport;
+	QTimer *drainTimer;
+	QElapsedTimer clock;
+
+	int rate, peerRate;
+	bucket_t bucket;
+	QHash<quint64, bucket_t> peerBuckets;
+
+	QHash<quint64, flow_t> flows;
+	QList<quint64> activeFlows;
+	int queued;
+	quint32 dropped, droppedReported;
+	qint64 droppedReportedAt;
+};
+
+}
+
+#endif
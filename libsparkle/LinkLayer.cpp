@@ -20,7 +20,11 @@
 #include <QStringList>
 #include <QHostInfo>
 #include <QTimer>
+#include <QThread>
 #include <QtEndian>
+#include <QFile>
+#include <QDataStream>
+#include <QtAlgorithms>
 
 #include <Sparkle/LinkLayer>
 #include <Sparkle/SparkleNode>
@@ -30,29 +34,117 @@
 #include <Sparkle/ApplicationLayer>
 #include <Sparkle/BlowfishKey>
 
+#include "EgressScheduler.h"
+#include "Compressor.h"
+#include "ParityCoder.h"
+#include "CryptoPipeline.h"
+#include "SparkleRandom.h"
+
 using namespace Sparkle;
 
 LinkLayer::LinkLayer(Router &router, PacketTransport &_transport, RSAKeyPair &_hostKeyPair)
-		: QObject(NULL), hostKeyPair(_hostKeyPair), _router(router), transport(_transport), joined(false), preparingForShutdown(false)
+		: QObject(NULL), hostKeyPair(_hostKeyPair), _router(router), transport(_transport),
+		  pendingDeliveryCount(0), receivingBatch(false), replicationFactor(0), joined(false),
+		  joinRTT(-1), nodeNegotiationTimeout(NegotiationTimeout),
+		  preparingForShutdown(false), lanDiscovery(true), compression(true), fec(true),
+		  joinAttempt(0), joinRetries(0), admissionRate(AdmissionRateDefault),
+		  sessionLimit(0), sessionIdleTimeout(SessionIdleTimeoutDefault), prewarmPeers(PrewarmPeersDefault),
+		  lanChallengesAnswered(0), packetCount(0), loadMeasuredAt(0), loadCPUTime(0),
+		  natProbeTarget(NULL), natProbeInFlight(false), natTimeoutEstimate(NATTimeoutDefault)
 {
-	connect(&transport, SIGNAL(receivedPacket(QByteArray&, QHostAddress, quint16)),
-			SLOT(handlePacket(QByteArray&, QHostAddress, quint16)));
+	transport.setSink(this);
+
+	egress = new EgressScheduler(transport, this);
+
+	crypto = new CryptoPipeline(this);
+	connect(crypto, SIGNAL(encrypted(QByteArray, QHostAddress, quint16, int)),
+			SLOT(sendCiphertext(QByteArray, QHostAddress, quint16, int)));
+	connect(crypto, SIGNAL(decrypted(QByteArray, quint32, quint16)),
+			SLOT(handleDecryptedPacket(QByteArray, quint32, quint16)));
 
 	pingTimer = new QTimer(this);
 	pingTimer->setSingleShot(true);
-	pingTimer->setInterval(10000);
+	pingTimer->setInterval(PingWaitTimeout);
 	connect(pingTimer, SIGNAL(timeout()), SLOT(pingTimeout()));
 
 	joinTimer = new QTimer(this);
 	joinTimer->setSingleShot(true);
-	joinTimer->setInterval(15000);
+	joinTimer->setInterval(JoinStepTimeout);
 	connect(joinTimer, SIGNAL(timeout()), SLOT(joinTimeout()));
 
 	natKeepaliveTimer = new QTimer(this);
 	natKeepaliveTimer->setSingleShot(false);
-	natKeepaliveTimer->setInterval(10000);
+	natKeepaliveTimer->setInterval(NATKeepaliveTick);
 	connect(natKeepaliveTimer, SIGNAL(timeout()), SLOT(keepNATAlive()));
 
+	natProbeTimer = new QTimer(this);
+	natProbeTimer->setSingleShot(true);
+	connect(natProbeTimer, SIGNAL(timeout()), SLOT(natProbeTimeout()));
+
+	natProbeReplyTimer = new QTimer(this);
+	natProbeReplyTimer->setSingleShot(true);
+	connect(natProbeReplyTimer, SIGNAL(timeout()), SLOT(sendDueNATProbeReplies()));
+
+	loadTimer = new QTimer(this);
+	loadTimer->setSingleShot(false);
+	loadTimer->setInterval(LoadAdvertisementInterval);
+	connect(loadTimer, SIGNAL(timeout()), SLOT(advertiseLoad()));
+
+	routeDigestTimer = new QTimer(this);
+	routeDigestTimer->setSingleShot(false);
+	routeDigestTimer->setInterval(RouteDigestInterval);
+	connect(routeDigestTimer, SIGNAL(timeout()), SLOT(reconcileRoutes()));
+
+	linkProbeTimer = new QTimer(this);
+	linkProbeTimer->setSingleShot(false);
+	linkProbeTimer->setInterval(LinkProbeInterval);
+	connect(linkProbeTimer, SIGNAL(timeout()), SLOT(probeLinks()));
+
+	punchTimer = new QTimer(this);
+	punchTimer->setSingleShot(true);
+	connect(punchTimer, SIGNAL(timeout()), SLOT(sendDuePunches()));
+
+	lanBeaconTimer = new QTimer(this);
+	lanBeaconTimer->setSingleShot(false);
+	lanBeaconTimer->setInterval(LANBeaconInterval);
+	connect(lanBeaconTimer, SIGNAL(timeout()), SLOT(sendLANBeacon()));
+
+	sessionTimer = new QTimer(this);
+	sessionTimer->setSingleShot(false);
+	sessionTimer->setInterval(SessionSweepInterval);
+	connect(sessionTimer, SIGNAL(timeout()), SLOT(evictSessions()));
+	connect(sessionTimer, SIGNAL(timeout()), SLOT(rotateKeys()));
+
+	prewarmTimer = new QTimer(this);
+	prewarmTimer->setSingleShot(false);
+	prewarmTimer->setInterval(PrewarmInterval);
+	connect(prewarmTimer, SIGNAL(timeout()), SLOT(prewarm()));
+
+	contactsTimer = new QTimer(this);
+	contactsTimer->setSingleShot(false);
+	contactsTimer->setInterval(ContactsSaveInterval);
+	connect(contactsTimer, SIGNAL(timeout()), SLOT(saveContacts()));
+
+	rejoinTimer = new QTimer(this);
+	rejoinTimer->setSingleShot(true);
+	connect(rejoinTimer, SIGNAL(timeout()), SLOT(rejoin()));
+
+	registerRetryTimer = new QTimer(this);
+	registerRetryTimer->setSingleShot(true);
+	connect(registerRetryTimer, SIGNAL(timeout()), SLOT(retryRegistration()));
+
+	admissionTimer = new QTimer(this);
+	admissionTimer->setSingleShot(false);
+	admissionTimer->setInterval(1000 / AdmissionRateDefault);
+	connect(admissionTimer, SIGNAL(timeout()), SLOT(admitQueuedRegistration()));
+
+	parityTimer = new QTimer(this);
+	parityTimer->setSingleShot(true);
+	parityTimer->setInterval(FECFlushDelay);
+	connect(parityTimer, SIGNAL(timeout()), SLOT(flushParity()));
+
+	clock.start();
+
 	_transport.connect(this, SIGNAL(leavedNetwork()), SLOT(endReceiving()));
 
 	Log::debug("link layer (protocol version %1) is ready") << ProtocolVersion;
@@ -67,34 +159,73 @@ Router& LinkLayer::router() {
 }
 
 bool LinkLayer::joinNetwork(QHostAddress remoteIP, quint16 remotePort, bool forceBehindNAT) {
-	Log::debug("link: joining via [%1]:%2") << remoteIP << remotePort;
+	this->forceBehindNAT = forceBehindNAT;
+
+	joinRemoteIP = remoteIP;
+	joinRemotePort = remotePort;
+	joinAttempt = 0;
+
+	return startJoin();
+}
+
+bool LinkLayer::startJoin() {
+	Log::debug("link: joining via [%1]:%2") << joinRemoteIP << joinRemotePort;
 
 	if(!initTransport())
 		return false;
 
-	this->forceBehindNAT = forceBehindNAT;
+	joinRTT = -1;
+	joinObservedIP = QHostAddress();
+	joinObservedPort = 0;
+	joinTimer->setInterval(JoinStepTimeout);
+	pingTimer->setInterval(PingWaitTimeout);
 
 	joinStep = JoinVersionRequest;
-	sendProtocolVersionRequest(wrapNode(remoteIP, remotePort));
+	joinRTTTimer.start();
+	sendProtocolVersionRequest(wrapNode(joinRemoteIP, joinRemotePort));
 
 	joinTimer->start();
 
 	return true;
 }
 
+void LinkLayer::setJoinRetries(int retries) {
+	joinRetries = retries;
+}
+
 void LinkLayer::joinTimeout() {
 	Log::error("link: join timeout");
 
 	cleanup();
-	emit joinFailed();
+
+	if(joinAttempt >= joinRetries) {
+		emit joinFailed();
+		return;
+	}
+
+	// everyone who lost the network at once must not come back at once
+	int backoff = qMin<qint64>((qint64) RejoinBackoffMin << qMin(joinAttempt, 16), RejoinBackoffMax);
+	int delay = backoff / 2 + qrand() % (backoff / 2 + 1);
+
+	joinAttempt++;
+
+	Log::info("link: retrying join in %1s (attempt %2 of %3)") << delay / 1000 << joinAttempt << joinRetries;
+
+	rejoinTimer->start(delay);
 }
 
-bool LinkLayer::createNetwork(QHostAddress localIP, quint8 networkDivisor) {
+void LinkLayer::rejoin() {
+	if(!startJoin())
+		emit joinFailed();
+}
+
+bool LinkLayer::createNetwork(QHostAddress localIP, quint8 networkDivisor, quint8 replicationFactor) {
 	SparkleNode *self = new SparkleNode(_router, localIP, transport.port());
 	Q_CHECK_PTR(self);
 	self->setMaster(true);
 	self->setAuthKey(hostKeyPair);
 	self->configure();
+	self->setRouteVersion(_router.nextRouteVersion());
 
 	_router.setSelfNode(self);
 
@@ -105,11 +236,22 @@ bool LinkLayer::createNetwork(QHostAddress localIP, quint8 networkDivisor) {
 
 	Log::debug("link: created network, my endpoint is [%1]:%2") << localIP << transport.port();
 
-	this->networkDivisor = networkDivisor;
+	this->networkDivisor = effectiveDivisor = networkDivisor;
 	Log::debug("link: network divisor is 1/%1") << networkDivisor;
 
+	this->replicationFactor = replicationFactor;
+	if(replicationFactor > 0)
+		Log::debug("link: routes are partitioned, %1 replicas each") << replicationFactor;
+
 	joinStep = JoinFinished;
 	joined = true;
+	loadTimer->start();
+	routeDigestTimer->start();
+	linkProbeTimer->start();
+	sessionTimer->start();
+	startPrewarm();
+	if(lanDiscovery)
+		lanBeaconTimer->start();
 	emit joinedNetwork(self);
 
 	return true;
@@ -163,16 +305,27 @@ bool LinkLayer::isMaster() {
 }
 
 SparkleNode* LinkLayer::wrapNode(QHostAddress host, quint16 port) {
+	Endpoint from = { host.toIPv4Address(), port };
+
+	return wrapNode(from);
+}
+
+/* the address object is built only when a node is new */
+SparkleNode* LinkLayer::wrapNode(const Endpoint &from) {
 	foreach(SparkleNode* node, nodeSpool) {
-		if((node->phantomIP() == host && node->phantomPort() == port) ||
-				(node->realIP() == host && node->realPort() == port))
+		if((node->phantomPort() == from.port && node->phantomIP().toIPv4Address() == from.address) ||
+				(node->realPort() == from.port && node->realIP().toIPv4Address() == from.address))
 			return node;
 	}
 
+	QHostAddress host(from.address);
+	quint16 port = from.port;
+
 	Log::debug("link: adding [%1]:%2 to node spool") << host << port;
 
 	SparkleNode* node = new SparkleNode(_router, host, port);
 	Q_CHECK_PTR(node);
+	node->setNegotiationTimeout(nodeNegotiationTimeout);
 	nodeSpool.append(node);
 
 	connect(node, SIGNAL(negotiationTimedOut(SparkleNode*)), SLOT(negotiationTimeout(SparkleNode*)));
@@ -180,29 +333,43 @@ SparkleNode* LinkLayer::wrapNode(QHostAddress host, quint16 port) {
 	return node;
 }
 
-void LinkLayer::sendPacket(packet_type_t type, QByteArray data, SparkleNode* node) {
-	Q_ASSERT(node != NULL);
+/* the header is written in place, ahead of a single copy of the payload */
+QByteArray LinkLayer::framePacket(packet_type_t type, const QByteArray &payload) {
+	QByteArray packet;
+	packet.reserve(sizeof(packet_header_t) + payload.size());
+
+	packet_header_t* hdr = wireAppend<packet_header_t>(packet);
+	hdr->length = sizeof(packet_header_t) + payload.size();
+	hdr->type = type;
+
+	return packet.append(payload);
+}
 
-	packet_header_t hdr;
-	hdr.length = qToBigEndian<quint16>(sizeof(packet_header_t) + data.size());
-	hdr.type = qToBigEndian<quint16>(type);
+void LinkLayer::sendPacket(packet_type_t type, QByteArray data, SparkleNode* node, int dataFlow) {
+	Q_ASSERT(node != NULL);
 
-	data.prepend(QByteArray((const char *) &hdr, sizeof(packet_header_t)));
+	data = framePacket(type, data);
 
 	if(node == _router.getSelfNode()) {
 		Log::error("link: attempting to send packet to myself, dropping");
 		return;
 	}
 
-	transport.sendPacket(data, node->phantomIP(), node->phantomPort());
+	node->touchSent();
+	packetCount++;
+
+	if(dataFlow < 0)
+		egress->send(data, node->phantomIP(), node->phantomPort());
+	else
+		egress->send(data, node->phantomIP(), node->phantomPort(), EgressScheduler::Data, dataFlow);
 }
 
-void LinkLayer::sendEncryptedPacket(packet_type_t type, QByteArray data, SparkleNode *node, bool skipTunnel) {
-	packet_header_t hdr;
-	hdr.length = qToBigEndian<quint16>(sizeof(packet_header_t) + data.size());
-	hdr.type = qToBigEndian<quint16>(type);
+void LinkLayer::setEgressRates(int bytesPerSecond, int peerBytesPerSecond) {
+	egress->setRates(bytesPerSecond, peerBytesPerSecond);
+}
 
-	data.prepend(QByteArray((const char *) &hdr, sizeof(packet_header_t)));
+void LinkLayer::sendEncryptedPacket(packet_type_t type, QByteArray data, SparkleNode *node, bool skipTunnel) {
+	data = framePacket(type, data);
 
 	if(!node->areKeysNegotiated()) {
 		node->pushQueue(data);
@@ -229,25 +396,197 @@ void LinkLayer::sendEncryptedPacket(packet_type_t type, QByteArray data, Sparkle
 void LinkLayer::encryptAndSend(QByteArray data, SparkleNode *node) {
 	Q_ASSERT(node->areKeysNegotiated());
 
-	sendPacket(EncryptedPacket, node->mySessionKey()->encrypt(data), node);
+	WireView<packet_header_t> hdr(data);
+	quint16 type = hdr->type;
+	if(type != KeepalivePacket)
+		node->touchUsed();
+
+	// bulk traffic is paced and shared fairly; messaging stays with the control plane
+	int dataFlow = -1;
+	WireView<data_packet_t> dataInfo(data, sizeof(packet_header_t));
+	if(type == DataPacket && dataInfo.isValid()) {
+		quint16 encap = dataInfo->encapsulation;
+
+		if(encap != ApplicationLayer::Messaging)
+			dataFlow = encap;
+	} else if(type == RelayedDataPacket || type == FECDataPacket || type == FECParityPacket) {
+		dataFlow = type;
+	}
+
+	QByteArray packet;
+	encrypted_packet_t* info = wireAppend<encrypted_packet_t>(packet);
+	info->epoch = node->myKeyEpoch();
+
+	/* With workers, everything for a peer goes through its shard. Control
+	 * packets may overtake its data there, which is harmless: every job
+	 * carries its key and epoch, and the peer keeps our previous key. */
+	if(crypto->workers() > 0) {
+		node->touchSent();
+		packetCount++;
+
+		crypto->encrypt(node->mySessionKey()->bytes(), packet, data, node->phantomIP(), node->phantomPort(), dataFlow);
+	} else {
+		packet.append(node->mySessionKey()->encrypt(data));
+
+		sendPacket(EncryptedPacket, packet, node, dataFlow);
+	}
+
+	node->countEncrypted(data.size());
+	if(node->bytesUnderKey() >= RekeyBytes && !node->isRekeyPending())
+		sendRekey(node);
+}
+
+void LinkLayer::sendCiphertext(QByteArray packet, QHostAddress host, quint16 port, int dataFlow) {
+	QByteArray data = framePacket(EncryptedPacket, packet);
+
+	if(dataFlow < 0)
+		egress->send(data, host, port);
+	else
+		egress->send(data, host, port, EgressScheduler::Data, dataFlow);
+}
+
+void LinkLayer::handleDecryptedPacket(QByteArray data, quint32 address, quint16 port) {
+	WireView<packet_header_t> hdr(data);
+
+	if(!hdr.isValid() ||
+			hdr->length < sizeof(packet_header_t) ||
+			hdr->length > data.size()) {
+		Log::warn("link: malformed encrypted payload from [%1]:%2") << QHostAddress(address) << port;
+
+		return;
+	}
+
+	// Blowfish requires 64-bit chunks, here we truncate alignment zeroes at end
+	quint16 length = hdr->length;
+	if(data.size() > length && data.size() < length + 8)
+		data.resize(length);
+
+	Endpoint from = { address, port };
+	handlePacket(data, from, true);
+}
+
+void LinkLayer::setCryptoWorkers(int count) {
+	crypto->setWorkers(count);
 }
 
 void LinkLayer::negotiationTimeout(SparkleNode* node) {
-	Log::warn("link: negotiation timeout for [%1]:%2, dropping queue") << *node;
+	Log::warn("link: negotiation timeout for [%1]:%2") << *node;
 
-	node->flushQueue();
+	node->countFailure();
 	awaitingNegotiation.removeOne(node);
 
+	SparkleAddress address = node->sparkleMAC();
+	if(isJoined() && !node->isMaster() && !address.isNull() && _router.findSparkleNode(address) == node) {
+		if(!relays.contains(address)) {
+			SparkleNode* relay = selectRelay(node);
+			if(relay != NULL) {
+				Log::info("link: cannot reach [%1]:%2 directly, relaying through [%3]:%4") << *node << *relay;
+
+				relays[address].relay = relay->sparkleMAC();
+				relays[address].lastUpgrade.start();
+			}
+		}
+
+		if(relays.contains(address)) {
+			while(!node->isQueueEmpty()) {
+				QByteArray data = node->popQueue();
+				WireView<packet_header_t> hdr(data);
+
+				if(hdr.isValid() && hdr->type == DataPacket)
+					sendRelayedDataPacket(node, data.mid(sizeof(packet_header_t)));
+			}
+		}
+	}
+
+	node->flushQueue();
+
 	if(awaitingNegotiation.count() == 0 && preparingForShutdown) {
 		cleanup();
 		emit leavedNetwork();
 	}
 }
 
+int LinkLayer::keepaliveInterval(SparkleNode* node) {
+	int timeout = node->natTimeout();
+	if(timeout == 0)
+		timeout = natTimeoutEstimate;
+
+	return timeout * 2 / 3;
+}
+
 void LinkLayer::keepNATAlive() {
 	foreach(SparkleNode* node, _router.find(Router::ExcludeSelf)) {
-		sendKeepalive(node);
+		// there is no session to keep; a new one will be estabilished through master,
+		// but the binding towards masters is kept even when they close our session
+		if(!node->areKeysNegotiated() && (!node->isMaster() || awaitingNegotiation.contains(node)))
+			continue;
+
+		if(natProbeInFlight && node == natProbeTarget)
+			continue;
+
+		if(!node->isMaster()) {
+			qint64 idle = node->msecsSinceActive();
+			if(idle < 0 || idle > NATSessionIdleTimeout)
+				continue;
+		}
+
+		qint64 sent = node->msecsSinceSent();
+		if(sent >= 0 && sent < keepaliveInterval(node))
+			continue;
+
+		if(node->areKeysNegotiated())
+			sendKeepalive(node);
+		else
+			sendPlainKeepalive(node);
+	}
+}
+
+static bool probedEarlier(SparkleNode* a, SparkleNode* b) {
+	qint64 probedA = a->msecsSinceProbe(), probedB = b->msecsSinceProbe();
+
+	// never measured goes first
+	if(probedA < 0 || probedB < 0)
+		return probedA < 0 && probedB >= 0;
+
+	return probedA > probedB;
+}
+
+void LinkLayer::probeLinks() {
+	if(isMaster())
+		detectFailures();
+
+	QList<SparkleNode*> candidates;
+
+	foreach(SparkleNode* node, _router.find(Router::ExcludeSelf)) {
+		if(!node->areKeysNegotiated())
+			continue;
+
+		// the binding lifetime probe needs this path to stay silent
+		if(natProbeInFlight && node == natProbeTarget)
+			continue;
+
+		// masters only poke peers which are about to be suspected
+		if(isMaster() && failureSilence(node) > FailureSilenceTimeout / 2) {
+			sendKeepalive(node);
+			continue;
+		}
+
+		// idle sessions are not worth measuring
+		qint64 idle = node->msecsSinceActive();
+		if(idle < 0 || idle > NATSessionIdleTimeout)
+			continue;
+
+		qint64 probed = node->msecsSinceProbe();
+		if(probed >= 0 && probed < LinkProbeInterval)
+			continue;
+
+		candidates.append(node);
 	}
+
+	qSort(candidates.begin(), candidates.end(), probedEarlier);
+
+	for(int i = 0; i < candidates.count() && i < LinkProbeSample; i++)
+		sendKeepalive(candidates[i]);
 }
 
 SparkleAddress LinkLayer::findPartialRoute(QByteArray mac) {
@@ -256,14 +595,22 @@ SparkleAddress LinkLayer::findPartialRoute(QByteArray mac) {
 			return node->sparkleMAC();
 	}
 
-	if(_router.getSelfNode()->isMaster())
-		return SparkleAddress();
+	SparkleNode* targetMaster;
+	if(replicationFactor > 0) {
+		targetMaster = selectOwner(mac);
+		if(targetMaster == NULL && _router.getSelfNode()->isMaster())
+			return SparkleAddress();
+	} else {
+		if(_router.getSelfNode()->isMaster())
+			return SparkleAddress();
+
+		targetMaster = _router.selectLeastLoaded(Router::Master);
+	}
 
 	route_request_t req;
 	memcpy(req.sparkleMAC, mac.constData(), mac.size());
 	req.length = mac.size();
 
-	SparkleNode* targetMaster = _router.select(Router::Master);
 	if(targetMaster == NULL) {
 		Log::error("findPartialRoute: no masters are present");
 		return SparkleAddress();
@@ -274,46 +621,77 @@ SparkleAddress LinkLayer::findPartialRoute(QByteArray mac) {
 	return SparkleAddress();
 }
 
-void LinkLayer::handlePacket(QByteArray &data, QHostAddress host, quint16 port, bool isEncrypted) {
-	const packet_header_t *hdr = (packet_header_t *) data.constData();
+void LinkLayer::receivePacket(QByteArray &packet, const Endpoint &from) {
+	receivingBatch = true;
+
+	handlePacket(packet, from);
+}
+
+void LinkLayer::receiveBatchDone() {
+	receivingBatch = false;
+
+	flushDeliveries();
+}
+
+void LinkLayer::handlePacket(QByteArray &data, const Endpoint &from, bool isEncrypted) {
+	WireView<packet_header_t> hdr(data);
 
-	if((size_t) data.size() < sizeof(packet_header_t) || qFromBigEndian<quint16>(hdr->length) != data.size()) {
-		Log::warn("link: malformed packet from [%1]:%2") << host << port;
+	if(!hdr.isValid() || hdr->length != data.size()) {
+		Log::warn("link: malformed packet from [%1]:%2") << QHostAddress(from.address) << from.port;
 		return;
 	}
 
-	QByteArray payload = data.right(data.size() - sizeof(packet_header_t));
-	SparkleNode* node = wrapNode(host, port);
-
-	packet_type_t type = (packet_type_t) qFromBigEndian<quint16>(hdr->type);
+	QByteArray payload = hdr.tail();
+	SparkleNode* node = wrapNode(from);
 
-	if(type == EncryptedPacket) {
-		if(!isEncrypted) {
-			if(node->areKeysNegotiated()) {
-				QByteArray decData = node->hisSessionKey()->decrypt(payload);
+	if(!isEncrypted) {
+		// anything which came through after a period of our silence proves
+		// that the binding lives at least that long
+		qint64 silence = node->msecsSinceSent();
+		if(natKeepaliveTimer->isActive() && silence > qMax(node->natTimeout(), natTimeoutEstimate))
+			node->setNATTimeout(qMin<qint64>(silence, NATTimeoutMax));
 
-				const packet_header_t *decHdr = (packet_header_t *) decData.constData();
-				quint16 decLength = qFromBigEndian<quint16>(decHdr->length);
+		node->touchReceived();
+		packetCount++;
 
-				if((size_t) decData.size() < sizeof(packet_header_t) ||
-						decLength < sizeof(packet_header_t) ||
-						decLength > decData.size()) {
-					Log::warn("link: malformed encrypted payload from [%1]:%2") << host << port;
+		if(!pendingIndirectProbes.isEmpty())
+			answerIndirectProbes(node);
+	}
 
-					return;
-				}
+	packet_type_t type = (packet_type_t) (quint16) hdr->type;
 
-				// Blowfish requires 64-bit chunks, here we truncate alignment zeroes at end
-				if(decData.size() > decLength && decData.size() < decLength + 8)
-					decData.resize(decLength);
+	if(isEncrypted && type != KeepalivePacket)
+		node->touchUsed();
 
-				handlePacket(decData, host, port, true);
+	if(type == EncryptedPacket) {
+		if(!isEncrypted) {
+			WireView<encrypted_packet_t> info(payload);
+
+			const BlowfishKey* key = NULL;
+			if(node->areKeysNegotiated() && info.isValid())
+				key = node->hisSessionKey(info->epoch);
+
+			if(key != NULL) {
+				if(crypto->workers() > 0)
+					crypto->decrypt(key->bytes(), info.tail(), from);
+				else
+					handleDecryptedPacket(key->decrypt(info.tail()), from.address, from.port);
+			} else if(isJoined() && !awaitingNegotiation.contains(node) &&
+					_router.findSparkleNode(node->sparkleMAC()) == node) {
+				// we have closed the session, but the peer has missed that
+				Log::debug("link: no keys for encrypted packet from [%1]:%2, renegotiating") <<
+					QHostAddress(from.address) << from.port;
+
+				node->negotiationStart();
+				awaitingNegotiation.append(node);
+				sendPublicKeyExchange(node, &hostKeyPair, true);
 			} else {
 				Log::warn("link: no keys for encrypted packet from [%1]:%2") <<
-					host << port;
+					QHostAddress(from.address) << from.port;
 			}
 		} else {
-			Log::warn("link: encrypted 'EncryptedPacket' packet from [%1]:%2") << host << port;
+			Log::warn("link: encrypted 'EncryptedPacket' packet from [%1]:%2") <<
+				QHostAddress(from.address) << from.port;
 		}
 
 		return;
@@ -327,11 +705,11 @@ void LinkLayer::handlePacket(QByteArray &data, QHostAddress host, quint16 port,
 		}
 
 		Log::warn("link: %4 packet of unknown type %1 from [%2]:%3") <<
-					type << host << port << (isEncrypted ? "plaintext" : "encrypted");
+					type << QHostAddress(from.address) << from.port << (isEncrypted ? "plaintext" : "encrypted");
 	}
 }
 
-bool LinkLayer::checkPacketSize(QByteArray& payload, quint16 requiredSize,
+bool LinkLayer::checkPacketSize(const QByteArray& payload, quint16 requiredSize,
 					 SparkleNode* node, const char* packetName,
 						 packet_size_class_t sizeClass) {
 	if((payload.size() != requiredSize && sizeClass == PacketSizeEqual) ||
@@ -371,20 +749,20 @@ void LinkLayer::handleProtocolVersionRequest(QByteArray &payload, SparkleNode* n
 
 void LinkLayer::sendProtocolVersionReply(SparkleNode* node) {
 	protocol_version_reply_t ver;
-	ver.version = qToBigEndian<quint32>(ProtocolVersion);
+	ver.version = ProtocolVersion;
 
 	sendPacket(ProtocolVersionReply, QByteArray((const char*) &ver, sizeof(ver)), node);
 }
 
 void LinkLayer::handleProtocolVersionReply(QByteArray &payload, SparkleNode* node) {
-	if(!checkPacketSize(payload, sizeof(protocol_version_reply_t), node, "ProtocolVersionReply"))
+	WireView<protocol_version_reply_t> reply(payload);
+	if(!checkPacketSize(reply, node, "ProtocolVersionReply"))
 		return;
 
 	if(!checkPacketExpection(node, "ProtocolVersionReply", JoinVersionRequest))
 		return;
 
-	const protocol_version_reply_t *reply = (const protocol_version_reply_t *) payload.data();
-	quint32 version = qFromBigEndian<quint32>(reply->version);
+	quint32 version = reply->version;
 
 	Log::debug("link: remote protocol version: %1") << version;
 
@@ -393,8 +771,12 @@ void LinkLayer::handleProtocolVersionReply(QByteArray &payload, SparkleNode* nod
 
 		cleanup();
 		emit joinFailed();
+
+		return;
 	}
 
+	applyJoinRTT(joinRTTTimer.elapsed());
+
 	joinStep = JoinMasterNodeRequest;
 	sendMasterNodeRequest(node);
 
@@ -406,13 +788,15 @@ void LinkLayer::handleProtocolVersionReply(QByteArray &payload, SparkleNode* nod
 void LinkLayer::sendPublicKeyExchange(SparkleNode* node, const RSAKeyPair* key, bool needHisKey, quint32 cookie) {
 	key_exchange_t ke;
 	ke.needOthersKey = needHisKey;
+	ke.features = (compression ? FeatureCompression : 0) | (fec ? FeatureFEC : 0);
+	ke.epoch = 0;
 
 	if(needHisKey) {
 		cookie = qrand();
 		cookies[cookie] = node;
 	}
 
-	ke.cookie = qToBigEndian<quint32>(cookie);
+	ke.cookie = cookie;
 
 	QByteArray request;
 	if(key)	request.append(key->publicKey());
@@ -423,12 +807,12 @@ void LinkLayer::sendPublicKeyExchange(SparkleNode* node, const RSAKeyPair* key,
 }
 
 void LinkLayer::handlePublicKeyExchange(QByteArray &payload, SparkleNode* node) {
-	if(!checkPacketSize(payload, sizeof(key_exchange_t), node, "PublicKeyExchange", PacketSizeGreater))
+	WireView<key_exchange_t> ke(payload);
+	if(!checkPacketSize(ke, node, "PublicKeyExchange", PacketSizeGreater))
 		return;
 
-	const key_exchange_t *ke = (const key_exchange_t*) payload.constData();
-	QByteArray key = payload.mid(sizeof(key_exchange_t));
-	quint32 cookie = qFromBigEndian<quint32>(ke->cookie);
+	QByteArray key = ke.tail();
+	quint32 cookie = ke->cookie;
 
 	if(!ke->needOthersKey && !cookies.contains(cookie)) {
 		cookies.remove(cookie);
@@ -446,6 +830,7 @@ void LinkLayer::handlePublicKeyExchange(QByteArray &payload, SparkleNode* node)
 
 	if(ke->needOthersKey) {
 		sendPublicKeyExchange(node, NULL, false, cookie);
+		node->startRTTSample();
 	} else {
 		SparkleNode* origNode = cookies[cookie];
 		cookies.remove(cookie);
@@ -457,9 +842,7 @@ void LinkLayer::handlePublicKeyExchange(QByteArray &payload, SparkleNode* node)
 			origNode->setPhantomPort(node->phantomPort());
 			origNode->setAuthKey(node->authKey()->publicKey());
 
-			Log::debug("link: removing [%1]:%2 from node spool [nat]") << *node;
-			nodeSpool.removeOne(node);
-			delete node;
+			forgetNode(node, "nat");
 
 			node = origNode;
 
@@ -475,22 +858,29 @@ void LinkLayer::handlePublicKeyExchange(QByteArray &payload, SparkleNode* node)
 void LinkLayer::sendSessionKeyExchange(SparkleNode* node, bool needHisKey) {
 	key_exchange_t ke;
 	ke.needOthersKey = needHisKey;
+	ke.features = (compression ? FeatureCompression : 0) | (fec ? FeatureFEC : 0);
+
+	ke.epoch = node->myKeyEpoch();
 
 	QByteArray request;
 	request.append(node->mySessionKey()->bytes());
 	request.prepend(QByteArray((const char*) &ke, sizeof(ke)));
 
 	sendPacket(SessionKeyExchange, request, node);
+
+	if(needHisKey)
+		node->startRTTSample();
 }
 
 void LinkLayer::handleSessionKeyExchange(QByteArray &payload, SparkleNode* node) {
-	if(!checkPacketSize(payload, sizeof(key_exchange_t), node, "SessionKeyExchange", PacketSizeGreater))
+	WireView<key_exchange_t> ke(payload);
+	if(!checkPacketSize(ke, node, "SessionKeyExchange", PacketSizeGreater))
 		return;
 
-	const key_exchange_t *ke = (const key_exchange_t*) payload.constData();
-
-	QByteArray key = payload.mid(sizeof(key_exchange_t));
-	node->setHisSessionKey(key);
+	QByteArray key = ke.tail();
+	node->setHisSessionKey(key, ke->epoch);
+	node->setFeatures(ke->features);
+	node->finishRTTSample();
 
 	Log::debug("link: stored session key for [%1]:%2") << *node;
 
@@ -510,6 +900,63 @@ void LinkLayer::handleSessionKeyExchange(QByteArray &payload, SparkleNode* node)
 	}
 }
 
+/* Rekey */
+
+void LinkLayer::sendRekey(SparkleNode* node) {
+	const BlowfishKey* key = node->startRekey();
+
+	QByteArray request;
+	rekey_t* rekey = wireAppend<rekey_t>(request);
+	rekey->epoch = node->myKeyEpoch() + 1;
+	request.append(key->bytes());
+
+	Log::debug("link: offering session key %1 to [%2]:%3") << (quint8) (node->myKeyEpoch() + 1) << *node;
+
+	sendEncryptedPacket(Rekey, request, node);
+}
+
+void LinkLayer::handleRekey(QByteArray &payload, SparkleNode* node) {
+	WireView<rekey_t> rekey(payload);
+	if(!checkPacketSize(rekey, node, "Rekey", PacketSizeGreater))
+		return;
+
+	node->rotateHisSessionKey(rekey.tail(), rekey->epoch);
+
+	sendRekeyAck(node, rekey->epoch);
+}
+
+/* RekeyAck */
+
+void LinkLayer::sendRekeyAck(SparkleNode* node, quint8 epoch) {
+	rekey_t ack;
+	ack.epoch = epoch;
+
+	sendEncryptedPacket(RekeyAck, QByteArray((const char*) &ack, sizeof(rekey_t)), node);
+}
+
+void LinkLayer::handleRekeyAck(QByteArray &payload, SparkleNode* node) {
+	WireView<rekey_t> ack(payload);
+	if(!checkPacketSize(ack, node, "RekeyAck"))
+		return;
+
+	if(node->finishRekey(ack->epoch))
+		Log::debug("link: switched to session key %1 for [%2]:%3") << ack->epoch << *node;
+}
+
+void LinkLayer::rotateKeys() {
+	foreach(SparkleNode* node, _router.find(Router::ExcludeSelf)) {
+		if(!node->areKeysNegotiated())
+			continue;
+
+		if(node->isRekeyPending()) {
+			if(node->msecsSinceRekey() > RekeyRetryInterval)
+				sendRekey(node);
+		} else if(node->msecsUnderKey() > RekeyInterval) {
+			sendRekey(node);
+		}
+	}
+}
+
 /* LocalRewrite */
 
 void LinkLayer::sendLocalRewritePacket(SparkleNode* node) {
@@ -545,15 +992,11 @@ void LinkLayer::handleLocalRewritePacket(QByteArray &payload, SparkleNode* node)
 	}
 
 	if(orphan != NULL && !_router.nodes().contains(orphan)) {
-		Log::debug("link: removing [%1]:%2 from node spool [orphan]") << *orphan;
-		nodeSpool.removeOne(orphan);
-		delete orphan;
+		forgetNode(orphan, "orphan");
 	}
 
 	if(node != orphan && !_router.nodes().contains(node)) {
-		Log::debug("link: removing [%1]:%2 from node spool [rewrite]") << *node;
-		nodeSpool.removeOne(node);
-		delete node;
+		forgetNode(node, "rewrite");
 	}
 
 	Log::debug("link: associated [%1]:%2 to link-local [%3]:%4") << *target << target->phantomIP() << target->phantomPort();
@@ -570,7 +1013,7 @@ void LinkLayer::handleMasterNodeRequest(QByteArray &payload, SparkleNode* node)
 		return;
 
 	// scatter load over the whole network
-	SparkleNode* master = _router.select(Router::Master | Router::ExcludeSelf, node->realIP());
+	SparkleNode* master = _router.selectLeastLoaded(Router::Master | Router::ExcludeSelf, node->realIP());
 
 	if(master == NULL) {
 		Log::warn("only one master, self, is present in the network; NAT passthrough may work incorrectly");
@@ -587,24 +1030,31 @@ void LinkLayer::handleMasterNodeRequest(QByteArray &payload, SparkleNode* node)
 
 void LinkLayer::sendMasterNodeReply(SparkleNode* node, SparkleNode* masterNode) {
 	master_node_reply_t reply;
-	reply.addr = qToBigEndian<quint32>(masterNode->realIP().toIPv4Address());
-	reply.port = qToBigEndian<quint16>(masterNode->realPort());
+	reply.addr = masterNode->realIP().toIPv4Address();
+	reply.port = masterNode->realPort();
+	reply.observedAddr = node->realIP().toIPv4Address();
+	reply.observedPort = node->realPort();
 
 	sendEncryptedPacket(MasterNodeReply, QByteArray((const char*) &reply, sizeof(master_node_reply_t)), node);
 }
 
 void LinkLayer::handleMasterNodeReply(QByteArray &payload, SparkleNode* node) {
-	if(!checkPacketSize(payload, sizeof(master_node_reply_t), node, "MasterNodeReply"))
+	WireView<master_node_reply_t> reply(payload);
+	if(!checkPacketSize(reply, node, "MasterNodeReply"))
 		return;
 
 	if(!checkPacketExpection(node, "MasterNodeReply", JoinMasterNodeRequest))
 		return;
 
-	const master_node_reply_t *reply = (const master_node_reply_t*) payload.constData();
-
-	SparkleNode* master = wrapNode(QHostAddress(qFromBigEndian<quint32>(reply->addr)), qFromBigEndian<quint16>(reply->port));
+	SparkleNode* master = wrapNode(QHostAddress(reply->addr), reply->port);
 	joinMaster = master;
 
+	// a second opinion on our endpoint is only useful from another host
+	if(master != node) {
+		joinObservedIP = QHostAddress(reply->observedAddr);
+		joinObservedPort = reply->observedPort;
+	}
+
 	Log::debug("link: determined master node: [%1]:%2") << *master;
 
 	if(!forceBehindNAT) {
@@ -629,19 +1079,18 @@ void LinkLayer::handleMasterNodeReply(QByteArray &payload, SparkleNode* node) {
 void LinkLayer::sendPingRequest(SparkleNode* node, SparkleNode* target, int count) {
 	ping_request_t req;
 	req.count = count;
-	req.addr = qToBigEndian<quint32>(target->realIP().toIPv4Address());
-	req.port = qToBigEndian<quint16>(target->realPort());
+	req.addr = target->realIP().toIPv4Address();
+	req.port = target->realPort();
 
 	sendEncryptedPacket(PingRequest, QByteArray((const char*) &req, sizeof(ping_request_t)), node);
 }
 
 void LinkLayer::handlePingRequest(QByteArray &payload, SparkleNode* node) {
-	if(!checkPacketSize(payload, sizeof(ping_request_t), node, "PingRequest"))
+	WireView<ping_request_t> req(payload);
+	if(!checkPacketSize(req, node, "PingRequest"))
 		return;
 
-	const ping_request_t *req = (const ping_request_t*) payload.constData();
-
-	SparkleNode* target = wrapNode(QHostAddress(qFromBigEndian<quint32>(req->addr)), qFromBigEndian<quint16>(req->port));
+	SparkleNode* target = wrapNode(QHostAddress(req->addr), req->port);
 
 	if(*_router.getSelfNode() == *target) {
 		doPing(node, req->count);
@@ -656,19 +1105,18 @@ void LinkLayer::handlePingRequest(QByteArray &payload, SparkleNode* node) {
 void LinkLayer::sendPingInitiate(SparkleNode* node, SparkleNode* target, int count) {
 	ping_request_t req;
 	req.count = count;
-	req.addr = qToBigEndian<quint32>(target->realIP().toIPv4Address());
-	req.port = qToBigEndian<quint16>(target->realPort());
+	req.addr = target->realIP().toIPv4Address();
+	req.port = target->realPort();
 
 	sendEncryptedPacket(PingInitiate, QByteArray((const char*) &req, sizeof(ping_request_t)), node);
 }
 
 void LinkLayer::handlePingInitiate(QByteArray &payload, SparkleNode* node) {
-	if(!checkPacketSize(payload, sizeof(ping_request_t), node, "PingInitiate"))
+	WireView<ping_request_t> req(payload);
+	if(!checkPacketSize(req, node, "PingInitiate"))
 		return;
 
-	const ping_request_t *req = (const ping_request_t*) payload.constData();
-
-	doPing(wrapNode(QHostAddress(qFromBigEndian<quint32>(req->addr)), qFromBigEndian<quint16>(req->port)), req->count);
+	doPing(wrapNode(QHostAddress(req->addr), req->port), req->count);
 }
 
 void LinkLayer::doPing(SparkleNode* node, quint8 count) {
@@ -685,14 +1133,15 @@ void LinkLayer::doPing(SparkleNode* node, quint8 count) {
 
 void LinkLayer::sendPing(SparkleNode* node) {
 	ping_t ping;
-	ping.addr = qToBigEndian<quint32>(node->realIP().toIPv4Address());
-	ping.port = qToBigEndian<quint16>(node->realPort());
+	ping.addr = node->realIP().toIPv4Address();
+	ping.port = node->realPort();
 
 	sendPacket(Ping, QByteArray((const char*) &ping, sizeof(ping_t)), node);
 }
 
 void LinkLayer::handlePing(QByteArray &payload, SparkleNode* node) {
-	if(!checkPacketSize(payload, sizeof(ping_t), node, "Ping"))
+	WireView<ping_t> ping(payload);
+	if(!checkPacketSize(ping, node, "Ping"))
 		return;
 
 	if(!checkPacketExpection(node, "Ping", JoinAwaitingPings))
@@ -703,16 +1152,21 @@ void LinkLayer::handlePing(QByteArray &payload, SparkleNode* node) {
 		return;
 	}
 
-	const ping_t* ping = (const ping_t*) payload.constData();
-
 	joinPingsArrived++;
 	if(joinPing.addr == 0) {
-		joinPing = *ping;
+		joinPing = *ping.data();
+
+		// we are reachable; the rest of the burst is only a confirmation,
+		// so don't wait for it longer than one RTT
+		if(joinPingsArrived < joinPingsEmitted && joinRTT >= 0)
+			pingTimer->start(qBound<int>(PingSettleTimeoutMin, joinRTT, PingSettleTimeoutMax));
 	} else if(joinPing.addr != ping->addr || joinPing.port != ping->port) {
 		Log::error("link: got nonidentical pings");
 
 		cleanup();
 		emit joinFailed();
+
+		return;
 	}
 
 	if(joinPingsArrived == joinPingsEmitted)
@@ -732,6 +1186,23 @@ void LinkLayer::pingTimeout() {
 	}
 }
 
+void LinkLayer::applyJoinRTT(int rtt) {
+	joinRTT = rtt;
+
+	// ping path: we -> bootstrap -> master -> we, plus possible negotiation between masters
+	pingTimer->setInterval(qBound<int>(PingWaitTimeoutMin, 4 * rtt + 250, PingWaitTimeout));
+
+	// each step may include key negotiation (two RTTs) and RSA work on both sides
+	joinTimer->setInterval(qBound<int>(JoinStepTimeoutMin, 8 * rtt + 2000, JoinStepTimeout));
+
+	nodeNegotiationTimeout = qBound<int>(NegotiationTimeoutMin, 4 * rtt + 1000, NegotiationTimeout);
+	foreach(SparkleNode* node, nodeSpool)
+		node->setNegotiationTimeout(nodeNegotiationTimeout);
+
+	Log::debug("link: RTT to bootstrap node is %1 ms; timeouts: join step %2 ms, pings %3 ms, negotiation %4 ms")
+			<< rtt << joinTimer->interval() << pingTimer->interval() << nodeNegotiationTimeout;
+}
+
 void LinkLayer::joinGotPinged() {
 	Log::debug("link: %1% of pings arrived") << (joinPingsArrived * 100 / joinPingsEmitted);
 
@@ -740,7 +1211,7 @@ void LinkLayer::joinGotPinged() {
 	joinStep = JoinRegistration;
 
 	Log::debug("link: no NAT detected, my real address is [%1]:%2")
-				<< QHostAddress(qFromBigEndian<quint32>(joinPing.addr)) << qFromBigEndian<quint16>(joinPing.port);
+				<< QHostAddress(joinPing.addr) << joinPing.port;
 
 	Log::debug("link: registering on [%1]:%2") << *joinMaster;
 	sendRegisterRequest(joinMaster, false);
@@ -751,14 +1222,20 @@ void LinkLayer::joinGotPinged() {
 /* RegisterRequest */
 
 void LinkLayer::sendRegisterRequest(SparkleNode* node, bool isBehindNAT) {
+	joinBehindNAT = isBehindNAT;
+
 	register_request_t req;
 	req.isBehindNAT = isBehindNAT;
+	req.cpuCount = qBound(1, QThread::idealThreadCount(), 255);
+	req.observedIP = joinObservedIP.isNull() ? 0 : joinObservedIP.toIPv4Address();
+	req.observedPort = joinObservedPort;
 
 	sendEncryptedPacket(RegisterRequest, QByteArray((const char*) &req, sizeof(register_request_t)), node);
 }
 
 void LinkLayer::handleRegisterRequest(QByteArray &payload, SparkleNode* node) {
-	if(!checkPacketSize(payload, sizeof(register_request_t), node, "RegisterRequest"))
+	WireView<register_request_t> req(payload);
+	if(!checkPacketSize(req, node, "RegisterRequest"))
 		return;
 
 	if(!_router.getSelfNode()->isMaster()) {
@@ -766,42 +1243,199 @@ void LinkLayer::handleRegisterRequest(QByteArray &payload, SparkleNode* node) {
 		return;
 	}
 
-	const register_request_t* req = (const register_request_t*) payload.constData();
+	if(!admissionTimer->isActive()) {
+		admissionTimer->start();
+		admitRegistration(node, req.data());
+		return;
+	}
+
+	for(int i = 0; i < admissionQueue.count(); i++) {
+		if(admissionQueue[i].host == node->phantomIP() && admissionQueue[i].port == node->phantomPort()) {
+			// retransmission; the hint was probably lost
+			sendRegisterRetry(node, queuedRetryDelay(i + 1));
+			return;
+		}
+	}
+
+	if(admissionQueue.count() >= AdmissionQueueMax) {
+		// the queue drains at admissionRate; by then it should have room again
+		int delay = qBound<int>(RegisterRetryMin, admissionQueue.count() * 1000 / admissionRate, RegisterRetryMax);
+
+		Log::debug("link: admission queue is full, [%1]:%2 should retry in %3 ms") << *node << delay;
+
+		sendRegisterRetry(node, delay);
+		return;
+	}
+
+	pending_registration_t pending;
+	pending.host = node->phantomIP();
+	pending.port = node->phantomPort();
+	pending.request = *req.data();
+	admissionQueue.append(pending);
+
+	// a queued node hears nothing until it is admitted; keep it from timing
+	// out and registering again meanwhile
+	sendRegisterRetry(node, queuedRetryDelay(admissionQueue.count()));
+}
+
+/* The reply should come well before a node at this queue position retries */
+int LinkLayer::queuedRetryDelay(int position) {
+	return qBound<int>(RegisterRetryMin, 2 * position * 1000 / admissionRate, RegisterRetryMax);
+}
+
+void LinkLayer::setAdmissionRate(int registrationsPerSecond) {
+	admissionRate = qBound(1, registrationsPerSecond, 1000);
+	admissionTimer->setInterval(1000 / admissionRate);
+}
+
+void LinkLayer::admitQueuedRegistration() {
+	flushAnnouncements();
+
+	if(admissionQueue.isEmpty()) {
+		admissionTimer->stop();
+		return;
+	}
+
+	pending_registration_t pending = admissionQueue.takeFirst();
+
+	if(!isMaster())
+		return;
+
+	admitRegistration(wrapNode(pending.host, pending.port), &pending.request);
+}
+
+void LinkLayer::flushAnnouncements() {
+	foreach(SparkleAddress mac, pendingAnnounces.keys()) {
+		SparkleNode* master = _router.findSparkleNode(mac);
+		if(master == NULL)
+			continue;
+
+		QList<SparkleNode*> targets;
+		foreach(SparkleAddress targetMAC, pendingAnnounces[mac]) {
+			SparkleNode* target = _router.findSparkleNode(targetMAC);
+			if(target != NULL)
+				targets.append(target);
+		}
+
+		if(!targets.isEmpty())
+			sendRouteBatch(master, targets);
+	}
+
+	pendingAnnounces.clear();
+}
 
+void LinkLayer::admitRegistration(SparkleNode* node, const register_request_t* req) {
 	node->configure();
 	node->setBehindNAT(req->isBehindNAT);
-
-	if(!node->isBehindNAT()) {
-		if(_router.count(Router::Master) == 1) {
+	node->setCPUCount(qMax<quint8>(req->cpuCount, 1));
+
+	if(node->isBehindNAT() && req->observedIP != 0)
+		classifyNAT(node, QHostAddress(req->observedIP), req->observedPort);
+
+	SparkleNode* promote = NULL;
+
+	if(!node->isBehindNAT() && _router.count(Router::Master) == 1) {
+		node->setMaster(true);
+	} else if(mastersInsufficient(_router.nodes().count() + 1)) {
+		// prefer an established slave over a node which has just appeared
+		SparkleNode* candidate = selectPromotionCandidate();
+		if(candidate != NULL && (node->isBehindNAT() || promotionScore(candidate) > promotionScore(node))) {
+			Log::debug("link: insufficient masters, promoting established node [%1]:%2") << *candidate;
+			promote = candidate;
+			node->setMaster(false);
+		} else if(!node->isBehindNAT()) {
+			Log::debug("link: insufficient masters, promoting new node [%1]:%2") << *node;
 			node->setMaster(true);
 		} else {
-			double ik = 1. / networkDivisor;
-			double rk = ((double) _router.count(Router::Master)) / (_router.nodes().count() + 1);
-			if(rk < ik) {
-				Log::debug("link: insufficient masters (I %1; R %2), adding one") << ik << rk;
-				node->setMaster(true);
-			} else {
-				node->setMaster(false);
-			}
+			node->setMaster(false);
 		}
 	} else {
 		node->setMaster(false);
 	}
 
+	node->setRouteVersion(_router.nextRouteVersion());
+
+	_router.updateNode(node);
+
 	QList<SparkleNode*> updates;
 	if(node->isMaster())	updates = _router.find(Router::ExcludeSelf);
 	else			updates = _router.find(Router::Master | Router::ExcludeSelf);
+	updates.removeOne(node);
+
+	QList<SparkleNode*> announces = updates;
+
+	if(replicationFactor > 0) {
+		// a slave is announced to its owners only; everyone learns about masters,
+		// while a new master gets only the routes it is going to own
+		QList<SparkleNode*> owners = _router.owners(node->sparkleMAC().bytes(), replicationFactor);
+
+		if(!node->isMaster()) {
+			announces.clear();
+			foreach(SparkleNode* owner, owners) {
+				if(owner != _router.getSelfNode())
+					announces.append(owner);
+			}
+		}
 
-	foreach(SparkleNode* update, updates) {
-		sendRoute(node, update);
-		sendRoute(update, node);
+		foreach(SparkleNode* update, updates) {
+			if(!update->isMaster() && !_router.isOwner(node, update->sparkleMAC().bytes(), replicationFactor))
+				updates.removeOne(update);
+		}
 	}
 
-	sendRoute(node, _router.getSelfNode());
+	foreach(SparkleNode* announce, announces)
+		pendingAnnounces[announce->sparkleMAC()].append(node->sparkleMAC());
 
-	_router.updateNode(node);
+	updates.append(_router.getSelfNode());
+	sendRouteBatch(node, updates);
 
 	sendRegisterReply(node);
+
+	if(!node->isMaster()) {
+		homeSlaves.insert(node->sparkleMAC());
+		replicateHomeSlave(node, false);
+	}
+
+	if(promote != NULL)
+		reincarnateSomeone(promote);
+}
+
+/* RegisterRetry */
+
+void LinkLayer::sendRegisterRetry(SparkleNode* node, int delay) {
+	register_retry_t retry;
+	retry.delay = delay;
+
+	sendEncryptedPacket(RegisterRetry, QByteArray((const char*) &retry, sizeof(register_retry_t)), node);
+}
+
+void LinkLayer::handleRegisterRetry(QByteArray &payload, SparkleNode* node) {
+	WireView<register_retry_t> retry(payload);
+	if(!checkPacketSize(retry, node, "RegisterRetry"))
+		return;
+
+	if(!checkPacketExpection(node, "RegisterRetry", JoinRegistration))
+		return;
+
+	if(node != joinMaster) {
+		Log::warn("link: RegisterRetry from [%1]:%2, which is not my master") << *node;
+		return;
+	}
+
+	int delay = qBound<int>(RegisterRetryMin, retry->delay, RegisterRetryMax);
+	delay += qrand() % (delay / 2 + 1);
+
+	Log::info("link: master is busy, retrying registration in %1s") << delay / 1000;
+
+	joinTimer->stop();
+	registerRetryTimer->start(delay);
+}
+
+void LinkLayer::retryRegistration() {
+	Log::debug("link: registering on [%1]:%2") << *joinMaster;
+	sendRegisterRequest(joinMaster, joinBehindNAT);
+
+	joinTimer->start();
 }
 
 /* RegisterReply */
@@ -810,9 +1444,10 @@ void LinkLayer::sendRegisterReply(SparkleNode* node) {
 	register_reply_t reply;
 	reply.isMaster = node->isMaster();
 	reply.networkDivisor = networkDivisor;
+	reply.replicationFactor = replicationFactor;
 	if(node->isBehindNAT()) {
-		reply.realIP = qToBigEndian<quint32>(node->realIP().toIPv4Address());
-		reply.realPort = qToBigEndian<quint16>(node->realPort());
+		reply.realIP = node->realIP().toIPv4Address();
+		reply.realPort = node->realPort();
 	} else {
 		reply.realIP = reply.realPort = 0;
 	}
@@ -824,24 +1459,34 @@ void LinkLayer::sendRegisterReply(SparkleNode* node) {
 }
 
 void LinkLayer::handleRegisterReply(QByteArray &payload, SparkleNode* node) {
-	if(!checkPacketSize(payload, sizeof(register_reply_t), node, "RegisterReply"))
+	WireView<register_reply_t> reply(payload);
+	if(!checkPacketSize(reply, node, "RegisterReply"))
 		return;
 
 	if(!checkPacketExpection(node, "RegisterReply", JoinRegistration))
 		return;
 
-	const register_reply_t* reply = (const register_reply_t*) payload.constData();
+	// admitted from the queue before the hinted retry
+	registerRetryTimer->stop();
 
 	SparkleNode* self;
 	if(reply->realIP != 0) { // i am behind NAT
 		Log::debug("link: external endpoint was assigned by NAT passthrough");
-		self = wrapNode(QHostAddress(qFromBigEndian<quint32>(reply->realIP)), qFromBigEndian<quint16>(reply->realPort));
+		self = wrapNode(QHostAddress(reply->realIP), reply->realPort);
 		self->setBehindNAT(true);
 
-		Log::debug("link: enabling NAT keepalive polling (each %1s)") << natKeepaliveTimer->interval() / 1000;
+		natTimeoutEstimate = NATTimeoutDefault;
+		natTimeoutConfirmed = 0;
+		natTimeoutCeiling = NATTimeoutMax * 2;
+
+		Log::debug("link: enabling NAT keepalive polling (each %1s until binding lifetime is probed)")
+				<< keepaliveInterval(node) / 1000;
 		natKeepaliveTimer->start();
+
+		natProbeTarget = node;
+		natProbeTimer->start(NATProbeInterval);
 	} else {
-		self = wrapNode(QHostAddress(qFromBigEndian<quint32>(joinPing.addr)), qFromBigEndian<quint16>(joinPing.port));
+		self = wrapNode(QHostAddress(joinPing.addr), joinPing.port);
 		self->setBehindNAT(false);
 	}
 	self->setSparkleMAC(reply->sparkleMAC);
@@ -849,35 +1494,60 @@ void LinkLayer::handleRegisterReply(QByteArray &payload, SparkleNode* node) {
 	self->setMaster(reply->isMaster);
 	_router.setSelfNode(self);
 
-	networkDivisor = reply->networkDivisor;
+	networkDivisor = effectiveDivisor = reply->networkDivisor;
 	Log::debug("link: network divisor is 1/%1") << networkDivisor;
 
+	replicationFactor = reply->replicationFactor;
+	if(replicationFactor > 0)
+		Log::debug("link: routes are partitioned, %1 replicas each") << replicationFactor;
+
 	joinTimer->stop();
 
+	homeMaster = node->sparkleMAC();
+
 	joined = true;
 	joinStep = JoinFinished;
+	loadTimer->start();
+	routeDigestTimer->start();
+	linkProbeTimer->start();
+	sessionTimer->start();
+	startPrewarm();
+	if(lanDiscovery) {
+		lanBeaconTimer->start();
+		sendLANBeacon();
+	}
 	emit joinedNetwork(self);
 }
 
 /* Route */
 
+void LinkLayer::fillRoute(route_t* route, SparkleNode* target, bool tunnelRequest) {
+	route->realIP = target->realIP().toIPv4Address();
+	route->realPort = target->realPort();
+	route->isMaster = target->isMaster();
+	route->isBehindNAT = target->isBehindNAT();
+	route->tunnelRequest = tunnelRequest;
+	route->isRemoved = false;
+	route->version = target->routeVersion();
+	route->natType = target->natType();
+	route->natPortDelta = target->natPortDelta();
+	route->lifetime = 0;
+
+	Q_ASSERT(!target->sparkleMAC().isNull());
+	memcpy(route->sparkleMAC, target->sparkleMAC().rawBytes(), SPARKLE_ADDRESS_SIZE);
+}
+
 void LinkLayer::sendRoute(SparkleNode* node, SparkleNode* target, bool tunnelRequest)
 {
-	route_t route;
-	route.realIP = qToBigEndian<quint32>(target->realIP().toIPv4Address());
-	route.realPort = qToBigEndian<quint16>(target->realPort());
-	route.isMaster = target->isMaster();
-	route.isBehindNAT = target->isBehindNAT();
-	route.tunnelRequest = tunnelRequest;
-
-	Q_ASSERT(!node->sparkleMAC().isNull());
-	memcpy(route.sparkleMAC, target->sparkleMAC().rawBytes(), SPARKLE_ADDRESS_SIZE);
+	QByteArray data;
+	fillRoute(wireAppend<route_t>(data), target, tunnelRequest);
 
-	sendEncryptedPacket(Route, QByteArray((const char*) &route, sizeof(route_t)), node);
+	sendEncryptedPacket(Route, data, node);
 }
 
 void LinkLayer::handleRoute(QByteArray &payload, SparkleNode* node) {
-	if(!checkPacketSize(payload, sizeof(route_t), node, "Route"))
+	WireView<route_t> route(payload);
+	if(!checkPacketSize(route, node, "Route"))
 		return;
 
 	if(!node->isMaster() && _router.getSelfNode() != NULL) {
@@ -885,20 +1555,111 @@ void LinkLayer::handleRoute(QByteArray &payload, SparkleNode* node) {
 		return;
 	}
 
-	const route_t* route = (const route_t*) payload.constData();
-
 	Log::debug("link: route received from [%1]:%2") << *node;
 
-	SparkleNode* target = NULL;
-	QHostAddress newIP(qFromBigEndian<quint32>(route->realIP));
-	quint16 newPort = qFromBigEndian<quint16>(route->realPort);
+	applyRoute(route.data());
+}
 
-	foreach(SparkleNode* node, _router.nodes()) {
-		if(node->sparkleMAC() == route->sparkleMAC && !(node->realIP() == newIP && node->realPort() == newPort)) {
-			Log::debug("link: endpoint [%1]:%2 is obsolete in favor of [%3]:%4") << *node << newIP << newPort;
-			target = node;
-		}
-	}
+/* RouteBatch */
+
+void LinkLayer::sendRouteBatch(SparkleNode* node, QList<SparkleNode*> targets) {
+	QByteArray entries;
+	foreach(SparkleNode* target, targets)
+		fillRoute(wireAppend<route_t>(entries), target, false);
+
+	sendRouteEntries(node, entries);
+}
+
+void LinkLayer::sendRouteEntries(SparkleNode* node, QByteArray entries, packet_type_t type) {
+	const int chunkSize = (RouteBatchPayloadMax / sizeof(route_t)) * sizeof(route_t);
+
+	for(int offset = 0; offset < entries.size(); offset += chunkSize)
+		sendEncryptedPacket(type, entries.mid(offset, chunkSize), node);
+}
+
+void LinkLayer::handleRouteBatch(QByteArray &payload, SparkleNode* node) {
+	WireArray<route_t> routes(payload);
+	if(routes.count() == 0) {
+		Log::warn("link: malformed RouteBatch packet from [%1]:%2") << *node;
+		return;
+	}
+
+	if(!node->isMaster() && _router.getSelfNode() != NULL) {
+		Log::warn("link: route batch from unauthoritative source [%1]:%2") << *node;
+		return;
+	}
+
+	Log::debug("link: %3 routes received from [%1]:%2") << *node << routes.count();
+
+	for(int i = 0; i < routes.count(); i++)
+		applyRoute(&routes[i]);
+}
+
+void LinkLayer::applyRoute(const route_t* route) {
+	SparkleAddress mac(route->sparkleMAC);
+	quint32 version = route->version;
+	QHostAddress newIP(route->realIP);
+	quint16 newPort = route->realPort;
+
+	_router.observeRouteVersion(version);
+
+	SparkleNode* existing = _router.findSparkleNode(mac);
+	if(existing != NULL) {
+		bool stale = version < existing->routeVersion();
+
+		// same version with different contents: larger endpoint wins everywhere
+		if(version == existing->routeVersion() && version != 0 && !route->isRemoved) {
+			quint32 newAddr = newIP.toIPv4Address(), oldAddr = existing->realIP().toIPv4Address();
+			stale = newAddr < oldAddr || (newAddr == oldAddr && newPort < existing->realPort());
+		}
+
+		if(stale) {
+			Log::debug("link: ignoring stale route %1 (v%2, have v%3)") << mac.pretty()
+					<< version << existing->routeVersion();
+			return;
+		}
+	} else {
+		quint32 removedAt = _router.tombstoneVersion(mac);
+		if(removedAt != 0 && version <= removedAt) {
+			Log::debug("link: ignoring route %1 (v%2) removed at v%3") << mac.pretty() << version << removedAt;
+			return;
+		}
+	}
+
+	if(route->isRemoved) {
+		if(existing != NULL && existing == _router.getSelfNode()) {
+			Log::info("link: refuting removal of myself (v%1)") << version;
+			existing->setRouteVersion(_router.nextRouteVersion());
+
+			// do not wait for the next digest round; peers may reap us meanwhile
+			if(existing->isMaster()) {
+				foreach(SparkleNode* master, _router.find(Router::Master | Router::ExcludeSelf))
+					sendRoute(master, existing);
+			}
+
+			return;
+		}
+
+		_router.addTombstone(mac, version, qMin<qint64>(route->lifetime, RouteTombstoneLifetime));
+
+		if(existing != NULL) {
+			Log::debug("link: removing route %3 @ [%1]:%2 [reconciled]") << *existing << mac.pretty();
+
+			removeRoute(existing, "reconciled");
+		}
+
+		return;
+	}
+
+	SparkleNode* target = NULL;
+
+	foreach(SparkleNode* node, _router.nodes()) {
+		if(node->sparkleMAC() == route->sparkleMAC && !(node->realIP() == newIP && node->realPort() == newPort)) {
+			Log::debug("link: endpoint [%1]:%2 is obsolete in favor of [%3]:%4") << *node << newIP << newPort;
+			node->countFailure();
+			target = node;
+		}
+	}
 
 	if(target == NULL) {
 		target = wrapNode(newIP, newPort);
@@ -907,11 +1668,19 @@ void LinkLayer::handleRoute(QByteArray &payload, SparkleNode* node) {
 
 	target->setRealIP(newIP);
 	target->setRealPort(newPort);
+	bool becameMaster = route->isMaster && !(target->isMaster() && _router.nodes().contains(target));
+
 	target->setMaster(route->isMaster);
 	target->setBehindNAT(route->isBehindNAT);
+	target->setRouteVersion(version);
+	if(route->natType != SparkleNode::NATUnknown)
+		target->setNATType((SparkleNode::NATType) route->natType, route->natPortDelta);
 
 	_router.updateNode(target);
 
+	if(becameMaster && replicationFactor > 0 && isMaster())
+		announceMaster(target);
+
 	SparkleAddress addr(target->sparkleMAC());
 
 	if(isJoined() && _router.getSelfNode()->isBehindNAT() && target->isBehindNAT() && route->tunnelRequest) {
@@ -923,10 +1692,151 @@ void LinkLayer::handleRoute(QByteArray &payload, SparkleNode* node) {
 	if(queuedData.contains(addr) && queuedData[addr].count() > 0) {
 		Log::debug("link: sending %1 packets in %2 queue") << queuedData[addr].count() << addr.pretty();
 
+		countContact(addr, target);
+
 		foreach(const QByteArray& packet, queuedData[addr])
 			sendEncryptedPacket(DataPacket, packet, target);
 		queuedData.remove(addr); // route is estabilished
 	}
+
+	if(prewarmRoutes.remove(addr) && !target->areKeysNegotiated() && !awaitingNegotiation.contains(target))
+		sendKeepalive(target);
+}
+
+/* RouteDigest */
+
+void LinkLayer::reconcileRoutes() {
+	if(!isMaster())
+		return;
+
+	_router.expireTombstones();
+	rebalanceRoutes();
+	refreshStandby();
+
+	SparkleNode* peer = _router.select(Router::Master | Router::ExcludeSelf);
+	if(peer != NULL)
+		sendRouteDigest(peer, false);
+}
+
+void LinkLayer::sendRouteDigest(SparkleNode* node, bool isReply) {
+	route_digest_t digest;
+	digest.isReply = isReply;
+
+	quint32 hashes[RouteDigestBuckets];
+	_router.computeDigest(hashes, RouteDigestBuckets, node, replicationFactor);
+	for(int i = 0; i < RouteDigestBuckets; i++)
+		digest.hashes[i] = hashes[i];
+
+	sendEncryptedPacket(RouteDigest, QByteArray((const char*) &digest, sizeof(route_digest_t)), node);
+}
+
+void LinkLayer::handleRouteDigest(QByteArray &payload, SparkleNode* node) {
+	WireView<route_digest_t> digest(payload);
+	if(!checkPacketSize(digest, node, "RouteDigest"))
+		return;
+
+	if(!isMaster() || !node->isMaster()) {
+		Log::warn("link: RouteDigest from [%1]:%2 not between masters, dropping") << *node;
+		return;
+	}
+
+	quint32 hashes[RouteDigestBuckets];
+	_router.computeDigest(hashes, RouteDigestBuckets, node, replicationFactor);
+
+	quint64 differing = 0;
+	for(int i = 0; i < RouteDigestBuckets; i++) {
+		if(digest->hashes[i] != hashes[i])
+			differing |= Q_UINT64_C(1) << i;
+	}
+
+	if(differing != 0) {
+		Log::debug("link: route tables of [%1]:%2 differ, reconciling") << *node;
+		sendRouteBuckets(node, differing);
+	}
+
+	// the initiator applies our entries first and then pushes what it still has newer
+	if(!digest->isReply)
+		sendRouteDigest(node, true);
+}
+
+void LinkLayer::sendRouteBuckets(SparkleNode* node, quint64 buckets) {
+	QByteArray entries;
+
+	foreach(SparkleNode* target, _router.nodes()) {
+		if(target->sparkleMAC().isNull() || !_router.isShared(target, node, replicationFactor) ||
+		   !(buckets & (Q_UINT64_C(1) << Router::digestBucket(target->sparkleMAC(), RouteDigestBuckets))))
+			continue;
+
+		fillRoute(wireAppend<route_t>(entries), target, false);
+	}
+
+	QHash<SparkleAddress, quint32> tombstones = _router.tombstones();
+	foreach(SparkleAddress mac, tombstones.keys()) {
+		if(!(buckets & (Q_UINT64_C(1) << Router::digestBucket(mac, RouteDigestBuckets))))
+			continue;
+
+		route_t* route = wireAppend<route_t>(entries);
+		memcpy(route->sparkleMAC, mac.rawBytes(), SPARKLE_ADDRESS_SIZE);
+		route->isRemoved = true;
+		route->version = tombstones[mac];
+		route->lifetime = _router.tombstoneLifetime(mac);
+	}
+
+	if(!entries.isEmpty())
+		sendRouteEntries(node, entries);
+}
+
+/* Partitioned route registry */
+
+SparkleNode* LinkLayer::selectOwner(QByteArray addressPrefix) {
+	QList<SparkleNode*> owners = _router.owners(addressPrefix, replicationFactor);
+	owners.removeOne(_router.getSelfNode());
+
+	if(owners.isEmpty())
+		return NULL;
+
+	return owners[qrand() % owners.count()];
+}
+
+void LinkLayer::announceMaster(SparkleNode* master) {
+	// slaves need every master to find owners of the addresses they look up
+	foreach(SparkleNode* node, _router.find(Router::Slave | Router::ExcludeSelf))
+		sendRoute(node, master);
+
+	rebalanceRoutes();
+}
+
+void LinkLayer::rebalanceRoutes() {
+	if(replicationFactor == 0 || !isMaster())
+		return;
+
+	QHash<SparkleNode*, QList<SparkleNode*> > handoffs;
+	QList<SparkleNode*> foreign;
+
+	foreach(SparkleNode* node, _router.find(Router::Slave | Router::ExcludeSelf)) {
+		QList<SparkleNode*> owners = _router.owners(node->sparkleMAC().bytes(), replicationFactor);
+		if(owners.contains(_router.getSelfNode()))
+			continue;
+
+		foreach(SparkleNode* owner, owners)
+			handoffs[owner].append(node);
+		foreign.append(node);
+	}
+
+	if(foreign.isEmpty())
+		return;
+
+	Log::debug("link: handing %1 routes over to their owners") << foreign.count();
+
+	foreach(SparkleNode* owner, handoffs.keys())
+		sendRouteBatch(owner, handoffs[owner]);
+
+	// node objects stay in the spool, so established sessions are kept
+	foreach(SparkleNode* node, foreign) {
+		// failure detection and NAT keepalives run over routed nodes
+		if(!homeSlaves.contains(node->sparkleMAC()))
+			_router.removeNode(node);
+	}
 }
 
 /* RouteRequest */
@@ -941,7 +1851,17 @@ void LinkLayer::sendRouteRequest(SparkleAddress mac) {
 		return;
 	}
 
-	SparkleNode* master = _router.select(Router::Master);
+	SparkleNode* master;
+	if(replicationFactor > 0) {
+		master = selectOwner(mac.bytes());
+		if(master == NULL)
+			master = _router.getSelfNode();
+	} else {
+		master = _router.findSparkleNode(homeMaster);
+		if(master == NULL || homeMaster.isNull() || !master->isMaster())
+			master = _router.select(Router::Master);
+	}
+
 	if(master == _router.getSelfNode()) {
 		// i'm the one master & i don't know route
 		Log::debug("link: no route to %1") << mac.pretty();
@@ -963,11 +1883,10 @@ void LinkLayer::handleRouteRequest(QByteArray &payload, SparkleNode* node) {
 		return;
 	}
 
-	if(!checkPacketSize(payload, sizeof(route_request_t), node, "RouteRequest"))
+	WireView<route_request_t> req(payload);
+	if(!checkPacketSize(req, node, "RouteRequest"))
 		return;
 
-	const route_request_t* req = (const route_request_t*) payload.constData();
-
 	if(req->length > 6) {
 		Log::warn("link: got malformed extended RouteRequest from [%1]:%2") << *node;
 	} else if(req->length < 6) {
@@ -996,10 +1915,10 @@ void LinkLayer::sendRouteMissing(SparkleNode* node, SparkleAddress mac) {
 }
 
 void LinkLayer::handleRouteMissing(QByteArray &payload, SparkleNode* node) {
-	if(!checkPacketSize(payload, sizeof(route_missing_t), node, "RouteMissing"))
+	WireView<route_missing_t> req(payload);
+	if(!checkPacketSize(req, node, "RouteMissing"))
 		return;
 
-	const route_missing_t* req = (const route_missing_t*) payload.constData();
 	SparkleAddress addr(req->sparkleMAC);
 
 	Log::debug("link: no route to %1") << addr.pretty();
@@ -1017,19 +1936,19 @@ void LinkLayer::handleRouteMissing(QByteArray &payload, SparkleNode* node) {
 
 void LinkLayer::sendRouteInvalidate(SparkleNode* node, SparkleNode* target) {
 	route_invalidate_t inv;
-	inv.realIP = qToBigEndian<quint32>(target->realIP().toIPv4Address());
-	inv.realPort = qToBigEndian<quint16>(target->realPort());
+	inv.realIP = target->realIP().toIPv4Address();
+	inv.realPort = target->realPort();
 
 	sendEncryptedPacket(RouteInvalidate, QByteArray((const char*) &inv, sizeof(route_invalidate_t)), node);
 }
 
 void LinkLayer::handleRouteInvalidate(QByteArray& payload, SparkleNode* node) {
-	if(!checkPacketSize(payload, sizeof(route_invalidate_t), node, "RouteInvalidate"))
+	WireView<route_invalidate_t> inv(payload);
+	if(!checkPacketSize(inv, node, "RouteInvalidate"))
 		return;
 
-	const route_invalidate_t* inv = (const route_invalidate_t*) payload.constData();
-	QHostAddress targetIP(qFromBigEndian<quint32>(inv->realIP));
-	quint16 targetPort = qFromBigEndian<quint16>(inv->realPort);
+	QHostAddress targetIP(inv->realIP);
+	quint16 targetPort = inv->realPort;
 
 	SparkleNode* target = NULL;
 	foreach(SparkleNode* node, _router.find(Router::ExcludeSelf)) {
@@ -1042,12 +1961,14 @@ void LinkLayer::handleRouteInvalidate(QByteArray& payload, SparkleNode* node) {
 	if(target != NULL) {
 		Log::debug("link: invalidating route %5 @ [%1]:%2 because of command from [%3]:%4") << *target << *node << node->sparkleMAC().pretty();
 
-		_router.removeNode(target);
+		SparkleAddress mac = target->sparkleMAC();
+		bool wasMaster = target->isMaster();
 
-		Log::debug("link: removing [%1]:%2 from node spool [iroute]") << *target;
+		_router.addTombstone(mac, _router.nextRouteVersion(), RouteTombstoneLifetime);
+		removeRoute(target, "iroute");
 
-		nodeSpool.removeOne(target);
-		delete target;
+		if(wasMaster && isMaster())
+			adoptSlaves(mac);
 	} else {
 		Log::warn("link: request of invalidating unexistent route [%1]:%2 because of command from [%3]:%4")
 			<< targetIP << targetPort << *node;
@@ -1058,10 +1979,10 @@ void LinkLayer::handleRouteInvalidate(QByteArray& payload, SparkleNode* node) {
 
 void LinkLayer::sendBacklinkRedirect(SparkleNode* node) {
 	backlink_redirect_t redirect;
-	redirect.realIP = qToBigEndian<quint32>(node->realIP().toIPv4Address());
-	redirect.realPort = qToBigEndian<quint16>(node->realPort());
+	redirect.realIP = node->realIP().toIPv4Address();
+	redirect.realPort = node->realPort();
 
-	SparkleNode* targetMaster = _router.select(Router::Master);
+	SparkleNode* targetMaster = _router.selectLeastLoaded(Router::Master);
 	if(targetMaster == NULL) {
 		Log::error("sendBacklinkRedirect: master not found");
 		return;
@@ -1071,7 +1992,8 @@ void LinkLayer::sendBacklinkRedirect(SparkleNode* node) {
 }
 
 void LinkLayer::handleBacklinkRedirect(QByteArray &payload, SparkleNode* node) {
-	if(!checkPacketSize(payload, sizeof(backlink_redirect_t), node, "BacklinkRedirect"))
+	WireView<backlink_redirect_t> redirect(payload);
+	if(!checkPacketSize(redirect, node, "BacklinkRedirect"))
 		return;
 
 	if(!_router.getSelfNode()->isMaster()) {
@@ -1084,9 +2006,7 @@ void LinkLayer::handleBacklinkRedirect(QByteArray &payload, SparkleNode* node) {
 		return;
 	}
 
-	const backlink_redirect_t* redirect = (const backlink_redirect_t*) payload.constData();
-
-	SparkleNode* target = wrapNode(QHostAddress(qFromBigEndian<quint32>(redirect->realIP)), qFromBigEndian<quint16>(redirect->realPort));
+	SparkleNode* target = wrapNode(QHostAddress(redirect->realIP), redirect->realPort);
 
 	if(!_router.nodes().contains(target)) {
 		Log::debug("link: got backlink redirect from [%1]:%2 for non-peered [%1]:%2; probably network error") << *node << *target;
@@ -1103,6 +2023,179 @@ void LinkLayer::handleBacklinkRedirect(QByteArray &payload, SparkleNode* node) {
 	}
 
 	sendRoute(target, node, true);
+
+	// let both ends punch at the same moment, the nearer one waits
+	int nodeRTT = qMax(node->rtt(), 0), targetRTT = qMax(target->rtt(), 0);
+	quint32 nonce = qrand();
+
+	sendPunchRequest(node, target, nonce, qMax(0, (targetRTT - nodeRTT) / 2));
+	sendPunchRequest(target, node, nonce, qMax(0, (nodeRTT - targetRTT) / 2));
+}
+
+/* NAT classification. The master sees the mapping towards itself, and the
+ * bootstrap node reported the mapping towards it a moment before. */
+
+void LinkLayer::classifyNAT(SparkleNode* node, QHostAddress observedIP, quint16 observedPort) {
+	int delta = node->realPort() - observedPort;
+
+	if(observedIP != node->realIP()) {
+		node->setNATType(SparkleNode::NATSymmetric, 0);
+	} else if(delta == 0) {
+		node->setNATType(SparkleNode::NATCone);
+	} else {
+		// huge deltas mean random allocation, which cannot be predicted
+		node->setNATType(SparkleNode::NATSymmetric, qAbs(delta) <= PunchPortDeltaMax ? delta : 0);
+	}
+
+	Log::debug("link: [%1]:%2 is behind %3 NAT (port delta %4)") << *node
+			<< (node->natType() == SparkleNode::NATCone ? "cone" : "symmetric") << node->natPortDelta();
+}
+
+/* PunchRequest */
+
+void LinkLayer::sendPunchRequest(SparkleNode* node, SparkleNode* peer, quint32 nonce, int delay) {
+	punch_request_t req;
+	memcpy(req.sparkleMAC, peer->sparkleMAC().rawBytes(), SPARKLE_ADDRESS_SIZE);
+	req.realIP = peer->realIP().toIPv4Address();
+	req.realPort = peer->realPort();
+	req.natType = peer->natType();
+	req.natPortDelta = peer->natPortDelta();
+	req.nonce = nonce;
+	req.delay = qMin<int>(delay, PunchLinger);
+
+	sendEncryptedPacket(PunchRequest, QByteArray((const char*) &req, sizeof(punch_request_t)), node);
+}
+
+void LinkLayer::handlePunchRequest(QByteArray &payload, SparkleNode* node) {
+	WireView<punch_request_t> req(payload);
+	if(!checkPacketSize(req, node, "PunchRequest"))
+		return;
+
+	if(!node->isMaster()) {
+		Log::warn("link: PunchRequest from slave [%1]:%2, dropping") << *node;
+		return;
+	}
+
+	pending_punch_t punch;
+	punch.peer = SparkleAddress(req->sparkleMAC);
+	punch.host = QHostAddress(req->realIP);
+	punch.port = req->realPort;
+	punch.natType = req->natType;
+	punch.natPortDelta = req->natPortDelta;
+	punch.nonce = req->nonce;
+	punch.attempts = PunchAttempts;
+	punch.due = clock.elapsed() + req->delay;
+
+	for(int i = 0; i < pendingPunches.count(); i++) {
+		if(pendingPunches[i].peer == punch.peer) {
+			pendingPunches.removeAt(i);
+			break;
+		}
+	}
+
+	Log::debug("link: punching through to %1 @ [%2]:%3") << punch.peer.pretty() << punch.host << punch.port;
+
+	pendingPunches.append(punch);
+	sendDuePunches();
+}
+
+void LinkLayer::sendDuePunches() {
+	qint64 now = clock.elapsed(), next = -1;
+
+	for(int i = 0; i < pendingPunches.count(); i++) {
+		pending_punch_t& punch = pendingPunches[i];
+
+		if(punch.due <= now) {
+			if(punch.attempts == 0) {
+				Log::debug("link: no punch from %1 arrived") << punch.peer.pretty();
+				pendingPunches.removeAt(i--);
+				continue;
+			}
+
+			sendPunch(punch.host, punch.port, punch.nonce, false);
+
+			if(punch.natType == SparkleNode::NATSymmetric) {
+				int delta = (punch.natPortDelta != 0) ? punch.natPortDelta : 1;
+				for(int k = 1; k <= PunchPredictionRange; k++) {
+					quint16 port = punch.port + delta * k;
+					if(port != 0)
+						sendPunch(punch.host, port, punch.nonce, false);
+				}
+			}
+
+			punch.attempts--;
+			punch.due = now + (punch.attempts > 0 ? PunchRetryInterval : PunchLinger);
+		}
+
+		if(next < 0 || punch.due < next)
+			next = punch.due;
+	}
+
+	if(next >= 0)
+		punchTimer->start(qMax<qint64>(next - now, 0));
+}
+
+/* Punch */
+
+void LinkLayer::sendPunch(QHostAddress host, quint16 port, quint32 nonce, bool isReply) {
+	punch_t punch;
+	memcpy(punch.sparkleMAC, _router.getSelfNode()->sparkleMAC().rawBytes(), SPARKLE_ADDRESS_SIZE);
+	punch.nonce = nonce;
+	punch.isReply = isReply;
+
+	// predicted endpoints are not nodes, so this bypasses sendPacket()
+	QByteArray data = framePacket(Punch, QByteArray((const char*) &punch, sizeof(punch_t)));
+
+	packetCount++;
+	egress->send(data, host, port);
+}
+
+void LinkLayer::handlePunch(QByteArray &payload, SparkleNode* node) {
+	WireView<punch_t> punch(payload);
+	if(!checkPacketSize(punch, node, "Punch"))
+		return;
+
+	if(!isJoined())
+		return;
+
+	SparkleAddress peer(punch->sparkleMAC);
+	quint32 nonce = punch->nonce;
+
+	int index = -1;
+	for(int i = 0; i < pendingPunches.count(); i++) {
+		if(pendingPunches[i].peer == peer && pendingPunches[i].nonce == nonce)
+			index = i;
+	}
+
+	if(index < 0) {
+		Log::debug("link: unexpected punch from [%1]:%2") << *node;
+		return;
+	}
+
+	pendingPunches.removeAt(index);
+
+	SparkleNode* target = _router.findSparkleNode(peer);
+	if(target == NULL)
+		return;
+
+	if(!punch->isReply)
+		sendPunch(node->realIP(), node->realPort(), nonce, true);
+
+	if(target != node) {
+		Log::info("link: punched through to %1 @ [%2]:%3") << peer.pretty() << *node;
+
+		// packets will go through the mapping which was proven to work
+		target->setPhantomIP(node->realIP());
+		target->setPhantomPort(node->realPort());
+
+		if(!_router.nodes().contains(node) && !node->areKeysNegotiated())
+			forgetNode(node, "punch");
+	} else {
+		Log::info("link: punched through to %1") << peer.pretty();
+	}
+
+	if(!target->areKeysNegotiated() && awaitingNegotiation.contains(target))
+		sendPublicKeyExchange(target, &hostKeyPair, true);
 }
 
 /* RoleUpdate */
@@ -1115,7 +2208,8 @@ void LinkLayer::sendRoleUpdate(SparkleNode* node, bool isMasterNow) {
 }
 
 void LinkLayer::handleRoleUpdate(QByteArray& payload, SparkleNode* node) {
-	if(!checkPacketSize(payload, sizeof(role_update_t), node, "RoleUpdate"))
+	WireView<role_update_t> update(payload);
+	if(!checkPacketSize(update, node, "RoleUpdate"))
 		return;
 
 	if(!node->isMaster()) {
@@ -1123,8 +2217,6 @@ void LinkLayer::handleRoleUpdate(QByteArray& payload, SparkleNode* node) {
 		return;
 	}
 
-	const role_update_t* update = (const role_update_t*) payload.constData();
-
 	Log::info("link: switching to %3 role caused by [%1]:%2") << *node
 		<< (update->isMasterNow ? "Master" : "Slave");
 
@@ -1134,125 +2226,1685 @@ void LinkLayer::handleRoleUpdate(QByteArray& payload, SparkleNode* node) {
 /* Keepalive */
 
 void LinkLayer::sendPlainKeepalive(SparkleNode* node) {
-	sendPacket(KeepalivePacket, QByteArray(), node);
+	keepalive_t keepalive;
+	keepalive.seq = keepalive.timestamp = 0;
+	keepalive.flags = 0;
+
+	sendPacket(KeepalivePacket, QByteArray((const char*) &keepalive, sizeof(keepalive_t)), node);
 }
 
 void LinkLayer::sendKeepalive(SparkleNode* node, bool skipTunnel) {
-	sendEncryptedPacket(KeepalivePacket, QByteArray(), node, skipTunnel);
-}
+	quint32 seq = node->startKeepaliveProbe(LinkProbeLossTimeout);
 
-void LinkLayer::handleKeepalive(QByteArray& payload, SparkleNode* node) {
-	if(!checkPacketSize(payload, 0, node, "Keepalive"))
-		return;
+	keepalive_t keepalive;
+	keepalive.seq = seq;
+	keepalive.timestamp = clock.elapsed();
+	keepalive.flags = (seq != 0) ? KeepaliveProbe : 0;
 
-	// nothing currently
+	QByteArray data((const char*) &keepalive, sizeof(keepalive_t));
+	if(isMaster() && node->isMaster())
+		data.append(takeGossip());
+
+	sendEncryptedPacket(KeepalivePacket, data, node, skipTunnel);
 }
 
-/* ExitNotification */
+void LinkLayer::sendKeepaliveReply(SparkleNode* node, const keepalive_t* probe) {
+	keepalive_t reply;
+	reply.seq = probe->seq;
+	reply.timestamp = probe->timestamp;
+	reply.flags = KeepaliveReply;
 
-void LinkLayer::sendExitNotification(SparkleNode* node) {
-	sendEncryptedPacket(ExitNotification, QByteArray(), node);
+	sendEncryptedPacket(KeepalivePacket, QByteArray((const char*) &reply, sizeof(keepalive_t)), node);
 }
 
-void LinkLayer::handleExitNotification(QByteArray& payload, SparkleNode* node) {
-	if(!checkPacketSize(payload, 0, node, "ExitNotification"))
+/* A plaintext keepalive only refreshes the binding, which handlePacket has
+ * done already. Anyone can send one, so gossip and probe flags are trusted
+ * only when they come encrypted: answering a probe would start negotiation
+ * with any endpoint, and a reply would forge link samples. */
+void LinkLayer::handlePlainKeepalive(QByteArray& payload, SparkleNode* node) {
+	WireView<keepalive_t> keepalive(payload);
+	if(!checkPacketSize(keepalive, node, "Keepalive"))
 		return;
 
-	if(!_router.getSelfNode()->isMaster()) {
-		Log::warn("link: ExitNotification was received from [%1]:%2, but I am slave") << *node;
+	if(keepalive->flags != 0)
+		Log::debug("link: ignoring flags of plaintext keepalive from [%1]:%2") << *node;
+}
+
+void LinkLayer::handleKeepalive(QByteArray& payload, SparkleNode* node) {
+	WireView<keepalive_t> keepalive(payload);
+	WireArray<gossip_t> gossip(payload, sizeof(keepalive_t));
+	if(!keepalive.isValid() || !gossip.isValid()) {
+		Log::warn("link: malformed Keepalive packet from [%1]:%2") << *node;
 		return;
 	}
 
-	_router.removeNode(node);
+	if(gossip.count() > 0 && isMaster() && node->isMaster()) {
+		for(int i = 0; i < gossip.count(); i++)
+			handleGossip(&gossip[i], node);
+	}
 
-	foreach(SparkleNode* target, _router.find(Router::ExcludeSelf))
-		sendRouteInvalidate(target, node);
+	if(keepalive->flags & KeepaliveReply) {
+		// timestamp is ours, so wraparound of the 32-bit clock cancels out
+		quint32 rtt = (quint32) clock.elapsed() - keepalive->timestamp;
+		if(rtt > NATTimeoutMax) {
+			Log::warn("link: keepalive reply from [%1]:%2 with bogus timestamp") << *node;
+			return;
+		}
 
-	Log::debug("link: removing [%1]:%2 from node spool [exit]") << *node;
+		node->finishKeepaliveProbe(keepalive->seq, rtt);
+	} else if(keepalive->flags & KeepaliveProbe) {
+		sendKeepaliveReply(node, keepalive.data());
+	}
+}
 
-	nodeSpool.removeOne(node);
-	delete node;
+/* NATProbe */
 
-	double ik = 1. / networkDivisor;
-	double rk = ((double) _router.count(Router::Master)) / (_router.nodes().count());
-	if(rk < ik || _router.count(Router::Master) == 1) {
-		Log::debug("link: insufficient masters (I %1; R %2)") << ik << rk;
+void LinkLayer::sendNATProbe(SparkleNode* node, quint32 delay) {
+	nat_probe_t probe;
+	probe.delay = delay;
 
-		reincarnateSomeone();
-	}
+	sendEncryptedPacket(NATProbe, QByteArray((const char*) &probe, sizeof(nat_probe_t)), node);
 }
 
-void LinkLayer::reincarnateSomeone() {
-	SparkleNode* target = _router.select(Router::Slave | Router::White);
+void LinkLayer::handleNATProbe(QByteArray &payload, SparkleNode* node) {
+	WireView<nat_probe_t> probe(payload);
+	if(!checkPacketSize(probe, node, "NATProbe"))
+		return;
+
+	pending_nat_probe_t pending;
+	pending.host = node->realIP();
+	pending.port = node->realPort();
+	pending.delay = probe->delay;
+	pending.due = clock.elapsed() + pending.delay;
 
-	if(target == NULL) {
-		Log::warn("link: there're no nodes to reincarnate");
+	if(pending.delay > NATTimeoutMax) {
+		Log::warn("link: NATProbe from [%1]:%2 with too long delay %3") << *node << pending.delay;
+		return;
+	}
+
+	for(int i = 0; i < pendingNATProbes.count(); i++) {
+		if(pendingNATProbes[i].host == pending.host && pendingNATProbes[i].port == pending.port) {
+			pendingNATProbes.removeAt(i);
+			break;
+		}
+	}
+
+	if(pendingNATProbes.count() >= NATProbeMaxPending) {
+		Log::warn("link: too many pending NAT probes, dropping one from [%1]:%2") << *node;
 		return;
 	}
 
-	Log::debug("link: %1 @ [%2]:%3 is selected as target") << target->sparkleMAC().pretty() << *target;
+	int pos = 0;
+	while(pos < pendingNATProbes.count() && pendingNATProbes[pos].due <= pending.due)
+		pos++;
+	pendingNATProbes.insert(pos, pending);
 
-	target->setMaster(true);
+	natProbeReplyTimer->start(qMax<qint64>(0, pendingNATProbes.first().due - clock.elapsed()));
+}
 
-	_router.updateNode(target);
+void LinkLayer::sendDueNATProbeReplies() {
+	qint64 now = clock.elapsed();
 
-	foreach(SparkleNode* node, _router.find(Router::ExcludeSelf)) {
-		if(!node->isMaster() && node != target) {
-			sendRoute(node, target);
-			sendRoute(target, node);
-		}
+	while(!pendingNATProbes.isEmpty() && pendingNATProbes.first().due <= now) {
+		pending_nat_probe_t pending = pendingNATProbes.takeFirst();
+
+		SparkleNode* node = _router.findNode(pending.host, pending.port);
+		if(node != NULL)
+			sendNATProbeReply(node, pending.delay);
 	}
 
-	sendRoleUpdate(target, true);
+	if(!pendingNATProbes.isEmpty())
+		natProbeReplyTimer->start(pendingNATProbes.first().due - now);
 }
 
-/* DataPacket */
+/* NATProbeReply */
 
-void LinkLayer::sendDataPacket(SparkleAddress address, ApplicationLayer::Encapsulation encap, QByteArray &payload) {
-	if(address.isNull()) {
-		Log::debug("link: refusing to send packets<%1> to null MAC.") << encap;
-		return;
-	}
+void LinkLayer::sendNATProbeReply(SparkleNode* node, quint32 delay) {
+	nat_probe_t probe;
+	probe.delay = delay;
 
-	data_packet_t info;
-	info.encapsulation = qToBigEndian<quint16>(encap);
+	sendEncryptedPacket(NATProbeReply, QByteArray((const char*) &probe, sizeof(nat_probe_t)), node);
+}
 
-	QByteArray packet = QByteArray((const char*) &info, sizeof(data_packet_t)).append(payload);
+void LinkLayer::handleNATProbeReply(QByteArray &payload, SparkleNode* node) {
+	WireView<nat_probe_t> probe(payload);
+	if(!checkPacketSize(probe, node, "NATProbeReply"))
+		return;
 
-	SparkleNode* node = _router.findSparkleNode(address);
-	if(node) {
-		sendEncryptedPacket(DataPacket, packet, node);
-	} else {
-		Log::debug("link: queueing data<%2> packet for %1") << address.pretty() << encap;
-		queuedData[address].append(packet);
-		sendRouteRequest(address);
+	if(!natProbeInFlight || node != natProbeTarget || probe->delay != (quint32) natProbeDelay) {
+		Log::debug("link: stale NATProbeReply from [%1]:%2") << *node;
+		return;
 	}
+
+	finishNATProbe(true);
 }
 
-void LinkLayer::handleDataPacket(QByteArray& packet, SparkleNode* node) {
-	if(!checkPacketSize(packet, sizeof(data_packet_t), node, "DataPacket", PacketSizeGreater))
+void LinkLayer::startNATProbe() {
+	if(natProbeTarget == NULL || !_router.nodes().contains(natProbeTarget)) {
+		Log::debug("link: NAT probe target is gone, keeping binding lifetime estimate of %1s")
+				<< natTimeoutEstimate / 1000;
+		natProbeTarget = NULL;
 		return;
+	}
+
+	if(natTimeoutConfirmed == 0)
+		natProbeDelay = qMin<int>(NATTimeoutDefault, natTimeoutCeiling / 2);
+	else if(natTimeoutCeiling > NATTimeoutMax)
+		natProbeDelay = qMin<int>(natTimeoutConfirmed * 2, NATTimeoutMax);
+	else
+		natProbeDelay = (natTimeoutConfirmed + natTimeoutCeiling) / 2;
 
-	const data_packet_t* info = (const data_packet_t*) packet.constData();
+	natProbeDelay = qMax<int>(natProbeDelay, NATTimeoutMin);
 
-	QByteArray payload = packet.right(packet.size() - sizeof(data_packet_t));
+	Log::debug("link: probing NAT binding lifetime of %1s") << natProbeDelay / 1000;
 
-	ApplicationLayer::Encapsulation encap = (ApplicationLayer::Encapsulation) qFromBigEndian<quint16>(info->encapsulation);
+	natProbeInFlight = true;
+	sendNATProbe(natProbeTarget, natProbeDelay);
 
-	if(appLayers.contains(encap)) {
-		appLayers[encap]->handleDataPacket(payload, node->sparkleMAC());
-	} else {
-		Log::warn("link: received packet from [%1]:%2 with unknown encapsulation %3") << *node << encap;
-	}
+	natProbeTimer->start(natProbeDelay + qMax(joinRTT * 2, (int) NATProbeMargin));
 }
 
+void LinkLayer::natProbeTimeout() {
+	if(natProbeInFlight)
+		finishNATProbe(false);
+	else
+		startNATProbe();
+}
 
-/* ======= END ======= */
+void LinkLayer::finishNATProbe(bool arrived) {
+	natProbeInFlight = false;
+	natProbeTimer->stop();
 
-void LinkLayer::cleanup() {
-	Log::debug("link: cleanup");
+	if(!_router.nodes().contains(natProbeTarget)) {
+		natProbeTarget = NULL;
+		return;
+	}
 
-	joined = false;
+	// anything sent to the target during the probe refreshed the binding
+	bool silent = natProbeTarget->msecsSinceSent() >= natProbeDelay;
+
+	if(arrived && silent) {
+		natTimeoutConfirmed = natProbeDelay;
+	} else if(!arrived && silent) {
+		natTimeoutCeiling = natProbeDelay;
+
+		// the binding is most probably gone; reopen it
+		sendKeepalive(natProbeTarget);
+	} else {
+		Log::debug("link: NAT probe is inconclusive, repeating");
+	}
+
+	if(natTimeoutConfirmed > 0)
+		natTimeoutEstimate = natTimeoutConfirmed;
+	else
+		natTimeoutEstimate = qMax<int>(NATTimeoutMin, qMin<int>(NATTimeoutDefault, natTimeoutCeiling / 2));
+
+	if(natTimeoutConfirmed >= NATTimeoutMax || natTimeoutConfirmed == natTimeoutCeiling ||
+			natTimeoutCeiling - natTimeoutConfirmed <= qMax(natTimeoutConfirmed / 8, (int) NATTimeoutMin)) {
+		Log::info("link: NAT binding lifetime is %1s, sending keepalives each %2s")
+				<< natTimeoutEstimate / 1000 << natTimeoutEstimate * 2 / 3 / 1000;
+		return;
+	}
+
+	natProbeTimer->start(NATProbeInterval);
+}
+
+/* LoadAdvertisement */
+
+void LinkLayer::measureLoad() {
+	qint64 now = clock.elapsed();
+	clock_t cpuTime = ::clock();
+
+	quint32 peers = 0;
+	foreach(SparkleNode* node, nodeSpool) {
+		if(node->areKeysNegotiated())
+			peers++;
+	}
+
+	qint64 elapsed = now - loadMeasuredAt;
+	if(elapsed <= 0)
+		elapsed = 1;
+
+	quint32 pps = (qint64) packetCount * 1000 / elapsed;
+	qint64 cpu = ((qint64) (cpuTime - loadCPUTime)) * 1000 / CLOCKS_PER_SEC * 100 / elapsed;
+
+	packetCount = 0;
+	loadMeasuredAt = now;
+	loadCPUTime = cpuTime;
+
+	_router.getSelfNode()->setLoad(peers, pps, qBound<qint64>(0, cpu, 100));
+}
+
+void LinkLayer::advertiseLoad() {
+	if(!isMaster())
+		return;
+
+	measureLoad();
+
+	SparkleNode* self = _router.getSelfNode();
+	Log::debug("link: my load is %1 peers, %2 pps, %3% CPU") << self->loadPeers() << self->loadPPS() << self->loadCPU();
+
+	// only peers which talk to us care about our load
+	foreach(SparkleNode* node, _router.find(Router::ExcludeSelf)) {
+		if(node->areKeysNegotiated())
+			sendLoadAdvertisement(node);
+	}
+
+	adaptNetworkDivisor();
+
+	if(mastersInsufficient(_router.nodes().count()) && isPromotionLeader() && selectPromotionCandidate() != NULL) {
+		Log::debug("link: insufficient masters after divisor change");
+		reincarnateSomeone();
+	}
+}
+
+void LinkLayer::adaptNetworkDivisor() {
+	quint32 total = 0;
+	int known = 0;
+	foreach(SparkleNode* master, _router.find(Router::Master)) {
+		if(master->isLoadKnown()) {
+			total += Router::loadScore(master);
+			known++;
+		}
+	}
+
+	if(known == 0)
+		return;
+
+	quint32 average = total / known;
+
+	int divisor = effectiveDivisor;
+	if(average > ControlLoadHigh)
+		divisor--;
+	else if(average < ControlLoadLow)
+		divisor++;
+
+	divisor = qBound<int>(qMax<int>(NetworkDivisorMin, networkDivisor / 2), divisor,
+				qMin<int>(NetworkDivisorMax, networkDivisor * 2));
+
+	if(divisor != effectiveDivisor) {
+		Log::info("link: average master load is %1, network divisor is now 1/%2") << average << divisor;
+		effectiveDivisor = divisor;
+	}
+}
+
+bool LinkLayer::mastersInsufficient(int nodeCount) {
+	if(nodeCount == 0)
+		return false;
+
+	double ik = 1. / effectiveDivisor;
+	double rk = ((double) _router.count(Router::Master)) / nodeCount;
+
+	if(rk < ik) {
+		Log::debug("link: insufficient masters (I %1; R %2)") << ik << rk;
+		return true;
+	}
+
+	return false;
+}
+
+int LinkLayer::promotionScore(SparkleNode* node) {
+	// an hour of uptime, each failure, core and 20ms of RTT are weighted alike
+	int score = qMin<qint64>(node->msecsKnown() / 60000, 60);
+	score -= qMin<quint32>(node->failures(), 10) * 10;
+	score += qMin<int>(node->cpuCount(), 16);
+	if(node->rtt() >= 0)
+		score -= qMin(node->rtt() / 20, 50);
+
+	return score;
+}
+
+SparkleNode* LinkLayer::selectPromotionCandidate() {
+	SparkleNode* best = NULL;
+	int bestScore = 0;
+
+	foreach(SparkleNode* node, _router.find(Router::Slave | Router::White)) {
+		int score = promotionScore(node);
+		if(best == NULL || score > bestScore) {
+			best = node;
+			bestScore = score;
+		}
+	}
+
+	return best;
+}
+
+bool LinkLayer::isPromotionLeader() {
+	// the master with the lowest address promotes, so that others won't race it
+	QByteArray self = _router.getSelfNode()->sparkleMAC().bytes();
+
+	foreach(SparkleNode* master, _router.find(Router::Master | Router::ExcludeSelf)) {
+		if(master->sparkleMAC().bytes() < self)
+			return false;
+	}
+
+	return true;
+}
+
+void LinkLayer::sendLoadAdvertisement(SparkleNode* node) {
+	SparkleNode* self = _router.getSelfNode();
+
+	load_advertisement_t load;
+	load.peers = self->loadPeers();
+	load.pps = self->loadPPS();
+	load.cpu = self->loadCPU();
+
+	sendEncryptedPacket(LoadAdvertisement, QByteArray((const char*) &load, sizeof(load_advertisement_t)), node);
+}
+
+void LinkLayer::handleLoadAdvertisement(QByteArray &payload, SparkleNode* node) {
+	WireView<load_advertisement_t> load(payload);
+	if(!checkPacketSize(load, node, "LoadAdvertisement"))
+		return;
+
+	if(!node->isMaster()) {
+		Log::warn("link: LoadAdvertisement from slave [%1]:%2, dropping") << *node;
+		return;
+	}
+
+	node->setLoad(load->peers, load->pps, load->cpu);
+}
+
+/* ExitNotification */
+
+void LinkLayer::sendExitNotification(SparkleNode* node) {
+	sendEncryptedPacket(ExitNotification, QByteArray(), node);
+}
+
+void LinkLayer::handleExitNotification(QByteArray& payload, SparkleNode* node) {
+	if(!checkPacketSize(payload, 0, node, "ExitNotification"))
+		return;
+
+	if(!_router.getSelfNode()->isMaster()) {
+		Log::warn("link: ExitNotification was received from [%1]:%2, but I am slave") << *node;
+		return;
+	}
+
+	SparkleAddress mac = node->sparkleMAC();
+	bool wasMaster = node->isMaster();
+
+	_router.addTombstone(mac, _router.nextRouteVersion(), RouteTombstoneLifetime);
+	_router.removeNode(node);
+
+	foreach(SparkleNode* target, _router.find(Router::ExcludeSelf))
+		sendRouteInvalidate(target, node);
+
+	removeRoute(node, "exit");
+
+	if(wasMaster)
+		adoptSlaves(mac);
+
+	if(_router.count(Router::Master) == 1 || mastersInsufficient(_router.nodes().count()))
+		reincarnateSomeone();
+}
+
+void LinkLayer::reincarnateSomeone(SparkleNode* target) {
+	if(target == NULL)
+		target = selectPromotionCandidate();
+
+	if(target == NULL) {
+		Log::warn("link: there're no nodes to reincarnate");
+		return;
+	}
+
+	Log::debug("link: %1 @ [%2]:%3 is selected as target (score %4)") << target->sparkleMAC().pretty() << *target
+			<< promotionScore(target);
+
+	target->setMaster(true);
+	target->setRouteVersion(_router.nextRouteVersion());
+
+	_router.updateNode(target);
+
+	QList<SparkleNode*> slaves;
+	foreach(SparkleNode* node, _router.find(Router::ExcludeSelf)) {
+		if(!node->isMaster() && node != target) {
+			sendRoute(node, target);
+			slaves.append(node);
+		}
+	}
+
+	if(!slaves.isEmpty())
+		sendRouteBatch(target, slaves);
+
+	sendRoleUpdate(target, true);
+}
+
+/* DataPacket */
+
+void LinkLayer::sendDataPacket(SparkleAddress address, ApplicationLayer::Encapsulation encap, QByteArray &payload) {
+	if(address.isNull()) {
+		Log::debug("link: refusing to send packets<%1> to null MAC.") << encap;
+		return;
+	}
+
+	QByteArray packet;
+	packet.reserve(sizeof(data_packet_t) + payload.size());
+
+	data_packet_t* info = wireAppend<data_packet_t>(packet);
+	info->encapsulation = encap;
+	info->flags = 0;
+
+	packet.append(payload);
+
+	SparkleNode* node = _router.findSparkleNode(address);
+	countContact(address, node);
+
+	if(node) {
+		if(relays.contains(address)) {
+			if(!node->areKeysNegotiated()) {
+				sendRelayedDataPacket(node, packet);
+				return;
+			}
+
+			Log::info("link: direct link to %1 is up, leaving relay") << address.pretty();
+			relays.remove(address);
+		}
+
+		if(node->areKeysNegotiated()) {
+			compressDataPacket(packet, node);
+
+			if(parityGroupSize(node) > 0) {
+				sendProtectedDataPacket(packet, node);
+				return;
+			}
+		}
+
+		sendEncryptedPacket(DataPacket, packet, node);
+	} else {
+		Log::debug("link: queueing data<%2> packet for %1") << address.pretty() << encap;
+		queuedData[address].append(packet);
+		sendRouteRequest(address);
+	}
+}
+
+void LinkLayer::handleDataPacket(QByteArray& packet, SparkleNode* node) {
+	if(!checkPacketSize(packet, sizeof(data_packet_t), node, "DataPacket", PacketSizeGreater))
+		return;
+
+	deliverDataPacket(packet, node->sparkleMAC(), node);
+}
+
+void LinkLayer::deliverDataPacket(QByteArray& packet, SparkleAddress source, SparkleNode* node) {
+	WireView<data_packet_t> info(packet);
+	if(!info.isValid())
+		return;
+
+	QByteArray payload = info.tail();
+
+	if(info->flags & DataCompressed) {
+		QByteArray compressed = payload;
+
+		if(!Compressor::decompress(compressed, payload)) {
+			Log::warn("link: received malformed compressed packet from [%1]:%2") << *node;
+			return;
+		}
+	}
+
+	ApplicationLayer::Encapsulation encap = (ApplicationLayer::Encapsulation) (quint16) info->encapsulation;
+
+	if(!appLayers.contains(encap)) {
+		Log::warn("link: received packet from [%1]:%2 with unknown encapsulation %3") << *node << encap;
+		return;
+	}
+
+	if(!receivingBatch) {
+		appLayers[encap]->handleDataPacket(payload, source);
+		return;
+	}
+
+	ApplicationLayer::DataPacket delivery;
+	delivery.payload = payload;
+	delivery.source = source;
+	pendingDeliveries[encap].append(delivery);
+
+	if(++pendingDeliveryCount >= DeliveryBatchMax)
+		flushDeliveries();
+}
+
+void LinkLayer::flushDeliveries() {
+	if(pendingDeliveryCount == 0)
+		return;
+
+	// layers may send in reply, so the batch is detached first
+	QHash<ApplicationLayer::Encapsulation, QVector<ApplicationLayer::DataPacket> > batch = pendingDeliveries;
+	pendingDeliveries.clear();
+	pendingDeliveryCount = 0;
+
+	foreach(ApplicationLayer::Encapsulation encap, batch.keys()) {
+		QVector<ApplicationLayer::DataPacket> &packets = batch[encap];
+		appLayers[encap]->handleDataPackets(packets.data(), packets.size());
+	}
+}
+
+/* Compression is used only when the peer announced it can decompress, and
+ * is backed off per peer while the traffic does not shrink. */
+void LinkLayer::compressDataPacket(QByteArray &packet, SparkleNode* node) {
+	if(!compression || !(node->features() & FeatureCompression))
+		return;
+
+	int size = packet.size() - sizeof(data_packet_t);
+	if(size < CompressMinSize || !node->shouldCompress())
+		return;
+
+	QByteArray compressed;
+	bool shrunk = Compressor::compress(packet.mid(sizeof(data_packet_t)), compressed);
+
+	node->countCompression(size, shrunk ? compressed.size() : size);
+
+	if(!shrunk)
+		return;
+
+	data_packet_t info = *WireView<data_packet_t>(packet).data();
+	info.flags |= DataCompressed;
+
+	packet.clear();
+	*wireAppend<data_packet_t>(packet) = info;
+	packet.append(compressed);
+}
+
+/* FECDataPacket, FECParityPacket */
+
+int LinkLayer::parityGroupSize(SparkleNode* node) {
+	if(!fec || !(node->features() & FeatureFEC))
+		return 0;
+
+	int loss = (int) (node->lossRate() * 1000);
+	if(loss < FECLossThreshold)
+		return 0;
+
+	return qBound<int>(FECGroupMin, FECGroupLoss / loss, FECGroupMax);
+}
+
+void LinkLayer::sendProtectedDataPacket(QByteArray packet, SparkleNode* node) {
+	ParityEncoder* encoder = node->parityEncoder();
+
+	fec_data_t info;
+	info.group = encoder->group();
+	info.index = encoder->add(packet);
+
+	sendEncryptedPacket(FECDataPacket, packet.prepend(QByteArray((const char*) &info, sizeof(fec_data_t))), node);
+
+	if(encoder->count() >= parityGroupSize(node))
+		sendParityPacket(node);
+	else if(!parityTimer->isActive())
+		parityTimer->start();
+}
+
+void LinkLayer::handleFECDataPacket(QByteArray &payload, SparkleNode* node) {
+	WireView<fec_data_t> info(payload);
+	if(!checkPacketSize(WireView<data_packet_t>(payload, sizeof(fec_data_t)), node, "FECDataPacket", PacketSizeGreater))
+		return;
+
+	QByteArray packet = info.tail(), recovered;
+
+	if(!node->parityDecoder()->add(info->group, info->index, packet, recovered))
+		return;
+
+	deliverDataPacket(packet, node->sparkleMAC(), node);
+
+	if(recovered.size() >= (int) sizeof(data_packet_t)) {
+		Log::debug("link: recovered lost packet from [%1]:%2") << *node;
+		deliverDataPacket(recovered, node->sparkleMAC(), node);
+	}
+}
+
+void LinkLayer::sendParityPacket(SparkleNode* node) {
+	ParityEncoder* encoder = node->parityEncoder();
+
+	fec_parity_t info;
+	info.group = encoder->group();
+	info.count = encoder->count();
+
+	quint16 lengths;
+	QByteArray parity = encoder->finish(lengths);
+	info.lengths = lengths;
+
+	sendEncryptedPacket(FECParityPacket, parity.prepend(QByteArray((const char*) &info, sizeof(fec_parity_t))), node);
+}
+
+void LinkLayer::handleFECParityPacket(QByteArray &payload, SparkleNode* node) {
+	WireView<fec_parity_t> info(payload);
+	if(!checkPacketSize(info, node, "FECParityPacket", PacketSizeGreater))
+		return;
+
+	QByteArray recovered;
+
+	if(!node->parityDecoder()->addParity(info->group, info->count,
+			info->lengths, info.tail(), recovered))
+		return;
+
+	if(recovered.size() >= (int) sizeof(data_packet_t)) {
+		Log::debug("link: recovered lost packet from [%1]:%2") << *node;
+		deliverDataPacket(recovered, node->sparkleMAC(), node);
+	}
+}
+
+/* closes groups that were left unfinished when traffic paused */
+void LinkLayer::flushParity() {
+	foreach(SparkleNode* node, _router.nodes()) {
+		if(node->areKeysNegotiated() && node->parityEncoder()->count() > 0)
+			sendParityPacket(node);
+	}
+}
+
+/* RelayedDataPacket */
+
+/* Relays are white nodes we already talk to, cheapest by measured RTT
+ * first. The relay-to-target leg is not known here and is not counted. */
+SparkleNode* LinkLayer::selectRelay(SparkleNode* target) {
+	SparkleNode* best = NULL;
+	qreal bestCost = 0;
+
+	foreach(SparkleNode* node, _router.find(Router::White | Router::ExcludeSelf)) {
+		if(node == target || !node->areKeysNegotiated() || node->rtt() < 0)
+			continue;
+
+		qreal cost = (node->rtt() + 2 * node->rttVariance()) * (1 + 4 * node->lossRate());
+		if(best == NULL || cost < bestCost) {
+			best = node;
+			bestCost = cost;
+		}
+	}
+
+	if(best == NULL)
+		best = _router.selectLeastLoaded(Router::Master | Router::ExcludeSelf);
+
+	return best;
+}
+
+void LinkLayer::sendRelayedDataPacket(SparkleNode* target, QByteArray packet) {
+	SparkleAddress address = target->sparkleMAC();
+	relay_t& route = relays[address];
+
+	SparkleNode* relay = _router.findSparkleNode(route.relay);
+	if(relay == NULL || relay == target) {
+		relay = selectRelay(target);
+		if(relay == NULL) {
+			Log::warn("link: no relay for %1 is available, dropping packet") << address.pretty();
+			relays.remove(address);
+			return;
+		}
+
+		route.relay = relay->sparkleMAC();
+	}
+
+	// keep trying to punch through, so that the relay is left as soon as possible
+	if(route.lastUpgrade.elapsed() > RelayUpgradeInterval && !awaitingNegotiation.contains(target)) {
+		route.lastUpgrade.start();
+		sendKeepalive(target);
+	}
+
+	relayed_data_packet_t relayed;
+	memcpy(relayed.destination, address.rawBytes(), SPARKLE_ADDRESS_SIZE);
+	memcpy(relayed.source, _router.getSelfNode()->sparkleMAC().rawBytes(), SPARKLE_ADDRESS_SIZE);
+	relayed.hops = 0;
+
+	packet.prepend(QByteArray((const char*) &relayed, sizeof(relayed_data_packet_t)));
+
+	sendEncryptedPacket(RelayedDataPacket, packet, relay);
+}
+
+void LinkLayer::handleRelayedDataPacket(QByteArray& payload, SparkleNode* node) {
+	WireView<relayed_data_packet_t> relayed(payload);
+	if(!checkPacketSize(WireView<data_packet_t>(payload, sizeof(relayed_data_packet_t)), node,
+				"RelayedDataPacket", PacketSizeGreater))
+		return;
+
+	SparkleAddress destination(relayed->destination), source(relayed->source);
+
+	if(destination == _router.getSelfNode()->sparkleMAC()) {
+		if(relayed->hops != 1) {
+			Log::warn("link: RelayedDataPacket from [%1]:%2 was not relayed") << *node;
+			return;
+		}
+
+		/* The source is only claimed by the relay, so it is believed only from
+		 * the relay already used for that node, or from a master. The first
+		 * relay is adopted only while the node is unreachable directly. */
+		SparkleNode* peer = _router.findSparkleNode(source);
+		if(relays.contains(source)) {
+			if(relays[source].relay != node->sparkleMAC() && !node->isMaster()) {
+				Log::warn("link: [%1]:%2 is not the relay for %3, dropping RelayedDataPacket")
+						<< *node << source.pretty();
+				return;
+			}
+		} else if(peer != NULL && !peer->areKeysNegotiated()) {
+			// the reverse path is most likely broken too
+			Log::info("link: %1 talks to me through [%2]:%3, answering the same way") << source.pretty() << *node;
+
+			relays[source].relay = node->sparkleMAC();
+			relays[source].lastUpgrade.start();
+		} else if(!node->isMaster()) {
+			Log::warn("link: unexpected RelayedDataPacket for %3 from [%1]:%2") << *node << source.pretty();
+			return;
+		}
+
+		QByteArray packet = relayed.tail();
+		deliverDataPacket(packet, source, node);
+	} else {
+		if(_router.getSelfNode()->isBehindNAT() || relayed->hops != 0) {
+			Log::warn("link: refusing to relay packet from [%1]:%2") << *node;
+			return;
+		}
+
+		SparkleNode* target = _router.findSparkleNode(destination);
+		if(target == NULL || target == node) {
+			sendRouteMissing(node, destination);
+			return;
+		}
+
+		// the source is whoever has sent it to us, not what it claims
+		QByteArray packet;
+		relayed_data_packet_t* forward = wireAppend<relayed_data_packet_t>(packet);
+		memcpy(forward->destination, relayed->destination, SPARKLE_ADDRESS_SIZE);
+		memcpy(forward->source, node->sparkleMAC().rawBytes(), SPARKLE_ADDRESS_SIZE);
+		forward->hops = 1;
+		packet.append(relayed.tail());
+
+		sendEncryptedPacket(RelayedDataPacket, packet, target, true);
+	}
+}
+
+/* LANBeacon */
+
+void LinkLayer::setCompressionEnabled(bool enabled) {
+	compression = enabled;
+}
+
+void LinkLayer::setFECEnabled(bool enabled) {
+	fec = enabled;
+}
+
+void LinkLayer::setLANDiscoveryEnabled(bool enabled) {
+	lanDiscovery = enabled;
+
+	if(!enabled)
+		lanBeaconTimer->stop();
+	else if(isJoined())
+		lanBeaconTimer->start();
+}
+
+void LinkLayer::sendLANBeacon() {
+	QByteArray key = hostKeyPair.publicKey();
+
+	lan_beacon_t beacon;
+	memcpy(beacon.sparkleMAC, _router.getSelfNode()->sparkleMAC().rawBytes(), SPARKLE_ADDRESS_SIZE);
+	beacon.port = transport.port();
+	beacon.keyLength = key.size();
+
+	lanChallengesAnswered = 0;
+	for(int i = 0; i < pendingLANChallenges.count(); i++) {
+		if(clock.elapsed() - pendingLANChallenges[i].sent > LANChallengeTimeout)
+			pendingLANChallenges.removeAt(i--);
+	}
+
+	QByteArray data = QByteArray((const char*) &beacon, sizeof(lan_beacon_t)).append(key);
+	data.append(hostKeyPair.sign(data));
+	data = framePacket(LANBeacon, data);
+
+	egress->send(data, QHostAddress::Broadcast, transport.port());
+	if(transport.port() != LANBeaconPort)
+		egress->send(data, QHostAddress::Broadcast, LANBeaconPort);
+}
+
+void LinkLayer::handleLANBeacon(QByteArray &payload, SparkleNode* node) {
+	WireView<lan_beacon_t> beacon(payload);
+	if(!checkPacketSize(beacon, node, "LANBeacon", PacketSizeGreater))
+		return;
+
+	if(!isJoined() || !lanDiscovery)
+		return;
+
+	SparkleAddress mac(beacon->sparkleMAC);
+
+	SparkleNode* target = _router.findSparkleNode(mac);
+
+	// only routed peers are interesting, and verifying costs an RSA operation
+	if(target != NULL && target != _router.getSelfNode() && target != node) {
+		quint16 keyLength = beacon->keyLength;
+		int signedLength = sizeof(lan_beacon_t) + keyLength;
+
+		QByteArray keyData = payload.mid(sizeof(lan_beacon_t), keyLength);
+
+		RSAKeyPair key;
+		if(payload.size() <= signedLength || !key.setPublicKey(keyData)) {
+			Log::warn("link: malformed LANBeacon from [%1]:%2") << *node;
+		} else if(SparkleNode::addressFromKey(&key) != mac ||
+				!key.verify(payload.left(signedLength), payload.mid(signedLength))) {
+			Log::warn("link: LANBeacon from [%1]:%2 has bad signature") << *node;
+		} else if(beacon->port != node->realPort()) {
+			Log::warn("link: LANBeacon from [%1]:%2 advertises port %3") << *node << (quint16) beacon->port;
+		} else if(target->phantomIP() != node->realIP() || target->phantomPort() != node->realPort()) {
+			sendLANChallenge(mac, keyData, node->realIP(), node->realPort());
+		}
+	}
+
+	// the beacon endpoint is now reached through the peer itself
+	if(node != target)
+		releaseSpooledNode(node, "beacon");
+}
+
+void LinkLayer::sendLANChallenge(SparkleAddress mac, QByteArray key, QHostAddress host, quint16 port) {
+	pending_lan_challenge_t pending;
+	pending.peer = mac;
+	pending.key = key;
+	pending.host = host;
+	pending.port = port;
+	pending.nonce = (quint32) SparkleRandom::integer();
+	pending.sent = clock.elapsed();
+
+	for(int i = 0; i < pendingLANChallenges.count(); i++) {
+		if(pendingLANChallenges[i].peer == mac) {
+			pendingLANChallenges.removeAt(i);
+			break;
+		}
+	}
+
+	pendingLANChallenges.append(pending);
+
+	lan_challenge_t challenge;
+	memcpy(challenge.sparkleMAC, mac.rawBytes(), SPARKLE_ADDRESS_SIZE);
+	challenge.nonce = pending.nonce;
+
+	// the candidate endpoint is not a node yet, so this bypasses sendPacket()
+	QByteArray data = framePacket(LANChallenge, QByteArray((const char*) &challenge, sizeof(lan_challenge_t)));
+
+	packetCount++;
+	egress->send(data, host, port);
+}
+
+void LinkLayer::handleLANChallenge(QByteArray &payload, SparkleNode* node) {
+	WireView<lan_challenge_t> challenge(payload);
+	if(!checkPacketSize(challenge, node, "LANChallenge"))
+		return;
+
+	if(isJoined() && lanDiscovery && SparkleAddress(challenge->sparkleMAC) == _router.getSelfNode()->sparkleMAC()) {
+		// every answer costs an RSA operation
+		if(lanChallengesAnswered < LANChallengeAnswers) {
+			lanChallengesAnswered++;
+
+			QByteArray data = payload;
+			data.append(hostKeyPair.sign(data));
+			data = framePacket(LANChallengeReply, data);
+
+			packetCount++;
+			egress->send(data, node->realIP(), node->realPort());
+		} else {
+			Log::debug("link: too many LANChallenges, ignoring one from [%1]:%2") << *node;
+		}
+	}
+
+	releaseSpooledNode(node, "challenge");
+}
+
+void LinkLayer::handleLANChallengeReply(QByteArray &payload, SparkleNode* node) {
+	WireView<lan_challenge_t> reply(payload);
+	if(!checkPacketSize(reply, node, "LANChallengeReply", PacketSizeGreater))
+		return;
+
+	SparkleAddress mac(reply->sparkleMAC);
+	quint32 nonce = reply->nonce;
+
+	int index = -1;
+	for(int i = 0; i < pendingLANChallenges.count(); i++) {
+		const pending_lan_challenge_t& pending = pendingLANChallenges[i];
+		if(pending.peer == mac && pending.nonce == nonce &&
+				pending.host == node->realIP() && pending.port == node->realPort()) {
+			index = i;
+			break;
+		}
+	}
+
+	if(index == -1) {
+		Log::debug("link: unexpected LANChallengeReply from [%1]:%2") << *node;
+	} else {
+		pending_lan_challenge_t pending = pendingLANChallenges.takeAt(index);
+
+		RSAKeyPair key;
+		SparkleNode* target = _router.findSparkleNode(mac);
+
+		if(clock.elapsed() - pending.sent > LANChallengeTimeout) {
+			Log::debug("link: late LANChallengeReply from [%1]:%2") << *node;
+		} else if(!key.setPublicKey(pending.key) ||
+				!key.verify(payload.left(sizeof(lan_challenge_t)), reply.tail())) {
+			Log::warn("link: LANChallengeReply from [%1]:%2 has bad signature") << *node;
+		} else if(target != NULL && target != node) {
+			Log::info("link: %1 is on local network at [%2]:%3") << mac.pretty() << *node;
+
+			target->setPhantomIP(node->realIP());
+			target->setPhantomPort(node->realPort());
+		}
+	}
+
+	releaseSpooledNode(node, "challenge");
+}
+
+/* Nodes are spooled for every endpoint a packet arrives from; those only
+ * announcing themselves are dropped at once. */
+void LinkLayer::releaseSpooledNode(SparkleNode* node, const char* reason) {
+	if(_router.nodes().contains(node) || node->areKeysNegotiated() ||
+			awaitingNegotiation.contains(node))
+		return;
+
+	forgetNode(node, reason);
+}
+
+/* Deletes a node object along with the references to it by pointer, so
+ * that no cookie or probe outlives it. */
+void LinkLayer::forgetNode(SparkleNode* node, const char* reason) {
+	Log::debug("link: removing [%1]:%2 from node spool [%3]") << *node << reason;
+
+	foreach(quint32 cookie, cookies.keys(node))
+		cookies.remove(cookie);
+
+	if(natProbeTarget == node)
+		natProbeTarget = NULL;
+
+	awaitingNegotiation.removeOne(node);
+	nodeSpool.removeOne(node);
+	delete node;
+}
+
+/* Drops a route together with the state kept for its address, then the
+ * node itself. Tombstones and notifications are left to the caller. */
+void LinkLayer::removeRoute(SparkleNode* node, const char* reason) {
+	SparkleAddress mac = node->sparkleMAC();
+
+	_router.removeNode(node);
+
+	suspects.remove(mac);
+	vouches.remove(mac);
+	queuedData.remove(mac);
+
+	foreach(SparkleAddress address, relays.keys()) {
+		if(address == mac || relays[address].relay == mac)
+			relays.remove(address);
+	}
+
+	forgetHomeSlave(node);
+
+	forgetNode(node, reason);
+}
+
+/* Failure detection */
+
+qint64 LinkLayer::failureSilence(SparkleNode* node) {
+	qint64 silence = node->msecsSinceReceived();
+	if(silence < 0)
+		silence = node->msecsKnown();
+
+	if(vouches.contains(node->sparkleMAC()))
+		silence = qMin(silence, clock.elapsed() - vouches[node->sparkleMAC()]);
+
+	return silence;
+}
+
+void LinkLayer::detectFailures() {
+	qint64 now = clock.elapsed();
+
+	foreach(SparkleNode* node, _router.find(Router::ExcludeSelf)) {
+		// only peers we have a session with can be probed at all
+		if(!node->areKeysNegotiated())
+			continue;
+
+		SparkleAddress mac = node->sparkleMAC();
+		qint64 silence = failureSilence(node);
+
+		if(suspects.contains(mac)) {
+			qint64 suspected = now - suspects[mac];
+
+			if(silence < suspected) {
+				Log::info("link: %1 @ [%2]:%3 is alive again") << mac.pretty() << *node;
+
+				suspects.remove(mac);
+				queueGossip(mac, GossipAlive);
+			} else if(suspected > FailureSuspicionTimeout) {
+				reap(node);
+			}
+		} else if(silence > FailureSilenceTimeout) {
+			suspect(node);
+		} else if(vouches.contains(mac) && node->msecsSinceReceived() >= 0 &&
+				node->msecsSinceReceived() < now - vouches[mac]) {
+			vouches.remove(mac);
+		}
+	}
+
+	for(int i = 0; i < pendingIndirectProbes.count(); ) {
+		if(now - pendingIndirectProbes[i].since > FailureSuspicionTimeout)
+			pendingIndirectProbes.removeAt(i);
+		else
+			i++;
+	}
+}
+
+void LinkLayer::suspect(SparkleNode* node) {
+	Log::info("link: %1 @ [%2]:%3 is silent for %4s, suspecting it")
+			<< node->sparkleMAC().pretty() << *node << (int) (failureSilence(node) / 1000);
+
+	suspects[node->sparkleMAC()] = clock.elapsed();
+	queueGossip(node->sparkleMAC(), GossipSuspect);
+
+	QList<SparkleNode*> helpers;
+	foreach(SparkleNode* master, _router.find(Router::Master | Router::ExcludeSelf)) {
+		if(master != node && master->areKeysNegotiated())
+			helpers.append(master);
+	}
+
+	for(int i = 0; i < FailureIndirectProbes && !helpers.isEmpty(); i++)
+		sendIndirectProbe(helpers.takeAt(qrand() % helpers.count()), node);
+}
+
+void LinkLayer::refute(SparkleAddress mac) {
+	vouches[mac] = clock.elapsed();
+
+	if(suspects.remove(mac) > 0) {
+		Log::info("link: %1 is vouched for, suspicion is lifted") << mac.pretty();
+
+		queueGossip(mac, GossipAlive);
+	}
+}
+
+void LinkLayer::reap(SparkleNode* node) {
+	SparkleAddress mac = node->sparkleMAC();
+	bool wasMaster = node->isMaster();
+
+	Log::info("link: %1 @ [%2]:%3 did not answer for %4s, reaping it")
+			<< mac.pretty() << *node << (int) (failureSilence(node) / 1000);
+
+	_router.addTombstone(mac, _router.nextRouteVersion(), RouteTombstoneLifetime);
+	_router.removeNode(node);
+
+	foreach(SparkleNode* target, _router.find(Router::ExcludeSelf))
+		sendRouteInvalidate(target, node);
+
+	removeRoute(node, "dead");
+
+	if(wasMaster)
+		adoptSlaves(mac);
+
+	if(wasMaster && (_router.count(Router::Master) == 1 || mastersInsufficient(_router.nodes().count())))
+		reincarnateSomeone();
+}
+
+void LinkLayer::queueGossip(SparkleAddress mac, gossip_state_t state) {
+	for(int i = 0; i < pendingGossip.count(); i++) {
+		if(pendingGossip[i].node == mac) {
+			pendingGossip.removeAt(i);
+			break;
+		}
+	}
+
+	// every master gets a keepalive each probe round
+	pending_gossip_t gossip;
+	gossip.node = mac;
+	gossip.state = state;
+	gossip.transmissions = _router.count(Router::Master) - 1;
+
+	if(gossip.transmissions > 0)
+		pendingGossip.append(gossip);
+}
+
+QByteArray LinkLayer::takeGossip() {
+	QByteArray data;
+
+	for(int i = 0; i < pendingGossip.count() && i < FailureGossipMax; ) {
+		gossip_t* gossip = wireAppend<gossip_t>(data);
+		memcpy(gossip->sparkleMAC, pendingGossip[i].node.rawBytes(), SPARKLE_ADDRESS_SIZE);
+		gossip->state = pendingGossip[i].state;
+
+		if(--pendingGossip[i].transmissions == 0)
+			pendingGossip.removeAt(i);
+		else
+			i++;
+	}
+
+	return data;
+}
+
+void LinkLayer::handleGossip(const gossip_t* gossip, SparkleNode* node) {
+	SparkleAddress mac(gossip->sparkleMAC);
+	SparkleNode* target = _router.findSparkleNode(mac);
+
+	if(target == NULL || target == _router.getSelfNode())
+		return;
+
+	if(gossip->state == GossipAlive) {
+		if(suspects.contains(mac))
+			Log::debug("link: [%1]:%2 says %3 is alive") << *node << mac.pretty();
+
+		refute(mac);
+	} else if(gossip->state == GossipSuspect) {
+		qint64 received = target->msecsSinceReceived();
+		if(received >= 0 && received < FailureSilenceTimeout) {
+			Log::debug("link: [%1]:%2 suspects %3, but I have heard from it %4s ago")
+					<< *node << mac.pretty() << (int) (received / 1000);
+
+			queueGossip(mac, GossipAlive);
+		}
+	} else {
+		Log::warn("link: unknown gossip state %1 from [%2]:%3") << gossip->state << *node;
+	}
+}
+
+/* IndirectProbe */
+
+void LinkLayer::sendIndirectProbe(SparkleNode* node, SparkleNode* target) {
+	indirect_probe_t probe;
+	memcpy(probe.sparkleMAC, target->sparkleMAC().rawBytes(), SPARKLE_ADDRESS_SIZE);
+
+	sendEncryptedPacket(IndirectProbe, QByteArray((const char*) &probe, sizeof(indirect_probe_t)), node);
+}
+
+void LinkLayer::handleIndirectProbe(QByteArray &payload, SparkleNode* node) {
+	WireView<indirect_probe_t> probe(payload);
+	if(!checkPacketSize(probe, node, "IndirectProbe"))
+		return;
+
+	if(!isMaster() || !node->isMaster()) {
+		Log::warn("link: IndirectProbe from [%1]:%2 between non-masters") << *node;
+		return;
+	}
+
+	SparkleAddress mac(probe->sparkleMAC);
+
+	SparkleNode* target = _router.findSparkleNode(mac);
+	if(target == NULL || target == _router.getSelfNode() || !target->areKeysNegotiated())
+		return;
+
+	qint64 received = target->msecsSinceReceived();
+	if(received >= 0 && received < LinkProbeInterval) {
+		sendIndirectProbeAck(node, mac);
+		return;
+	}
+
+	pending_indirect_probe_t pending;
+	pending.requester = node->sparkleMAC();
+	pending.target = mac;
+	pending.since = clock.elapsed();
+	pendingIndirectProbes.append(pending);
+
+	sendKeepalive(target);
+}
+
+void LinkLayer::answerIndirectProbes(SparkleNode* target) {
+	for(int i = 0; i < pendingIndirectProbes.count(); ) {
+		if(pendingIndirectProbes[i].target != target->sparkleMAC()) {
+			i++;
+			continue;
+		}
+
+		SparkleNode* requester = _router.findSparkleNode(pendingIndirectProbes[i].requester);
+		if(requester != NULL)
+			sendIndirectProbeAck(requester, target->sparkleMAC());
+
+		pendingIndirectProbes.removeAt(i);
+	}
+}
+
+/* IndirectProbeAck */
+
+void LinkLayer::sendIndirectProbeAck(SparkleNode* node, SparkleAddress target) {
+	indirect_probe_t ack;
+	memcpy(ack.sparkleMAC, target.rawBytes(), SPARKLE_ADDRESS_SIZE);
+
+	sendEncryptedPacket(IndirectProbeAck, QByteArray((const char*) &ack, sizeof(indirect_probe_t)), node);
+}
+
+void LinkLayer::handleIndirectProbeAck(QByteArray &payload, SparkleNode* node) {
+	WireView<indirect_probe_t> ack(payload);
+	if(!checkPacketSize(ack, node, "IndirectProbeAck"))
+		return;
+
+	if(!node->isMaster()) {
+		Log::warn("link: IndirectProbeAck from non-master [%1]:%2") << *node;
+		return;
+	}
+
+	SparkleAddress mac(ack->sparkleMAC);
+
+	if(!suspects.contains(mac))
+		return;
+
+	Log::debug("link: [%1]:%2 has heard from %3") << *node << mac.pretty();
+
+	refute(mac);
+}
+
+/* SessionClose */
+
+void LinkLayer::setSessionLimits(int maxSessions, int idleTimeout) {
+	sessionLimit = maxSessions;
+	sessionIdleTimeout = idleTimeout;
+}
+
+static bool usedLater(SparkleNode* a, SparkleNode* b) {
+	qint64 usedA = a->msecsSinceUsed(), usedB = b->msecsSinceUsed();
+	if(usedA < 0)
+		usedA = a->msecsKnown();
+	if(usedB < 0)
+		usedB = b->msecsKnown();
+
+	return usedA < usedB;
+}
+
+void LinkLayer::evictSessions() {
+	SparkleNode* self = _router.getSelfNode();
+	QList<SparkleNode*> candidates;
+	int sessions = 0;
+
+	foreach(SparkleNode* node, nodeSpool) {
+		if(!node->hasSession())
+			continue;
+
+		sessions++;
+
+		if(node == self || node->isMaster() || node == natProbeTarget ||
+				awaitingNegotiation.contains(node) || !node->isQueueEmpty())
+			continue;
+
+		// failure detection watches home slaves through their sessions
+		if(isMaster() && homeSlaves.contains(node->sparkleMAC()))
+			continue;
+
+		qint64 used = node->msecsSinceUsed();
+		if(used < 0)
+			used = node->msecsKnown();
+
+		if(used > sessionIdleTimeout) {
+			closeSession(node);
+			sessions--;
+		} else {
+			candidates.append(node);
+		}
+	}
+
+	if(sessionLimit > 0 && sessions > sessionLimit) {
+		qSort(candidates.begin(), candidates.end(), usedLater);
+
+		while(sessions > sessionLimit && !candidates.isEmpty()) {
+			closeSession(candidates.takeLast());
+			sessions--;
+		}
+	}
+
+	// endpoints nobody routes to and nobody talks to are forgotten entirely
+	QSet<SparkleNode*> referenced;
+	foreach(SparkleNode* node, _router.nodes())
+		referenced.insert(node);
+	foreach(SparkleNode* node, cookies)
+		referenced.insert(node);
+
+	foreach(SparkleNode* node, nodeSpool) {
+		if(referenced.contains(node) || node->hasSession() || awaitingNegotiation.contains(node))
+			continue;
+
+		qint64 active = node->msecsSinceActive();
+		if(active < 0)
+			active = node->msecsKnown();
+
+		if(active > sessionIdleTimeout)
+			forgetNode(node, "idle");
+	}
+}
+
+void LinkLayer::closeSession(SparkleNode* node) {
+	Log::debug("link: closing idle session with [%1]:%2") << *node;
+
+	sendEncryptedPacket(SessionClose, QByteArray(), node);
+	node->closeSession();
+	egress->forgetPeer(node->phantomIP(), node->phantomPort());
+}
+
+void LinkLayer::handleSessionClose(QByteArray &payload, SparkleNode* node) {
+	if(!checkPacketSize(payload, 0, node, "SessionClose"))
+		return;
+
+	if(awaitingNegotiation.contains(node))
+		return;
+
+	Log::debug("link: [%1]:%2 has closed our session") << *node;
+
+	node->closeSession();
+	egress->forgetPeer(node->phantomIP(), node->phantomPort());
+}
+
+/* Contacts and session pre-warming */
+
+bool LinkLayer::setContactsFile(QString filename) {
+	contactsFile = filename;
+	contacts.clear();
+
+	QFile file(filename);
+	if(!file.open(QIODevice::ReadOnly))
+		return false;
+
+	QByteArray data = file.readAll();
+	file.close();
+
+	QDataStream stream(&data, QIODevice::ReadOnly);
+
+	quint32 magic, count;
+	stream >> magic >> count;
+
+	if(magic != ContactsMagic) {
+		Log::warn("link: bad contacts file magic: %1") << magic;
+		return false;
+	}
+
+	for(quint32 i = 0; i < count && !stream.atEnd(); i++) {
+		QByteArray mac;
+		quint32 contactCount;
+		stream >> mac >> contactCount;
+
+		// older contacts weigh less
+		if(mac.size() == SPARKLE_ADDRESS_SIZE && contactCount / 2 > 0)
+			contacts[SparkleAddress(mac)] = contactCount / 2;
+	}
+
+	Log::debug("link: loaded %1 contacts") << contacts.count();
+
+	return true;
+}
+
+void LinkLayer::saveContacts() {
+	if(contactsFile.isEmpty())
+		return;
+
+	trimContacts();
+
+	QByteArray data;
+	QDataStream stream(&data, QIODevice::WriteOnly);
+
+	stream << (quint32) ContactsMagic << (quint32) contacts.count();
+	foreach(SparkleAddress mac, contacts.keys())
+		stream << mac.bytes() << contacts[mac];
+
+	QFile file(contactsFile);
+	if(!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+		Log::warn("link: cannot write contacts to %1") << contactsFile;
+		return;
+	}
+
+	file.write(data);
+	file.close();
+}
+
+void LinkLayer::setPrewarmPeers(int count) {
+	prewarmPeers = count;
+}
+
+/* Addresses without a route are counted when it arrives, so that made up
+ * destinations do not get into the table. */
+void LinkLayer::countContact(SparkleAddress address, SparkleNode* node) {
+	if(node == NULL)
+		return;
+
+	// a contact is the first packet after a pause, when a session stall would be seen
+	qint64 used = node->msecsSinceUsed();
+
+	if(!node->areKeysNegotiated() || used < 0 || used > ContactEpisodeGap)
+		contacts[address]++;
+
+	if(contacts.count() > 2 * qMax(prewarmPeers, 1) * ContactsPerPrewarmPeer)
+		trimContacts();
+}
+
+/* Drops the least frequent contacts beyond what pre-warming could use */
+void LinkLayer::trimContacts() {
+	int limit = qMax(prewarmPeers, 1) * ContactsPerPrewarmPeer;
+	if(contacts.count() <= limit)
+		return;
+
+	QList<quint32> counts = contacts.values();
+	qSort(counts.begin(), counts.end(), qGreater<quint32>());
+	quint32 threshold = counts[limit - 1];
+
+	foreach(SparkleAddress mac, contacts.keys()) {
+		if(contacts[mac] < threshold)
+			contacts.remove(mac);
+	}
+
+	// ties at the threshold
+	foreach(SparkleAddress mac, contacts.keys()) {
+		if(contacts.count() <= limit)
+			break;
+
+		if(contacts[mac] == threshold)
+			contacts.remove(mac);
+	}
+}
+
+void LinkLayer::startPrewarm() {
+	contactsTimer->start();
+
+	QHash<SparkleAddress, quint32> candidates = contacts;
+	candidates.remove(_router.getSelfNode()->sparkleMAC());
+
+	prewarmQueue.clear();
+	while(prewarmQueue.count() < prewarmPeers && !candidates.isEmpty()) {
+		SparkleAddress best;
+		quint32 bestCount = 0;
+
+		foreach(SparkleAddress mac, candidates.keys()) {
+			if(candidates[mac] > bestCount) {
+				best = mac;
+				bestCount = candidates[mac];
+			}
+		}
+
+		candidates.remove(best);
+		prewarmQueue.append(best);
+	}
+
+	if(prewarmQueue.isEmpty())
+		return;
+
+	Log::debug("link: pre-warming sessions with %1 frequent peers") << prewarmQueue.count();
+
+	prewarmTickAt = clock.elapsed();
+	prewarmCPUTime = ::clock();
+	prewarmTimer->start();
+}
+
+void LinkLayer::prewarm() {
+	qint64 now = clock.elapsed();
+	clock_t cpuTime = ::clock();
+
+	qint64 elapsed = qMax<qint64>(now - prewarmTickAt, 1);
+	qint64 cpu = ((qint64) (cpuTime - prewarmCPUTime)) * 1000 / CLOCKS_PER_SEC * 100 / elapsed;
+
+	prewarmTickAt = now;
+	prewarmCPUTime = cpuTime;
+
+	// key exchanges are RSA operations; let the real traffic have the CPU first
+	if(cpu > PrewarmCPUBudget)
+		return;
+
+	if(prewarmQueue.isEmpty()) {
+		prewarmTimer->stop();
+		return;
+	}
+
+	SparkleAddress mac = prewarmQueue.takeFirst();
+	SparkleNode* node = _router.findSparkleNode(mac);
+
+	if(node == NULL) {
+		prewarmRoutes.insert(mac);
+		sendRouteRequest(mac);
+	} else if(!node->areKeysNegotiated() && !awaitingNegotiation.contains(node)) {
+		Log::debug("link: pre-warming session with %1") << mac.pretty();
+
+		sendKeepalive(node);
+	}
+}
+
+/* StandbyReplica */
+
+SparkleNode* LinkLayer::selectStandby() {
+	QByteArray self = _router.getSelfNode()->sparkleMAC().bytes();
+	SparkleNode *next = NULL, *first = NULL;
+
+	foreach(SparkleNode* master, _router.find(Router::Master | Router::ExcludeSelf)) {
+		QByteArray mac = master->sparkleMAC().bytes();
+
+		if(first == NULL || mac < first->sparkleMAC().bytes())
+			first = master;
+
+		if(self < mac && (next == NULL || mac < next->sparkleMAC().bytes()))
+			next = master;
+	}
+
+	return (next != NULL) ? next : first;
+}
+
+SparkleNode* LinkLayer::findSpooledNode(SparkleAddress mac) {
+	SparkleNode* node = _router.findSparkleNode(mac);
+	if(node != NULL)
+		return node;
+
+	// partitioned routes we do not own are kept in the spool only
+	foreach(SparkleNode* spooled, nodeSpool) {
+		if(spooled->sparkleMAC() == mac)
+			return spooled;
+	}
+
+	return NULL;
+}
+
+void LinkLayer::refreshStandby() {
+	SparkleNode* standby = selectStandby();
+	SparkleAddress mac = (standby != NULL) ? standby->sparkleMAC() : SparkleAddress();
+
+	if(mac == standbyMAC)
+		return;
+
+	standbyMAC = mac;
+	if(standby == NULL)
+		return;
+
+	QByteArray entries;
+	foreach(SparkleAddress slaveMAC, homeSlaves.values()) {
+		SparkleNode* slave = findSpooledNode(slaveMAC);
+		if(slave == NULL || slave->isMaster()) {
+			homeSlaves.remove(slaveMAC);
+			continue;
+		}
+
+		fillRoute(wireAppend<route_t>(entries), slave, false);
+	}
+
+	Log::debug("link: %1 @ [%2]:%3 is my standby, replicating %4 slaves") << mac.pretty() << *standby
+			<< homeSlaves.count();
+
+	if(!entries.isEmpty())
+		sendRouteEntries(standby, entries, StandbyReplica);
+}
+
+void LinkLayer::replicateHomeSlave(SparkleNode* slave, bool removed) {
+	SparkleNode* standby = _router.findSparkleNode(standbyMAC);
+	if(standby == NULL || standbyMAC.isNull())
+		return;
+
+	route_t entry;
+	fillRoute(&entry, slave, false);
+	entry.isRemoved = removed;
+
+	sendEncryptedPacket(StandbyReplica, QByteArray((const char*) &entry, sizeof(route_t)), standby);
+}
+
+void LinkLayer::forgetHomeSlave(SparkleNode* node) {
+	if(homeSlaves.remove(node->sparkleMAC()))
+		replicateHomeSlave(node, true);
+
+	standbyReplicas.remove(node->sparkleMAC());
+}
+
+void LinkLayer::adoptSlaves(SparkleAddress master) {
+	if(!standbyReplicas.contains(master))
+		return;
+
+	QHash<SparkleAddress, QByteArray> replica = standbyReplicas.take(master);
+
+	Log::info("link: taking over %1 slaves of %2") << replica.count() << master.pretty();
+
+	refreshStandby();
+
+	foreach(QByteArray entry, replica.values()) {
+		WireView<route_t> route(entry);
+		applyRoute(route.data());
+
+		SparkleNode* slave = findSpooledNode(SparkleAddress(route->sparkleMAC));
+		if(slave == NULL || slave->isMaster())
+			continue;
+
+		homeSlaves.insert(slave->sparkleMAC());
+		replicateHomeSlave(slave, false);
+
+		sendMasterSwitch(slave);
+	}
+}
+
+void LinkLayer::handleStandbyReplica(QByteArray &payload, SparkleNode* node) {
+	WireArray<route_t> routes(payload);
+	if(routes.count() == 0) {
+		Log::warn("link: malformed StandbyReplica packet from [%1]:%2") << *node;
+		return;
+	}
+
+	if(!isMaster() || !node->isMaster()) {
+		Log::warn("link: StandbyReplica from [%1]:%2 between non-masters") << *node;
+		return;
+	}
+
+	QHash<SparkleAddress, QByteArray>& replica = standbyReplicas[node->sparkleMAC()];
+
+	for(int i = 0; i < routes.count(); i++) {
+		const route_t* route = &routes[i];
+		SparkleAddress mac(route->sparkleMAC);
+
+		if(route->isRemoved)
+			replica.remove(mac);
+		else
+			replica[mac] = QByteArray((const char*) route, sizeof(route_t));
+	}
+}
+
+/* MasterSwitch */
+
+void LinkLayer::sendMasterSwitch(SparkleNode* node) {
+	sendEncryptedPacket(MasterSwitch, QByteArray(), node);
+}
+
+void LinkLayer::handleMasterSwitch(QByteArray &payload, SparkleNode* node) {
+	if(!checkPacketSize(payload, 0, node, "MasterSwitch"))
+		return;
+
+	if(!node->isMaster() || isMaster()) {
+		Log::warn("link: unexpected MasterSwitch from [%1]:%2") << *node;
+		return;
+	}
+
+	Log::info("link: %1 @ [%2]:%3 is my master now") << node->sparkleMAC().pretty() << *node;
+
+	homeMaster = node->sparkleMAC();
+
+	// keep probing the binding lifetime against a live master
+	if(natKeepaliveTimer->isActive() && !natProbeInFlight &&
+			(natProbeTarget == NULL || !_router.nodes().contains(natProbeTarget))) {
+		natProbeTarget = node;
+		natProbeTimer->start(NATProbeInterval);
+	}
+}
+
+/* ======= END ======= */
+
+void LinkLayer::cleanup() {
+	Log::debug("link: cleanup");
+
+	if(joined)
+		saveContacts();
+
+	joined = false;
 
 	foreach(SparkleNode *node, nodeSpool)
 		delete node;
@@ -1264,6 +3916,43 @@ void LinkLayer::cleanup() {
 	joinTimer->stop();
 	pingTimer->stop();
 	natKeepaliveTimer->stop();
+	natProbeTimer->stop();
+	natProbeReplyTimer->stop();
+	loadTimer->stop();
+	routeDigestTimer->stop();
+	linkProbeTimer->stop();
+	pendingNATProbes.clear();
+	relays.clear();
+	punchTimer->stop();
+	pendingPunches.clear();
+	lanBeaconTimer->stop();
+	pendingLANChallenges.clear();
+	lanChallengesAnswered = 0;
+	sessionTimer->stop();
+	contactsTimer->stop();
+	rejoinTimer->stop();
+	registerRetryTimer->stop();
+	admissionTimer->stop();
+	admissionQueue.clear();
+	parityTimer->stop();
+	pendingAnnounces.clear();
+	egress->clear();
+	crypto->clear();
+	pendingDeliveries.clear();
+	pendingDeliveryCount = 0;
+	receivingBatch = false;
+	prewarmTimer->stop();
+	prewarmQueue.clear();
+	prewarmRoutes.clear();
+	homeSlaves.clear();
+	standbyMAC = homeMaster = SparkleAddress();
+	standbyReplicas.clear();
+	suspects.clear();
+	vouches.clear();
+	pendingGossip.clear();
+	pendingIndirectProbes.clear();
+	natProbeTarget = NULL;
+	natProbeInFlight = false;
 }
 
 const LinkLayer::packet_handler_t LinkLayer::packetHandlers[] = {
@@ -1275,7 +3964,7 @@ const LinkLayer::packet_handler_t LinkLayer::packetHandlers[] = {
 
 	{ Ping,                   false, &LinkLayer::handlePing },
 
-	{ KeepalivePacket,        false, &LinkLayer::handleKeepalive },
+	{ KeepalivePacket,        false, &LinkLayer::handlePlainKeepalive },
 
 	{ LocalRewritePacket,     true,  &LinkLayer::handleLocalRewritePacket },
 
@@ -1287,8 +3976,11 @@ const LinkLayer::packet_handler_t LinkLayer::packetHandlers[] = {
 
 	{ RegisterRequest,        true,  &LinkLayer::handleRegisterRequest },
 	{ RegisterReply,          true,  &LinkLayer::handleRegisterReply },
+	{ RegisterRetry,          true,  &LinkLayer::handleRegisterRetry },
 
 	{ Route,                  true,  &LinkLayer::handleRoute },
+	{ RouteBatch,             true,  &LinkLayer::handleRouteBatch },
+	{ RouteDigest,            true,  &LinkLayer::handleRouteDigest },
 	{ RouteRequest,           true,  &LinkLayer::handleRouteRequest },
 	{ RouteMissing,           true,  &LinkLayer::handleRouteMissing },
 	{ RouteInvalidate,        true,  &LinkLayer::handleRouteInvalidate },
@@ -1299,9 +3991,34 @@ const LinkLayer::packet_handler_t LinkLayer::packetHandlers[] = {
 
 	{ BacklinkRedirect,       true,  &LinkLayer::handleBacklinkRedirect },
 
+	{ NATProbe,               true,  &LinkLayer::handleNATProbe },
+	{ NATProbeReply,          true,  &LinkLayer::handleNATProbeReply },
+
+	{ LoadAdvertisement,      true,  &LinkLayer::handleLoadAdvertisement },
+
 	{ ExitNotification,       true,  &LinkLayer::handleExitNotification },
 
 	{ DataPacket,             true,  &LinkLayer::handleDataPacket },
+	{ RelayedDataPacket,      true,  &LinkLayer::handleRelayedDataPacket },
+	{ FECDataPacket,          true,  &LinkLayer::handleFECDataPacket },
+	{ FECParityPacket,        true,  &LinkLayer::handleFECParityPacket },
+	{ Rekey,                  true,  &LinkLayer::handleRekey },
+	{ RekeyAck,               true,  &LinkLayer::handleRekeyAck },
+
+	{ PunchRequest,           true,  &LinkLayer::handlePunchRequest },
+	{ Punch,                  false, &LinkLayer::handlePunch },
+
+	{ LANBeacon,              false, &LinkLayer::handleLANBeacon },
+	{ LANChallenge,           false, &LinkLayer::handleLANChallenge },
+	{ LANChallengeReply,      false, &LinkLayer::handleLANChallengeReply },
+
+	{ IndirectProbe,          true,  &LinkLayer::handleIndirectProbe },
+	{ IndirectProbeAck,       true,  &LinkLayer::handleIndirectProbeAck },
+
+	{ SessionClose,           true,  &LinkLayer::handleSessionClose },
+
+	{ StandbyReplica,         true,  &LinkLayer::handleStandbyReplica },
+	{ MasterSwitch,           true,  &LinkLayer::handleMasterSwitch },
 
 	{ (packet_type_t) 0, false, NULL }
 };
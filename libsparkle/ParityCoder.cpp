@@ -0,0 +1,164 @@
+/*
+ * Sparkle - zero-configuration fully distributed self-organizing encrypting VPN
+ * Copyright (C) 2009 Sergey Gridassov, Peter Zotov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ParityCoder.h"
+#include "SparkleRandom.h"
+
+using namespace Sparkle;
+
+ParityEncoder::ParityEncoder() : _count(0), lengths(0) {
+	// groups of a previous session must not be mistaken for ours
+	_group = (quint16) SparkleRandom::integer();
+}
+
+quint16 ParityEncoder::group() const {
+	return _group;
+}
+
+quint8 ParityEncoder::count() const {
+	return _count;
+}
+
+quint8 ParityEncoder::add(const QByteArray &packet) {
+	if(parity.size() < packet.size())
+		parity.append(QByteArray(packet.size() - parity.size(), 0));
+
+	char *out = parity.data();
+	const char *in = packet.constData();
+	for(int i = 0; i < packet.size(); i++)
+		out[i] ^= in[i];
+
+	lengths ^= (quint16) packet.size();
+
+	return _count++;
+}
+
+QByteArray ParityEncoder::finish(quint16 &_lengths) {
+	QByteArray result = parity;
+	_lengths = lengths;
+
+	_group++;
+	_count = 0;
+	parity.clear();
+	lengths = 0;
+
+	return result;
+}
+
+ParityDecoder::group_t &ParityDecoder::lookup(quint16 group) {
+	if(!groups.contains(group)) {
+		if(groups.isEmpty() || (qint16) (group - newest) > 0)
+			newest = group;
+
+		// forget groups which fell out of the window
+		foreach(quint16 key, groups.keys()) {
+			if((qint16) (newest - key) >= Window)
+				groups.remove(key);
+		}
+
+		group_t g;
+		g.received = 0;
+		g.count = 0;
+		g.parityKnown = false;
+		g.lengths = 0;
+		groups[group] = g;
+	}
+
+	return groups[group];
+}
+
+void ParityDecoder::accumulate(group_t &g, const QByteArray &data) {
+	if(g.accumulator.size() < data.size())
+		g.accumulator.append(QByteArray(data.size() - g.accumulator.size(), 0));
+
+	char *out = g.accumulator.data();
+	const char *in = data.constData();
+	for(int i = 0; i < data.size(); i++)
+		out[i] ^= in[i];
+}
+
+bool ParityDecoder::recover(group_t &g, QByteArray &recovered) {
+	if(!g.parityKnown)
+		return false;
+
+	int missing = -1, present = 0;
+	for(int i = 0; i < g.count; i++) {
+		if(g.received & (1 << i))
+			present++;
+		else
+			missing = i;
+	}
+
+	if(present == g.count) {
+		g.accumulator.clear();
+		return false;
+	} else if(present != g.count - 1) {
+		return false;
+	}
+
+	g.received |= 1 << missing;
+
+	if(g.lengths > g.accumulator.size())
+		return false;
+
+	recovered = g.accumulator.left(g.lengths);
+	g.accumulator.clear();
+
+	return true;
+}
+
+bool ParityDecoder::add(quint16 group, quint8 index, const QByteArray &packet, QByteArray &recovered) {
+	if(index >= MaxGroupSize)
+		return false;
+
+	group_t &g = lookup(group);
+	if(g.received & (1 << index))
+		return false;
+
+	g.received |= 1 << index;
+
+	// a completed group keeps only its mask, to drop late duplicates
+	if(!g.parityKnown || g.accumulator.size() > 0) {
+		accumulate(g, packet);
+		g.lengths ^= (quint16) packet.size();
+	}
+
+	recover(g, recovered);
+
+	return true;
+}
+
+bool ParityDecoder::addParity(quint16 group, quint8 count, quint16 lengths, const QByteArray &parity, QByteArray &recovered) {
+	if(count == 0 || count > MaxGroupSize)
+		return false;
+
+	group_t &g = lookup(group);
+	if(g.parityKnown)
+		return false;
+
+	g.parityKnown = true;
+	g.count = count;
+	g.lengths ^= lengths;
+	accumulate(g, parity);
+
+	return recover(g, recovered);
+}
+
+void ParityDecoder::clear() {
+	groups.clear();
+}
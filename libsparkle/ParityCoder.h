@@ -0,0 +1,87 @@
+/*
+ * Sparkle - zero-configuration fully distributed self-organizing encrypting VPN
+ * Copyright (C) 2009 Sergey Gridassov, Peter Zotov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PARITY_CODER__H__
+#define __PARITY_CODER__H__
+
+#include <QByteArray>
+#include <QHash>
+
+namespace Sparkle {
+
+/* XOR parity over groups of data packets. The parity of a group is the XOR
+ * of its packets, zero-padded to the longest one, together with the XOR of
+ * their lengths; any single packet lost from a group can be rebuilt from
+ * the rest of it and the parity, without a round trip. */
+class ParityEncoder {
+public:
+	ParityEncoder();
+
+	quint16 group() const;
+	quint8 count() const;
+
+	/* returns the index of the packet within the current group */
+	quint8 add(const QByteArray &packet);
+
+	/* closes the current group and starts the next one */
+	QByteArray finish(quint16 &lengths);
+
+private:
+	quint16 _group;
+	quint8 _count;
+	QByteArray parity;
+	quint16 lengths;
+};
+
+class ParityDecoder {
+public:
+	enum {
+		MaxGroupSize	= 16,
+	};
+
+	/* returns false for duplicates; fills recovered when the packet
+	 * completes a group whose parity is already known */
+	bool add(quint16 group, quint8 index, const QByteArray &packet, QByteArray &recovered);
+	bool addParity(quint16 group, quint8 count, quint16 lengths, const QByteArray &parity, QByteArray &recovered);
+
+	void clear();
+
+private:
+	enum {
+		Window		= 32,
+	};
+
+	struct group_t {
+		quint16		received;
+		quint8		count;
+		bool		parityKnown;
+		QByteArray	accumulator;
+		quint16		lengths;
+	};
+
+	group_t &lookup(quint16 group);
+	void accumulate(group_t &g, const QByteArray &data);
+	bool recover(group_t &g, QByteArray &recovered);
+
+	QHash<quint16, group_t> groups;
+	quint16 newest;
+};
+
+}
+
+#endif
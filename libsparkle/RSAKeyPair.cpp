@@ -20,6 +20,7 @@
 #include <Sparkle/Log>
 
 #include <QFile>
+#include <QCryptographicHash>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -277,3 +278,31 @@ QDataStream & operator >> (QDataStream& stream, mpi &data) {
 
 	return stream;
 }
+
+QByteArray RSAKeyPair::sign(QByteArray data) {
+	Q_D(RSAKeyPair);
+
+	QByteArray hash = QCryptographicHash::hash(data, QCryptographicHash::Sha1);
+	QByteArray signature(d->key.len, 0);
+
+	if(rsa_pkcs1_sign(&d->key, RSA_PRIVATE, SIG_RSA_SHA1, hash.size(),
+				(unsigned char *) hash.data(), (unsigned char *) signature.data()) != 0) {
+		Log::error("RSAKeyPair::sign: cannot sign data");
+
+		return QByteArray();
+	}
+
+	return signature;
+}
+
+bool RSAKeyPair::verify(QByteArray data, QByteArray signature) {
+	Q_D(RSAKeyPair);
+
+	if(signature.size() != d->key.len)
+		return false;
+
+	QByteArray hash = QCryptographicHash::hash(data, QCryptographicHash::Sha1);
+
+	return rsa_pkcs1_verify(&d->key, RSA_PUBLIC, SIG_RSA_SHA1, hash.size(),
+				(unsigned char *) hash.data(), (unsigned char *) signature.data()) == 0;
+}
@@ -17,6 +17,10 @@
  */
 
 #include <QtGlobal>
+#include <QElapsedTimer>
+#include <QPair>
+#include <QSet>
+#include <QtAlgorithms>
 
 #include <Sparkle/Router>
 #include <Sparkle/SparkleNode>
@@ -24,14 +28,50 @@
 
 using namespace Sparkle;
 
+/* 32-bit FNV-1a. Masters compare values computed from it, so unlike
+ * qHash() it must not depend on the Qt version or on a per-process seed. */
+static quint32 fnv1a(const QByteArray &data) {
+	quint32 hash = 2166136261u;
+
+	for(int i = 0; i < data.size(); i++) {
+		hash ^= (quint8) data[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
 namespace Sparkle {
 
 class RouterPrivate {
 public:
-	RouterPrivate() : self(0) { }
+	RouterPrivate() : self(0), ringValid(false), routeClock(0) { }
 
 	SparkleNode *self;
 	QList<SparkleNode *> nodes;
+
+	// kept up to date on every change, so that counting masters is O(1)
+	QSet<SparkleNode *> masters;
+
+	void trackRole(SparkleNode* node) {
+		if(node->isMaster())
+			masters.insert(node);
+		else
+			masters.remove(node);
+	}
+
+	typedef QPair<quint32, SparkleNode*> ring_point_t;
+	QList<ring_point_t> ring;
+	bool ringValid;
+
+	struct tombstone_t {
+		quint32		version;
+		qint64		lifetime;
+		QElapsedTimer	age;
+	};
+
+	quint32 routeClock;
+	QHash<SparkleAddress, tombstone_t> tombstones;
 };
 
 }
@@ -66,8 +106,14 @@ void Router::updateNode(SparkleNode* node) {
 
 	bool newNode = !d->nodes.contains(node);
 
-	if(newNode)
+	if(newNode) {
 		d->nodes.append(node);
+		d->tombstones.remove(node->sparkleMAC());
+	}
+
+	d->trackRole(node);
+
+	d->ringValid = false;
 
 	Log::debug("router: %6 node %3 @ [%1]:%2 (%4, %5)") << *node << node->sparkleMAC().pretty()
 			<< (node->isMaster() ? "master" : "slave")
@@ -88,6 +134,8 @@ void Router::removeNode(SparkleNode* node) {
 
 	if(d->nodes.contains(node)) {
 		d->nodes.removeOne(node);
+		d->masters.remove(node);
+		d->ringValid = false;
 		Log::debug("router: removing node %3 @ [%1]:%2") << *node << node->sparkleMAC().pretty();
 
 		emit nodeRemoved(node);
@@ -133,16 +181,16 @@ SparkleNode* Router::findNode(QHostAddress realIP, quint16 realPort) const {
 QList<SparkleNode*> Router::find(Router::NodeQueryFlags flags, QHostAddress excludeIP) {
 	Q_D(const Router);
 
-	QList<SparkleNode*> list = d->nodes;
+	QList<SparkleNode*> list;
 
-	foreach(SparkleNode* node, list) {
-		if((flags & White       &&  node->isBehindNAT()) ||
-		   (flags & BehindNAT   && !node->isBehindNAT()) ||
-		   (flags & Master      && !node->isMaster()) ||
-		   (flags & Slave       &&  node->isMaster()) ||
-		   (flags & ExcludeSelf &&  node == d->self) ||
-		   (node->realIP() == excludeIP)) {
-			list.removeOne(node);
+	foreach(SparkleNode* node, d->nodes) {
+		if(!((flags & White       &&  node->isBehindNAT()) ||
+		     (flags & BehindNAT   && !node->isBehindNAT()) ||
+		     (flags & Master      && !node->isMaster()) ||
+		     (flags & Slave       &&  node->isMaster()) ||
+		     (flags & ExcludeSelf &&  node == d->self) ||
+		     (node->realIP() == excludeIP))) {
+			list.append(node);
 		}
 	}
 
@@ -158,7 +206,57 @@ SparkleNode* Router::select(Router::NodeQueryFlags flags, QHostAddress excludeIP
 	return list[qrand() % list.size()];
 }
 
+/* Power of two choices: almost as good as picking the least loaded node
+ * and does not herd everyone onto it between load advertisements. */
+SparkleNode* Router::selectLeastLoaded(Router::NodeQueryFlags flags, QHostAddress excludeIP) {
+	QList<SparkleNode*> list = find(flags, excludeIP);
+
+	if(list.size() == 0)
+		return NULL;
+	else if(list.size() == 1)
+		return list[0];
+
+	int first = qrand() % list.size();
+	int second = qrand() % (list.size() - 1);
+	if(second >= first)
+		second++;
+
+	if(loadScore(list[second]) < loadScore(list[first]))
+		return list[second];
+	else
+		return list[first];
+}
+
+quint32 Router::loadScore(const SparkleNode* node) {
+	if(!node->isLoadKnown())
+		return 0; // freshly promoted masters have no load yet
+
+	quint32 score = node->loadPeers() + node->loadPPS() / 8;
+
+	// nearly saturated CPU hurts everyone served by that node
+	if(node->loadCPU() > 50)
+		score += (node->loadCPU() - 50) * 20;
+
+	return score;
+}
+
 int Router::count(Router::NodeQueryFlags flags, QHostAddress excludeIP) {
+	Q_D(const Router);
+
+	if(excludeIP.isNull()) {
+		int self = (d->self != NULL) ? 1 : 0;
+		int selfMaster = d->masters.contains(d->self) ? 1 : 0;
+
+		switch((int) flags) {
+			case 0:				return d->nodes.count();
+			case ExcludeSelf:		return d->nodes.count() - self;
+			case Master:			return d->masters.count();
+			case Master | ExcludeSelf:	return d->masters.count() - selfMaster;
+			case Slave:			return d->nodes.count() - d->masters.count();
+			case Slave | ExcludeSelf:	return d->nodes.count() - d->masters.count() - (self - selfMaster);
+		}
+	}
+
 	return find(flags, excludeIP).count();
 }
 
@@ -169,11 +267,13 @@ QList<SparkleNode*> Router::nodes() const {
 }
 
 void Router::notifyNodeUpdated(SparkleNode* target) {
-	Q_D(const Router);
+	Q_D(Router);
 
-	foreach(SparkleNode *node, d->nodes) {
-		if(node == target)
-			emit nodeUpdated(target);
+	d->ringValid = false;
+
+	if(d->nodes.contains(target)) {
+		d->trackRole(target);
+		emit nodeUpdated(target);
 	}
 }
 
@@ -186,5 +286,176 @@ void Router::clear() {
 		emit nodeRemoved(node);
 	}
 	d->self = NULL;
+
+	d->masters.clear();
+	d->tombstones.clear();
+	d->routeClock = 0;
+	d->ring.clear();
+	d->ringValid = false;
+}
+
+QList<SparkleNode*> Router::owners(QByteArray addressPrefix, int replicas) {
+	Q_D(Router);
+
+	if(addressPrefix.size() < RingKeySize)
+		return find(Master);
+
+	if(!d->ringValid) {
+		d->ring.clear();
+
+		foreach(SparkleNode* master, find(Master)) {
+			QByteArray mac = master->sparkleMAC().bytes();
+			for(int i = 0; i < RingVirtualNodes; i++) {
+				QByteArray point = mac;
+				point.append((char) i);
+				d->ring.append(qMakePair(fnv1a(point), master));
+			}
+		}
+
+		qSort(d->ring);
+		d->ringValid = true;
+	}
+
+	QList<SparkleNode*> list;
+	if(d->ring.isEmpty())
+		return list;
+
+	quint32 position = fnv1a(addressPrefix.left(RingKeySize));
+
+	int start = 0;
+	while(start < d->ring.count() && d->ring[start].first < position)
+		start++;
+
+	for(int i = 0; i < d->ring.count() && list.count() < replicas; i++) {
+		SparkleNode* master = d->ring[(start + i) % d->ring.count()].second;
+		if(!list.contains(master))
+			list.append(master);
+	}
+
+	return list;
+}
+
+bool Router::isOwner(SparkleNode* master, QByteArray addressPrefix, int replicas) {
+	return owners(addressPrefix, replicas).contains(master);
+}
+
+/* Route versions form a Lamport clock shared by masters: every local change
+ * of an entry takes the next tick, every received entry advances the clock. */
+quint32 Router::nextRouteVersion() {
+	Q_D(Router);
+
+	return ++d->routeClock;
+}
+
+void Router::observeRouteVersion(quint32 version) {
+	Q_D(Router);
+
+	if(version > d->routeClock)
+		d->routeClock = version;
+}
+
+/* The lifetime is what remains of it at the origin, not a fresh one: a
+ * tombstone received again keeps its age, and an expired one is not
+ * brought back. */
+void Router::addTombstone(SparkleAddress sparkleMAC, quint32 version, qint64 lifetime) {
+	Q_D(Router);
+
+	if(lifetime <= 0)
+		return;
+
+	if(d->tombstones.contains(sparkleMAC) && d->tombstones[sparkleMAC].version >= version)
+		return;
+
+	RouterPrivate::tombstone_t& tombstone = d->tombstones[sparkleMAC];
+	tombstone.version = version;
+	tombstone.lifetime = lifetime;
+	tombstone.age.start();
+}
+
+quint32 Router::tombstoneVersion(SparkleAddress sparkleMAC) const {
+	Q_D(const Router);
+
+	if(!d->tombstones.contains(sparkleMAC))
+		return 0;
+
+	return d->tombstones[sparkleMAC].version;
+}
+
+qint64 Router::tombstoneLifetime(SparkleAddress sparkleMAC) const {
+	Q_D(const Router);
+
+	if(!d->tombstones.contains(sparkleMAC))
+		return 0;
+
+	const RouterPrivate::tombstone_t& tombstone = d->tombstones[sparkleMAC];
+
+	return qMax<qint64>(tombstone.lifetime - tombstone.age.elapsed(), 0);
+}
+
+QHash<SparkleAddress, quint32> Router::tombstones() const {
+	Q_D(const Router);
+
+	QHash<SparkleAddress, quint32> list;
+	foreach(SparkleAddress mac, d->tombstones.keys())
+		list[mac] = d->tombstones[mac].version;
+
+	return list;
+}
+
+void Router::expireTombstones() {
+	Q_D(Router);
+
+	foreach(SparkleAddress mac, d->tombstones.keys()) {
+		if(d->tombstones[mac].age.elapsed() > d->tombstones[mac].lifetime)
+			d->tombstones.remove(mac);
+	}
+}
+
+int Router::digestBucket(SparkleAddress sparkleMAC, int buckets) {
+	return sparkleMAC.rawBytes()[SPARKLE_ADDRESS_SIZE - 1] % buckets;
+}
+
+/* Masters are known everywhere; in a partitioned network other entries are
+ * only expected to match between masters which both own them. */
+bool Router::isShared(SparkleNode* entry, SparkleNode* peer, int replicas) {
+	Q_D(Router);
+
+	if(replicas == 0 || entry->isMaster())
+		return true;
+
+	QList<SparkleNode*> list = owners(entry->sparkleMAC().bytes(), replicas);
+
+	return list.contains(d->self) && list.contains(peer);
+}
+
+/* Each bucket is a XOR of entry hashes, so it does not depend on the order
+ * of the nodes and two masters agree on it exactly when their entries do. */
+void Router::computeDigest(quint32* hashes, int buckets, SparkleNode* peer, int replicas) {
+	Q_D(Router);
+
+	for(int i = 0; i < buckets; i++)
+		hashes[i] = 0;
+
+	foreach(SparkleNode* node, d->nodes) {
+		if(!isShared(node, peer, replicas))
+			continue;
+
+		QByteArray entry = node->sparkleMAC().bytes();
+		entry.append(QByteArray::number(node->routeVersion()));
+		entry.append(QByteArray::number(node->realIP().toIPv4Address()));
+		entry.append(QByteArray::number(node->realPort()));
+		entry.append(node->isMaster() ? 'M' : 'S');
+		entry.append(node->isBehindNAT() ? 'N' : 'W');
+
+		hashes[digestBucket(node->sparkleMAC(), buckets)] ^= fnv1a(entry);
+	}
+
+	foreach(SparkleAddress mac, d->tombstones.keys()) {
+		QByteArray entry = mac.bytes();
+		entry.append(QByteArray::number(d->tombstones[mac].version));
+		entry.append('X');
+
+		hashes[digestBucket(mac, buckets)] ^= fnv1a(entry);
+	}
 }
 
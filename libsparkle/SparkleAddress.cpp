@@ -24,11 +24,7 @@
 
 using namespace Sparkle;
 
-SparkleAddress::SparkleAddress() {
-	memset(_bytes, 0, SPARKLE_ADDRESS_SIZE);
-}
-
-SparkleAddress::SparkleAddress(QByteArray origin) {
+SparkleAddress::SparkleAddress(QByteArray origin) : _value(0) {
 	if(origin.size() != SPARKLE_ADDRESS_SIZE) {
 		Log::error("attempting to create SparkleAddress with size %1") << origin.size();
 		origin.resize(SPARKLE_ADDRESS_SIZE);
@@ -37,43 +33,23 @@ SparkleAddress::SparkleAddress(QByteArray origin) {
 	memcpy(_bytes, origin.constData(), SPARKLE_ADDRESS_SIZE);
 }
 
-SparkleAddress::SparkleAddress(const quint8 origin[SPARKLE_ADDRESS_SIZE]) {
+SparkleAddress::SparkleAddress(const quint8 origin[SPARKLE_ADDRESS_SIZE]) : _value(0) {
 	memcpy(_bytes, origin, SPARKLE_ADDRESS_SIZE);
 }
 
-bool SparkleAddress::isNull() const {
-	for(int i = 0; i < SPARKLE_ADDRESS_SIZE; i++) {
-		if(_bytes[i] != 0)
-			return false;
-	}
-
-	return true;
-}
-
 const QByteArray SparkleAddress::bytes() const {
 	return QByteArray((const char*) _bytes, SPARKLE_ADDRESS_SIZE);
 }
 
-const quint8* SparkleAddress::rawBytes() const {
-	return _bytes;
-}
-
-bool SparkleAddress::operator==(SparkleAddress other) const {
-	return !memcmp(_bytes, other._bytes, SPARKLE_ADDRESS_SIZE);
-}
-
-bool SparkleAddress::operator!=(SparkleAddress other) const {
-	return !(*this == other);
-}
-
 QString SparkleAddress::pretty() const {
-	return QString(bytes().toHex()).toUpper().replace(QRegExp("(..)"), "\\1:").left(SPARKLE_ADDRESS_SIZE * 3 - 1);
-}
+	static const char digits[] = "0123456789ABCDEF";
 
-namespace Sparkle {
-
-uint qHash(const SparkleAddress &key) {
-	return qHash((const QByteArray &) key.bytes());
-}
+	char text[SPARKLE_ADDRESS_SIZE * 3];
+	for(int i = 0; i < SPARKLE_ADDRESS_SIZE; i++) {
+		text[i * 3]     = digits[_bytes[i] >> 4];
+		text[i * 3 + 1] = digits[_bytes[i] & 0x0f];
+		text[i * 3 + 2] = ':';
+	}
 
+	return QString::fromLatin1(text, SPARKLE_ADDRESS_SIZE * 3 - 1);
 }
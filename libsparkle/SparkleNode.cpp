@@ -17,6 +17,7 @@
  */
 
 #include <QTimer>
+#include <QElapsedTimer>
 #include <QCryptographicHash>
 
 #include <Sparkle/SparkleNode>
@@ -26,10 +27,54 @@
 #include <Sparkle/Log>
 #include <Sparkle/RSAKeyPair>
 
+#include "ParityCoder.h"
+#include "SparkleRandom.h"
+
 using namespace Sparkle;
 
 namespace Sparkle {
 
+/* Everything we keep about a peer only while talking to it. It is created
+ * on first use and dropped as a whole by closeSession(), so that an idle
+ * peer costs no more than its address, endpoint and role. */
+class SparkleSession {
+public:
+	SparkleSession();
+	~SparkleSession();
+
+	RSAKeyPair authKey;
+	bool authKeyPresent;
+
+	BlowfishKey *hisSessionKey, *mySessionKey;
+	bool keysNegotiated;
+
+	// keys rotate in place: our next key waits for the peer to acknowledge
+	// it, and his previous one still opens packets sent before the switch
+	quint8 myKeyEpoch, hisKeyEpoch;
+	BlowfishKey *myNextKey, *hisPreviousKey;
+	quint64 bytesUnderKey;
+	QElapsedTimer keyAge, rekeySent;
+
+	QList<QByteArray> queue;
+	QTimer *negotiationTimer;
+
+	QElapsedTimer rttSample;
+	int rtt, rttVariance;
+	qreal loss;
+
+	quint32 probeSeq;
+	bool probeOutstanding;
+	QElapsedTimer probeSent;
+
+	// features the peer announced for the current session
+	quint8 features;
+
+	int compressionSkip, compressionBackoff;
+
+	ParityEncoder parityEncoder;
+	ParityDecoder parityDecoder;
+};
+
 class SparkleNodePrivate {
 public:
 	SparkleNodePrivate(Router &router, QHostAddress realIP, quint16 realPort);
@@ -43,23 +88,73 @@ public:
 
 	bool master, behindNAT;
 
-	RSAKeyPair authKey;
-	bool authKeyPresent;
-	BlowfishKey hisSessionKey, mySessionKey;
-	bool keysNegotiated;
+	mutable SparkleSession *session;
 
-	QList<QByteArray> queue;
+	SparkleSession *state() const;
+	void openSession() const;
+
+	int negotiationTimeout;
+
+	QElapsedTimer lastSent, lastReceived, lastUsed;
+	int natTimeout;
+	SparkleNode::NATType natType;
+	qint16 natPortDelta;
+
+	bool loadKnown;
+	quint32 loadPeers, loadPPS;
+	quint8 loadCPU;
 
-	QTimer negotiationTimer;	
+	QElapsedTimer known;
+	quint32 routeVersion;
+
+	quint32 failures;
+	quint8 cpuCount;
 };
 
 }
 
-SparkleNodePrivate::SparkleNodePrivate(Router &router, QHostAddress realIP, quint16 realPort) : router(router), realIP(realIP), realPort(realPort), phantomPort(0), authKeyPresent(false), keysNegotiated(false), master(false), behindNAT(false) {
-	mySessionKey.generate();
-	
-	negotiationTimer.setSingleShot(true);
-	negotiationTimer.setInterval(5000);	
+SparkleSession::SparkleSession() : authKeyPresent(false), hisSessionKey(NULL), mySessionKey(NULL), keysNegotiated(false), myKeyEpoch(0), hisKeyEpoch(0), myNextKey(NULL), hisPreviousKey(NULL), bytesUnderKey(0), negotiationTimer(NULL), rtt(-1), rttVariance(0), loss(0), probeSeq(0), probeOutstanding(false), features(0), compressionSkip(0), compressionBackoff(0) {
+	keyAge.invalidate();
+	rekeySent.invalidate();
+	rttSample.invalidate();
+	probeSent.invalidate();
+
+	// replies cannot be forged by guessing the next sequence number
+	probeSeq = (quint32) SparkleRandom::integer();
+}
+
+SparkleSession::~SparkleSession() {
+	delete negotiationTimer;
+	delete hisSessionKey;
+	delete mySessionKey;
+	delete myNextKey;
+	delete hisPreviousKey;
+}
+
+SparkleNodePrivate::SparkleNodePrivate(Router &router, QHostAddress realIP, quint16 realPort) : router(router), realIP(realIP), realPort(realPort), phantomPort(0), master(false), behindNAT(false), session(NULL), negotiationTimeout(5000), natTimeout(0), natType(SparkleNode::NATUnknown), natPortDelta(0), loadKnown(false), loadPeers(0), loadPPS(0), loadCPU(0), routeVersion(0), failures(0), cpuCount(1) {
+	lastSent.invalidate();
+	lastReceived.invalidate();
+	lastUsed.invalidate();
+	known.start();
+}
+
+SparkleSession *SparkleNodePrivate::state() const {
+	if(session == NULL)
+		session = new SparkleSession();
+
+	return session;
+}
+
+void SparkleNodePrivate::openSession() const {
+	SparkleSession *s = state();
+	if(s->mySessionKey != NULL)
+		return;
+
+	s->mySessionKey = new BlowfishKey();
+	s->mySessionKey->generate();
+	s->keyAge.start();
+
+	s->hisSessionKey = new BlowfishKey();
 }
 
 SparkleNode::SparkleNode(SparkleNodePrivate &dd, QObject *parent) : QObject(parent), d_ptr(&dd) {
@@ -67,10 +162,12 @@ SparkleNode::SparkleNode(SparkleNodePrivate &dd, QObject *parent) : QObject(pare
 }
 
 SparkleNode::SparkleNode(Router &router, QHostAddress realIP, quint16 realPort) : QObject(&router), d_ptr(new SparkleNodePrivate(router, realIP, realPort)) {
-	connect(&d_ptr->negotiationTimer, SIGNAL(timeout()), SLOT(negotiationTimeout()));
+
 }
 
 SparkleNode::~SparkleNode() {
+	closeSession();
+
 	delete d_ptr;
 }
 
@@ -142,19 +239,133 @@ void SparkleNode::setBehindNAT(bool behindNAT) {
 	d->router.notifyNodeUpdated(this);
 }
 
-void SparkleNode::setHisSessionKey(const QByteArray &keyBytes) {
+void SparkleNode::setHisSessionKey(const QByteArray &keyBytes, quint8 epoch) {
 	Q_D(SparkleNode);
 	
-	d->hisSessionKey.setBytes(keyBytes);
-	d->keysNegotiated = true;
+	d->openSession();
+	d->session->hisSessionKey->setBytes(keyBytes);
+	d->session->hisKeyEpoch = epoch;
+	d->session->keysNegotiated = true;
+
+	delete d->session->hisPreviousKey;
+	d->session->hisPreviousKey = NULL;
 	
 	d->router.notifyNodeUpdated(this);
 }
 
+void SparkleNode::rotateHisSessionKey(const QByteArray &keyBytes, quint8 epoch) {
+	Q_D(SparkleNode);
+
+	d->openSession();
+	SparkleSession *s = d->session;
+
+	// a repeated Rekey whose acknowledgement was lost
+	if(epoch == s->hisKeyEpoch)
+		return;
+
+	delete s->hisPreviousKey;
+	s->hisPreviousKey = s->hisSessionKey;
+
+	s->hisSessionKey = new BlowfishKey();
+	s->hisSessionKey->setBytes(keyBytes);
+	s->hisKeyEpoch = epoch;
+}
+
+const BlowfishKey *SparkleNode::hisSessionKey(quint8 epoch) const {
+	Q_D(const SparkleNode);
+
+	if(d->session == NULL)
+		return NULL;
+
+	if(epoch == d->session->hisKeyEpoch)
+		return d->session->hisSessionKey;
+	else if(epoch == (quint8) (d->session->hisKeyEpoch - 1))
+		return d->session->hisPreviousKey;
+
+	return NULL;
+}
+
+quint8 SparkleNode::myKeyEpoch() const {
+	Q_D(const SparkleNode);
+
+	return d->session ? d->session->myKeyEpoch : 0;
+}
+
+quint8 SparkleNode::hisKeyEpoch() const {
+	Q_D(const SparkleNode);
+
+	return d->session ? d->session->hisKeyEpoch : 0;
+}
+
+const BlowfishKey *SparkleNode::startRekey() {
+	Q_D(SparkleNode);
+
+	d->openSession();
+	SparkleSession *s = d->session;
+
+	if(s->myNextKey == NULL) {
+		s->myNextKey = new BlowfishKey();
+		s->myNextKey->generate();
+	}
+
+	s->rekeySent.start();
+
+	return s->myNextKey;
+}
+
+bool SparkleNode::finishRekey(quint8 epoch) {
+	Q_D(SparkleNode);
+
+	SparkleSession *s = d->session;
+	if(s == NULL || s->myNextKey == NULL || epoch != (quint8) (s->myKeyEpoch + 1))
+		return false;
+
+	delete s->mySessionKey;
+	s->mySessionKey = s->myNextKey;
+	s->myNextKey = NULL;
+	s->myKeyEpoch = epoch;
+
+	s->bytesUnderKey = 0;
+	s->keyAge.start();
+	s->rekeySent.invalidate();
+
+	return true;
+}
+
+bool SparkleNode::isRekeyPending() const {
+	Q_D(const SparkleNode);
+
+	return d->session != NULL && d->session->myNextKey != NULL;
+}
+
+qint64 SparkleNode::msecsSinceRekey() const {
+	Q_D(const SparkleNode);
+
+	return (d->session && d->session->rekeySent.isValid()) ? d->session->rekeySent.elapsed() : -1;
+}
+
+void SparkleNode::countEncrypted(int bytes) {
+	Q_D(SparkleNode);
+
+	d->state()->bytesUnderKey += bytes;
+}
+
+quint64 SparkleNode::bytesUnderKey() const {
+	Q_D(const SparkleNode);
+
+	return d->session ? d->session->bytesUnderKey : 0;
+}
+
+qint64 SparkleNode::msecsUnderKey() const {
+	Q_D(const SparkleNode);
+
+	return (d->session && d->session->keyAge.isValid()) ? d->session->keyAge.elapsed() : -1;
+}
+
 bool SparkleNode::areKeysNegotiated() {
 	Q_D(const SparkleNode);
 
-	return d->keysNegotiated;
+	return d->session != NULL && d->session->keysNegotiated;
 }
 
 bool SparkleNode::setAuthKey(const RSAKeyPair &keyPair) {
@@ -164,18 +375,25 @@ bool SparkleNode::setAuthKey(const RSAKeyPair &keyPair) {
 bool SparkleNode::setAuthKey(const QByteArray &publicKey) {
 	Q_D(SparkleNode);
 
-	if(d->authKeyPresent) {
-		if(d->authKey.publicKey() != publicKey) {
+	SparkleSession *s = d->state();
+
+	if(s->authKeyPresent) {
+		if(s->authKey.publicKey() != publicKey) {
 			Log::warn("link: assigning new pubkey to authenticated node [%1]:%2") << d->realIP.toString() << d->realPort;
 		} else {
 			return true;
 		}
 	}
 
-	if(!d->authKey.setPublicKey(publicKey))
+	if(!s->authKey.setPublicKey(publicKey))
 		return false;
 
-	d->authKeyPresent = true;
+	// the key itself went away with the last session, but the address
+	// derived from it did not
+	if(!s->authKeyPresent && !d->sparkleMAC.isNull() && addressFromKey(&s->authKey) != d->sparkleMAC)
+		Log::warn("link: assigning new pubkey to known node [%1]:%2") << d->realIP.toString() << d->realPort;
+
+	s->authKeyPresent = true;
 
 	d->router.notifyNodeUpdated(this);
 
@@ -186,10 +404,12 @@ void SparkleNode::cloneKeys(SparkleNode *node) {
 	Q_D(SparkleNode);
 	
 	setAuthKey(node->authKey()->publicKey());
-	d->mySessionKey.setBytes(node->mySessionKey()->bytes());
+	d->openSession();
+	d->session->mySessionKey->setBytes(node->mySessionKey()->bytes());
+	d->session->myKeyEpoch = node->myKeyEpoch();
 	
 	if(node->areKeysNegotiated())
-		setHisSessionKey(node->hisSessionKey()->bytes());
+		setHisSessionKey(node->hisSessionKey()->bytes(), node->hisKeyEpoch());
 }
 
 SparkleAddress SparkleNode::addressFromKey(const RSAKeyPair *keyPair) {
@@ -203,7 +423,7 @@ SparkleAddress SparkleNode::addressFromKey(const RSAKeyPair *keyPair) {
 void SparkleNode::configure() {
 	Q_D(SparkleNode);
 	
-	d->sparkleMAC = addressFromKey(&d->authKey);
+	d->sparkleMAC = addressFromKey(&d->state()->authKey);
 }
 
 void SparkleNode::setMaster(bool isMaster) {
@@ -222,37 +442,370 @@ bool SparkleNode::isMaster() {
 bool SparkleNode::isQueueEmpty() {
 	Q_D(const SparkleNode);
 	
-	return d->queue.empty();
+	return d->session == NULL || d->session->queue.empty();
 }
 
 void SparkleNode::pushQueue(QByteArray data) {
 	Q_D(SparkleNode);
 
-	d->queue.append(data);
+	d->state()->queue.append(data);
 }
 
 QByteArray SparkleNode::popQueue() {
 	Q_D(SparkleNode);
 	
-	return d->queue.takeFirst();
+	return d->state()->queue.takeFirst();
 }
 
 void SparkleNode::flushQueue() {
 	Q_D(SparkleNode);
 	
-	d->queue.clear();
+	if(d->session != NULL)
+		d->session->queue.clear();
+}
+
+void SparkleNode::setNegotiationTimeout(int msec) {
+	Q_D(SparkleNode);
+
+	d->negotiationTimeout = msec;
+	if(d->session != NULL && d->session->negotiationTimer != NULL)
+		d->session->negotiationTimer->setInterval(msec);
+}
+
+bool SparkleNode::hasSession() const {
+	Q_D(const SparkleNode);
+
+	return d->session != NULL && d->session->mySessionKey != NULL;
+}
+
+void SparkleNode::closeSession() {
+	Q_D(SparkleNode);
+
+	delete d->session;
+	d->session = NULL;
+}
+
+void SparkleNode::touchUsed() {
+	Q_D(SparkleNode);
+
+	d->lastUsed.start();
+}
+
+qint64 SparkleNode::msecsSinceUsed() const {
+	Q_D(const SparkleNode);
+
+	return d->lastUsed.isValid() ? d->lastUsed.elapsed() : -1;
+}
+
+void SparkleNode::touchSent() {
+	Q_D(SparkleNode);
+
+	d->lastSent.start();
+}
+
+void SparkleNode::touchReceived() {
+	Q_D(SparkleNode);
+
+	d->lastReceived.start();
+}
+
+qint64 SparkleNode::msecsSinceSent() const {
+	Q_D(const SparkleNode);
+
+	return d->lastSent.isValid() ? d->lastSent.elapsed() : -1;
+}
+
+qint64 SparkleNode::msecsSinceReceived() const {
+	Q_D(const SparkleNode);
+
+	return d->lastReceived.isValid() ? d->lastReceived.elapsed() : -1;
+}
+
+qint64 SparkleNode::msecsSinceActive() const {
+	qint64 sent = msecsSinceSent(), received = msecsSinceReceived();
+
+	if(sent < 0)
+		return received;
+	else if(received < 0)
+		return sent;
+	else
+		return qMin(sent, received);
+}
+
+int SparkleNode::natTimeout() const {
+	Q_D(const SparkleNode);
+
+	return d->natTimeout;
+}
+
+void SparkleNode::setNATTimeout(int msec) {
+	Q_D(SparkleNode);
+
+	d->natTimeout = msec;
+}
+
+SparkleNode::NATType SparkleNode::natType() const {
+	Q_D(const SparkleNode);
+
+	return d->natType;
+}
+
+qint16 SparkleNode::natPortDelta() const {
+	Q_D(const SparkleNode);
+
+	return d->natPortDelta;
+}
+
+void SparkleNode::setNATType(NATType type, qint16 portDelta) {
+	Q_D(SparkleNode);
+
+	d->natType = type;
+	d->natPortDelta = portDelta;
+}
+
+quint32 SparkleNode::routeVersion() const {
+	Q_D(const SparkleNode);
+
+	return d->routeVersion;
+}
+
+void SparkleNode::setRouteVersion(quint32 version) {
+	Q_D(SparkleNode);
+
+	d->routeVersion = version;
+}
+
+qint64 SparkleNode::msecsKnown() const {
+	Q_D(const SparkleNode);
+
+	return d->known.elapsed();
+}
+
+quint32 SparkleNode::failures() const {
+	Q_D(const SparkleNode);
+
+	return d->failures;
+}
+
+void SparkleNode::countFailure() {
+	Q_D(SparkleNode);
+
+	d->failures++;
+}
+
+int SparkleNode::rtt() const {
+	Q_D(const SparkleNode);
+
+	return d->session ? d->session->rtt : -1;
+}
+
+void SparkleNode::startRTTSample() {
+	Q_D(SparkleNode);
+
+	d->state()->rttSample.start();
+}
+
+void SparkleNode::finishRTTSample() {
+	Q_D(SparkleNode);
+
+	if(d->session == NULL || !d->session->rttSample.isValid())
+		return;
+
+	int sample = d->session->rttSample.elapsed();
+	d->session->rttSample.invalidate();
+
+	addRTTSample(sample);
+}
+
+int SparkleNode::rttVariance() const {
+	Q_D(const SparkleNode);
+
+	return d->session ? d->session->rttVariance : 0;
+}
+
+qreal SparkleNode::lossRate() const {
+	Q_D(const SparkleNode);
+
+	return d->session ? d->session->loss : 0;
+}
+
+/* Smoothed RTT and its mean deviation, as in RFC 2988 */
+void SparkleNode::addRTTSample(int msec) {
+	Q_D(SparkleNode);
+
+	SparkleSession *s = d->state();
+
+	if(s->rtt < 0) {
+		s->rtt = msec;
+		s->rttVariance = msec / 2;
+	} else {
+		s->rttVariance = (s->rttVariance * 3 + qAbs(s->rtt - msec)) / 4;
+		s->rtt = (s->rtt * 7 + msec) / 8;
+	}
+}
+
+/* Only one probe is in flight at a time; 0 means that it is still awaited. */
+quint32 SparkleNode::startKeepaliveProbe(int lossTimeout) {
+	Q_D(SparkleNode);
+
+	SparkleSession *s = d->state();
+
+	if(s->probeOutstanding) {
+		if(s->probeSent.elapsed() < lossTimeout)
+			return 0;
+
+		s->loss += (1 - s->loss) / 8;
+		emit linkQualityChanged(this);
+	}
+
+	if(++s->probeSeq == 0)
+		s->probeSeq++;
+
+	s->probeOutstanding = true;
+	s->probeSent.start();
+
+	return s->probeSeq;
+}
+
+void SparkleNode::finishKeepaliveProbe(quint32 seq, int rtt) {
+	Q_D(SparkleNode);
+
+	SparkleSession *s = d->session;
+	if(s == NULL || !s->probeOutstanding || seq != s->probeSeq)
+		return;
+
+	s->probeOutstanding = false;
+	s->loss -= s->loss / 8;
+	addRTTSample(rtt);
+
+	emit linkQualityChanged(this);
+}
+
+qint64 SparkleNode::msecsSinceProbe() const {
+	Q_D(const SparkleNode);
+
+	return (d->session && d->session->probeSent.isValid()) ? d->session->probeSent.elapsed() : -1;
+}
+
+quint8 SparkleNode::cpuCount() const {
+	Q_D(const SparkleNode);
+
+	return d->cpuCount;
+}
+
+void SparkleNode::setCPUCount(quint8 count) {
+	Q_D(SparkleNode);
+
+	d->cpuCount = count;
+}
+
+bool SparkleNode::isLoadKnown() const {
+	Q_D(const SparkleNode);
+
+	return d->loadKnown;
+}
+
+quint32 SparkleNode::loadPeers() const {
+	Q_D(const SparkleNode);
+
+	return d->loadPeers;
+}
+
+quint32 SparkleNode::loadPPS() const {
+	Q_D(const SparkleNode);
+
+	return d->loadPPS;
+}
+
+quint8 SparkleNode::loadCPU() const {
+	Q_D(const SparkleNode);
+
+	return d->loadCPU;
+}
+
+void SparkleNode::setLoad(quint32 peers, quint32 pps, quint8 cpu) {
+	Q_D(SparkleNode);
+
+	d->loadKnown = true;
+	d->loadPeers = peers;
+	d->loadPPS = pps;
+	d->loadCPU = cpu;
+}
+
+quint8 SparkleNode::features() const {
+	Q_D(const SparkleNode);
+
+	return d->session ? d->session->features : 0;
+}
+
+void SparkleNode::setFeatures(quint8 features) {
+	Q_D(SparkleNode);
+
+	d->state()->features = features;
+}
+
+/* Incompressible traffic is only probed now and then: every miss doubles
+ * the number of packets sent raw before the next attempt, up to 64. */
+bool SparkleNode::shouldCompress() {
+	Q_D(SparkleNode);
+
+	SparkleSession *s = d->state();
+
+	if(s->compressionSkip > 0) {
+		s->compressionSkip--;
+		return false;
+	}
+
+	return true;
+}
+
+void SparkleNode::countCompression(int original, int compressed) {
+	Q_D(SparkleNode);
+
+	SparkleSession *s = d->state();
+
+	// saving less than an eighth is not worth the CPU
+	if(compressed * 8 > original * 7) {
+		s->compressionBackoff = qMin(s->compressionBackoff ? s->compressionBackoff * 2 : 1, 64);
+		s->compressionSkip = s->compressionBackoff;
+	} else {
+		s->compressionBackoff = 0;
+	}
+}
+
+ParityEncoder *SparkleNode::parityEncoder() {
+	Q_D(SparkleNode);
+
+	return &d->state()->parityEncoder;
+}
+
+ParityDecoder *SparkleNode::parityDecoder() {
+	Q_D(SparkleNode);
+
+	return &d->state()->parityDecoder;
 }
 
 void SparkleNode::negotiationStart() {
 	Q_D(SparkleNode);
 	
-	d->negotiationTimer.start();
+	d->openSession();
+	SparkleSession *s = d->session;
+
+	if(s->negotiationTimer == NULL) {
+		s->negotiationTimer = new QTimer(this);
+		s->negotiationTimer->setSingleShot(true);
+		s->negotiationTimer->setInterval(d->negotiationTimeout);
+		connect(s->negotiationTimer, SIGNAL(timeout()), SLOT(negotiationTimeout()));
+	}
+
+	s->negotiationTimer->start();
 }
 
 void SparkleNode::negotiationFinished() {
 	Q_D(SparkleNode);
 	
-	d->negotiationTimer.stop();
+	if(d->session != NULL && d->session->negotiationTimer != NULL)
+		d->session->negotiationTimer->stop();
 }
 
 void SparkleNode::negotiationTimeout() {
@@ -262,19 +815,21 @@ void SparkleNode::negotiationTimeout() {
 const BlowfishKey *SparkleNode::hisSessionKey() const {
 	Q_D(const SparkleNode);
 	
-	return &d->hisSessionKey;
+	d->openSession();
+	return d->session->hisSessionKey;
 }
 
 const BlowfishKey *SparkleNode::mySessionKey() const {
 	Q_D(const SparkleNode);
 	
-	return &d->mySessionKey;
+	d->openSession();
+	return d->session->mySessionKey;
 }
 
 const RSAKeyPair *SparkleNode::authKey() const {
 	Q_D(const SparkleNode);
 	
-	return &d->authKey;
+	return &d->state()->authKey;
 }
 
 const QHostAddress &SparkleNode::realIP() const {
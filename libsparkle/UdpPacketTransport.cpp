@@ -84,15 +84,24 @@ void UdpPacketTransport::endReceiving() {
 void UdpPacketTransport::haveDatagram() {
 	Q_D(UdpPacketTransport);
 	
+	QHostAddress host;
+	quint16 port;
+
 	while(d->socket->hasPendingDatagrams()) {
 		QByteArray data(d->socket->pendingDatagramSize(), 0);
-		QHostAddress host;
-		quint16 port;
 
 		d->socket->readDatagram(data.data(), data.size(), &host, &port);
 
-		emit receivedPacket(data, host, port);
+		if(sink) {
+			Endpoint from = { host.toIPv4Address(), port };
+			sink->receivePacket(data, from);
+		} else {
+			emit receivedPacket(data, host, port);
+		}
 	}
+
+	if(sink)
+		sink->receiveBatchDone();
 }
 
 void UdpPacketTransport::sendPacket(QByteArray &packet, QHostAddress host, quint16 port) {
@@ -19,14 +19,12 @@
 #ifndef __APPLICATION_LAYER_H__
 #define __APPLICATION_LAYER_H__
 
+#include <QByteArray>
 #include <Sparkle/Sparkle>
-
-class QByteArray;
+#include <Sparkle/SparkleAddress>
 
 namespace Sparkle {
 
-class SparkleAddress;
-
 class SPARKLE_DECL ApplicationLayer {
 public:
 	enum Encapsulation {
@@ -34,9 +32,21 @@ public:
 		Messaging	= 2,
 	};
 
+	struct DataPacket {
+		QByteArray	payload;
+		SparkleAddress	source;
+	};
+
 	virtual ~ApplicationLayer() { }
 
 	virtual void handleDataPacket(QByteArray &packet, SparkleAddress address) = 0;
+
+	/* Receives all packets for this layer from one transport read batch.
+	 * Layers which do not override this get them one by one. */
+	virtual void handleDataPackets(DataPacket *packets, int count) {
+		for(int i = 0; i < count; i++)
+			handleDataPacket(packets[i].payload, packets[i].source);
+	}
 };
 
 };
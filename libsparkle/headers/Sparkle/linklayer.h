@@ -21,23 +21,32 @@
 
 #include <QObject>
 #include <QHostInfo>
+#include <QHostAddress>
 #include <QTime>
+#include <QElapsedTimer>
+#include <QSet>
+#include <QVector>
+
+#include <time.h>
 
 #include <Sparkle/Sparkle>
 #include <Sparkle/RSAKeyPair>
 #include <Sparkle/SparkleAddress>
 #include <Sparkle/ApplicationLayer>
+#include <Sparkle/WireFormat>
+#include <Sparkle/PacketSink>
 
-class QHostAddress;
 class QTimer;
 
 namespace Sparkle {
 
 class SparkleNode;
+class EgressScheduler;
+class CryptoPipeline;
 class PacketTransport;
 class Router;
 
-class SPARKLE_DECL LinkLayer : public QObject
+class SPARKLE_DECL LinkLayer : public QObject, public PacketSink
 {
 	Q_OBJECT
 
@@ -46,7 +55,7 @@ public:
 
 	void attachApplicationLayer(ApplicationLayer::Encapsulation encap, ApplicationLayer* app);
 
-	bool createNetwork(QHostAddress localAddress, quint8 networkDivisor);
+	bool createNetwork(QHostAddress localAddress, quint8 networkDivisor, quint8 replicationFactor = 0);
 	bool joinNetwork(QHostAddress remoteAddress, quint16 remotePort, bool forceBehindNAT);
 
 	// fixme Add some kind of DHCP to Ethernet layer
@@ -54,8 +63,27 @@ public:
 
 	void sendDataPacket(SparkleAddress address, ApplicationLayer::Encapsulation encap, QByteArray &packet);
 
+	virtual void receivePacket(QByteArray &packet, const Endpoint &from);
+	virtual void receiveBatchDone();
+
 	bool isJoined();
 
+	void setLANDiscoveryEnabled(bool enabled);
+	void setSessionLimits(int maxSessions, int idleTimeout);
+
+	bool setContactsFile(QString filename);
+	void setPrewarmPeers(int count);
+
+	void setJoinRetries(int retries);
+	void setAdmissionRate(int registrationsPerSecond);
+
+	void setEgressRates(int bytesPerSecond, int peerBytesPerSecond);
+
+	void setCompressionEnabled(bool enabled);
+	void setFECEnabled(bool enabled);
+
+	void setCryptoWorkers(int count);
+
 	Router& router();
 
 public slots:
@@ -71,18 +99,251 @@ signals:
 	void routeMissing(SparkleAddress addr);
 
 private slots:
-	void handlePacket(QByteArray &data, QHostAddress host, quint16 port, bool isEncrypted = false);
 	void pingTimeout();
 	void negotiationTimeout(SparkleNode* node);
 	void joinTimeout();
+	void rejoin();
+	void retryRegistration();
+	void admitQueuedRegistration();
+	void flushParity();
 	void keepNATAlive();
+	void natProbeTimeout();
+	void sendDueNATProbeReplies();
+	void advertiseLoad();
+	void reconcileRoutes();
+	void probeLinks();
+	void sendDuePunches();
+	void sendLANBeacon();
+	void evictSessions();
+	void rotateKeys();
+
+	void sendCiphertext(QByteArray packet, QHostAddress host, quint16 port, int dataFlow);
+	void handleDecryptedPacket(QByteArray data, quint32 address, quint16 port);
+	void prewarm();
+	void saveContacts();
 
 private:
 	/* History:
 	 *  - v15: endianness compatibility
+	 *  - v16: NAT binding lifetime probes
+	 *  - v17: master load advertisements,
+	 *         CPU count in registration requests, batched routes,
+	 *         versioned routes and master route table digests,
+	 *         partitioned route registry, keepalive probes and replies,
+	 *         relayed data packets, NAT classification and coordinated punching,
+	 *         signed LAN beacons, indirect probes and failure gossip,
+	 *         session close notifications, standby replication and master switch,
+	 *         registration retry hints, negotiated payload compression,
+	 *         parity packets, packed structs without padding,
+	 *         session key epochs and in-band rekeying
 	 */
 	enum {
-		ProtocolVersion	= 15,
+		ProtocolVersion	= 17,
+	};
+
+	/* Optional features announced in key exchanges */
+	enum {
+		FeatureCompression		= 1,
+		FeatureFEC			= 2,
+	};
+
+	/* Data packet flags */
+	enum {
+		DataCompressed			= 1,
+	};
+
+	/* Payloads shorter than this are sent raw, bytes */
+	enum {
+		CompressMinSize			= 128,
+	};
+
+	/* Data packets of one receive batch are held back and handed to each
+	 * application layer together, but never more than this many at once */
+	enum {
+		DeliveryBatchMax		= 64,
+	};
+
+	/* Parity protection for lossy links. One parity packet follows every
+	 * k data packets, with k chosen so that a group loses about a fifth of
+	 * a packet on average; links losing less than FECLossThreshold (per
+	 * mille) are not protected. Unfinished groups are closed after
+	 * FECFlushDelay ms, so sparse traffic is protected too. */
+	enum {
+		FECLossThreshold		= 10,
+		FECGroupLoss			= 200,
+		FECGroupMin			= 2,
+		FECGroupMax			= 16,
+		FECFlushDelay			= 40,
+	};
+
+	/* Join timeouts, ms. Until the round-trip time to the bootstrap node
+	 * is known the defaults are used; after that every timeout is derived
+	 * from the measured RTT and clamped to [Min, Default]. */
+	enum {
+		JoinStepTimeout			= 15000,
+		JoinStepTimeoutMin		= 3000,
+
+		PingWaitTimeout			= 10000,
+		PingWaitTimeoutMin		= 1000,
+
+		PingSettleTimeoutMin		= 200,
+		PingSettleTimeoutMax		= 1000,
+
+		NegotiationTimeout		= 5000,
+		NegotiationTimeoutMin		= 1500,
+	};
+
+	/* Masters admit registrations at a limited rate and queue the rest;
+	 * a queued node, and beyond the queue a rejected one, is told when
+	 * to retry. Routes of admitted nodes are announced to other masters
+	 * in batches. A failed join is retried with exponential backoff and
+	 * equal jitter, ms. */
+	enum {
+		AdmissionRateDefault		= 50,
+		AdmissionQueueMax		= 64,
+
+		RegisterRetryMin		= 1000,
+		RegisterRetryMax		= 60000,
+
+		RejoinBackoffMin		= 2000,
+		RejoinBackoffMax		= 300000,
+	};
+
+	/* NAT keepalives, ms. A keepalive is sent to a peer only when nothing
+	 * else was sent to it for 2/3 of its binding lifetime estimate. The
+	 * estimate starts at NATTimeoutDefault and is refined by probing the
+	 * master we have registered on: it is asked to answer after a delay
+	 * while we keep silent, and the delay is binary-searched. */
+	enum {
+		NATKeepaliveTick		= 2000,
+
+		NATTimeoutDefault		= 15000,
+		NATTimeoutMin			= 5000,
+		NATTimeoutMax			= 180000,
+
+		NATProbeInterval		= 60000,
+		NATProbeMargin			= 2000,
+		NATProbeMaxPending		= 1024,
+
+		/* slaves we haven't exchanged anything with for this long
+		 * are not kept alive; the master will punch a new hole */
+		NATSessionIdleTimeout		= 120000,
+	};
+
+	enum {
+		LoadAdvertisementInterval	= 30000,
+	};
+
+	/* Keepalives double as RTT and loss probes. Besides those sent to keep
+	 * NAT bindings, each round measures at most LinkProbeSample active
+	 * sessions whose last sample is older than LinkProbeInterval. A probe
+	 * which has no reply when the next one is due is counted lost. */
+	enum {
+		LinkProbeInterval		= 10000,
+		LinkProbeLossTimeout		= 5000,
+		LinkProbeSample			= 4,
+	};
+
+	/* Failure detection on masters, SWIM-like. A peer which stays silent in
+	 * spite of link probes is probed indirectly through a few other masters
+	 * and becomes suspect; unless someone hears from it before the suspicion
+	 * times out, it is reaped. Suspicions and refutations are piggybacked
+	 * on keepalives between masters, at most FailureGossipMax per packet. */
+	enum {
+		FailureSilenceTimeout		= 30000,
+		FailureSuspicionTimeout		= 30000,
+		FailureIndirectProbes		= 3,
+		FailureGossipMax		= 8,
+	};
+
+	/* Sessions unused (keepalives aside) for the idle timeout are closed, and
+	 * so are the least recently used ones beyond the limit, if it is set;
+	 * keys are renegotiated on demand. Sessions with masters are kept. */
+	enum {
+		SessionSweepInterval		= 10000,
+		SessionIdleTimeoutDefault	= 600000,
+	};
+
+	/* Session keys are replaced in band after encrypting RekeyBytes or
+	 * after RekeyInterval ms, checked on every session sweep. Both keys
+	 * stay valid until the peer acknowledges the new one, so nothing is
+	 * queued; an unacknowledged Rekey is repeated after RekeyRetryInterval. */
+	enum {
+		RekeyBytes			= 1 << 30,
+		RekeyInterval			= 3600000,
+		RekeyRetryInterval		= 10000,
+	};
+
+	/* Peers we start talking to most often are counted across runs and
+	 * have their sessions negotiated in advance after joining, one per
+	 * tick while our CPU usage stays within the budget, percent. Counts are
+	 * halved on every load, so peers we stopped using fade away. Only the
+	 * ContactsPerPrewarmPeer * prewarmPeers most frequent ones are kept. */
+	enum {
+		PrewarmPeersDefault		= 8,
+		PrewarmInterval			= 500,
+		PrewarmCPUBudget		= 25,
+		ContactsPerPrewarmPeer		= 4,
+		ContactEpisodeGap		= 60000,
+		ContactsSaveInterval		= 300000,
+		ContactsMagic			= 0x434E5453,	// 'CNTS'
+	};
+
+	/* When a slave-slave link cannot be negotiated, data goes through a
+	 * relay; direct negotiation is retried at most once per interval. */
+	enum {
+		RelayUpgradeInterval		= 30000,
+	};
+
+	/* Hole punching. Both peers send bursts at the same moment, set by
+	 * their master; mappings of a symmetric NAT are predicted from the port
+	 * delta between two mappings seen during join. */
+	enum {
+		PunchAttempts			= 3,
+		PunchRetryInterval		= 500,
+		PunchLinger			= 2000,
+		PunchPredictionRange		= 8,
+		PunchPortDeltaMax		= 1000,
+	};
+
+	/* Signed beacons are broadcast on the local segment to our own port and
+	 * to the default one; peers listening anywhere else are not found.
+	 * A beacon can be replayed, so the endpoint is switched only after the
+	 * peer signs a nonce sent there within LANChallengeTimeout msecs.
+	 * At most LANChallengeAnswers challenges are answered per beacon. */
+	enum {
+		LANBeaconInterval		= 30000,
+		LANBeaconPort			= 1801,
+		LANChallengeTimeout		= 2000,
+		LANChallengeAnswers		= 8,
+	};
+
+	/* Route batches are kept under the common path MTU together with the
+	 * packet header, Blowfish padding and UDP/IP headers. */
+	enum {
+		RouteBatchPayloadMax		= 1200,
+	};
+
+	/* Masters compare route table digests with a random peer master and
+	 * exchange only the entries of buckets which differ. Removed entries are
+	 * remembered as tombstones long enough to reach every master; the
+	 * remaining lifetime travels with them, so passing one around does not
+	 * keep it alive. */
+	enum {
+		RouteDigestInterval		= 20000,
+		RouteDigestBuckets		= 64,
+		RouteTombstoneLifetime		= 600000,
+	};
+
+	/* Average master load score (see Router::loadScore) beyond which the
+	 * master ratio is raised or lowered by one divisor step. The effective
+	 * divisor stays within [networkDivisor / 2, networkDivisor * 2]. */
+	enum {
+		ControlLoadLow			= 100,
+		ControlLoadHigh			= 400,
+
+		NetworkDivisorMin		= 1,
+		NetworkDivisorMax		= 50,
 	};
 
 	enum packet_type_t {
@@ -108,6 +369,8 @@ private:
 		RegisterReply			= 17,
 
 		Route				= 18,
+		RouteBatch			= 20,
+		RouteDigest			= 31,
 
 		RouteRequest			= 19,
 		RouteInvalidate			= 21,
@@ -121,86 +384,237 @@ private:
 
 		BacklinkRedirect		= 26,
 
+		NATProbe			= 27,
+		NATProbeReply			= 28,
+
+		LoadAdvertisement		= 29,
+
 		DataPacket			= 30,
+		RelayedDataPacket		= 32,
+
+		PunchRequest			= 33,
+		Punch				= 34,
+
+		LANBeacon			= 35,
+
+		IndirectProbe			= 36,
+		IndirectProbeAck		= 37,
+
+		SessionClose			= 38,
+
+		StandbyReplica			= 39,
+		MasterSwitch			= 40,
+
+		RegisterRetry			= 41,
+
+		FECDataPacket			= 42,
+		FECParityPacket			= 43,
+
+		Rekey				= 44,
+		RekeyAck			= 45,
+
+		LANChallenge			= 46,
+		LANChallengeReply		= 47,
 	};
 
 	struct packet_header_t {
-		quint16	type;
-		quint16	length;
+		BigEndian<quint16>	type;
+		BigEndian<quint16>	length;
 	};
 
 	struct protocol_version_reply_t {
-		quint32	version;
+		BigEndian<quint32>	version;
 	};
 
 	struct key_exchange_t {
-		quint8		needOthersKey;
-		quint32		cookie;
+		quint8			needOthersKey;
+		quint8			features;
+		BigEndian<quint32>	cookie;
+		/* of the session key being sent, if any */
+		quint8			epoch;
+	};
+
+	/* followed by data encrypted with the key of that epoch */
+	struct encrypted_packet_t {
+		quint8			epoch;
+	};
+
+	/* followed by the new key in a Rekey, alone in a RekeyAck */
+	struct rekey_t {
+		quint8			epoch;
 	};
 
 	struct master_node_reply_t {
-		quint32		addr;
-		quint16		port;
+		BigEndian<quint32>	addr;
+		BigEndian<quint16>	port;
+		/* requester endpoint as seen by the replying node */
+		BigEndian<quint32>	observedAddr;
+		BigEndian<quint16>	observedPort;
 	};
 
 	struct ping_request_t {
-		quint32		addr;
-		quint16		port;
-		quint8		count;
+		BigEndian<quint32>	addr;
+		BigEndian<quint16>	port;
+		quint8			count;
 	};
 
 	struct ping_t {
-		quint32		addr;
-		quint16		port;
+		BigEndian<quint32>	addr;
+		BigEndian<quint16>	port;
 	};
 
 	struct register_request_t {
-		quint8		isBehindNAT;
+		quint8			isBehindNAT;
+		quint8			cpuCount;
+		/* endpoint seen by the bootstrap node, 0 if it is the master itself */
+		BigEndian<quint32>	observedIP;
+		BigEndian<quint16>	observedPort;
+	};
+
+	struct register_retry_t {
+		BigEndian<quint32>	delay;
 	};
 
 	struct register_reply_t {
-		quint8		networkDivisor;
-		quint8		isMaster;
-		quint8		sparkleMAC[SPARKLE_ADDRESS_SIZE];
+		quint8			networkDivisor;
+		quint8			replicationFactor;
+		quint8			isMaster;
+		quint8			sparkleMAC[SPARKLE_ADDRESS_SIZE];
 		/* filled only when NAT is detected */
-		quint32		realIP;
-		quint16		realPort;
+		BigEndian<quint32>	realIP;
+		BigEndian<quint16>	realPort;
 	};
 
 	struct route_t {
-		quint8		sparkleMAC[SPARKLE_ADDRESS_SIZE];
-		quint32		realIP;
-		quint16		realPort;
-		quint8		isMaster;
-		quint8		isBehindNAT;
-		quint8		tunnelRequest;
+		quint8			sparkleMAC[SPARKLE_ADDRESS_SIZE];
+		BigEndian<quint32>	realIP;
+		BigEndian<quint16>	realPort;
+		quint8			isMaster;
+		quint8			isBehindNAT;
+		quint8			tunnelRequest;
+		quint8			isRemoved;
+		BigEndian<quint32>	version;
+		quint8			natType;
+		BigEndian<quint16>	natPortDelta;
+		BigEndian<quint32>	lifetime;	/* msecs a removed entry is remembered */
+	};
+
+	enum {
+		KeepaliveProbe			= 0x01,
+		KeepaliveReply			= 0x02,
+	};
+
+	/* followed by up to FailureGossipMax gossip_t between masters */
+	struct keepalive_t {
+		BigEndian<quint32>	seq;
+		BigEndian<quint32>	timestamp;
+		quint8			flags;
+	};
+
+	enum gossip_state_t {
+		GossipAlive			= 1,
+		GossipSuspect			= 2,
+	};
+
+	struct gossip_t {
+		quint8			sparkleMAC[SPARKLE_ADDRESS_SIZE];
+		quint8			state;
+	};
+
+	struct indirect_probe_t {
+		quint8			sparkleMAC[SPARKLE_ADDRESS_SIZE];
+	};
+
+	struct punch_request_t {
+		quint8			sparkleMAC[SPARKLE_ADDRESS_SIZE];
+		BigEndian<quint32>	realIP;
+		BigEndian<quint16>	realPort;
+		quint8			natType;
+		BigEndian<quint16>	natPortDelta;
+		BigEndian<quint32>	nonce;
+		BigEndian<quint16>	delay;
+	};
+
+	struct punch_t {
+		quint8			sparkleMAC[SPARKLE_ADDRESS_SIZE];
+		BigEndian<quint32>	nonce;
+		quint8			isReply;
+	};
+
+	/* followed by public key and signature of everything before it */
+	struct lan_beacon_t {
+		quint8			sparkleMAC[SPARKLE_ADDRESS_SIZE];
+		BigEndian<quint16>	port;
+		BigEndian<quint16>	keyLength;
+	};
+
+	/* a reply is followed by signature of the challenge */
+	struct lan_challenge_t {
+		quint8			sparkleMAC[SPARKLE_ADDRESS_SIZE];
+		BigEndian<quint32>	nonce;
+	};
+
+	struct route_digest_t {
+		quint8			isReply;
+		BigEndian<quint32>	hashes[RouteDigestBuckets];
 	};
 
 	struct route_request_t {
-		quint8		sparkleMAC[SPARKLE_ADDRESS_SIZE];
-		quint8		length;
+		quint8			sparkleMAC[SPARKLE_ADDRESS_SIZE];
+		quint8			length;
 	};
 
 	struct route_invalidate_t {
-		quint32		realIP;
-		quint16		realPort;
+		BigEndian<quint32>	realIP;
+		BigEndian<quint16>	realPort;
 	};
 
 	struct route_missing_t {
-		quint8		sparkleMAC[SPARKLE_ADDRESS_SIZE];
+		quint8			sparkleMAC[SPARKLE_ADDRESS_SIZE];
 	};
 
 	struct role_update_t {
-		quint8		isMasterNow;
+		quint8			isMasterNow;
 	};
 
 	struct backlink_redirect_t {
-		quint32		realIP;
-		quint16		realPort;
+		BigEndian<quint32>	realIP;
+		BigEndian<quint16>	realPort;
+	};
+
+	struct nat_probe_t {
+		BigEndian<quint32>	delay;
+	};
+
+	struct load_advertisement_t {
+		BigEndian<quint32>	peers;
+		BigEndian<quint32>	pps;
+		quint8			cpu;
 	};
 
 	struct data_packet_t {
-		quint16		encapsulation;
+		BigEndian<quint16>	encapsulation;
+		quint8			flags;
+	};
+
+	/* followed by data_packet_t */
+	struct fec_data_t {
+		BigEndian<quint16>	group;
+		quint8			index;
+	};
+
+	/* followed by XOR of the group packets */
+	struct fec_parity_t {
+		BigEndian<quint16>	group;
+		quint8			count;
+		BigEndian<quint16>	lengths;
+	};
+
+	/* followed by data_packet_t */
+	struct relayed_data_packet_t {
+		quint8			destination[SPARKLE_ADDRESS_SIZE];
+		quint8			source[SPARKLE_ADDRESS_SIZE];
+		quint8			hops;
 	};
 
 	typedef struct {
@@ -218,12 +632,19 @@ private:
 	};
 
 	bool initTransport();
+	bool startJoin();
 
 	SparkleNode* wrapNode(QHostAddress host, quint16 port);
+	SparkleNode* wrapNode(const Endpoint &from);
+
+	void handlePacket(QByteArray &data, const Endpoint &from, bool isEncrypted = false);
 
 	bool isMaster();
 
-	void sendPacket(packet_type_t type, QByteArray data, SparkleNode* node);
+	static QByteArray framePacket(packet_type_t type, const QByteArray &payload);
+
+	/* dataFlow is the encapsulation of bulk data, -1 for everything else */
+	void sendPacket(packet_type_t type, QByteArray data, SparkleNode* node, int dataFlow = -1);
 	void sendEncryptedPacket(packet_type_t type, QByteArray data, SparkleNode *node, bool skipTunnel = false);
 	void encryptAndSend(QByteArray data, SparkleNode *node);
 
@@ -232,9 +653,16 @@ private:
 		PacketSizeGreater
 	};
 
-	bool checkPacketSize(QByteArray& payload, quint16 requiredSize,
+	bool checkPacketSize(const QByteArray& payload, quint16 requiredSize,
 					SparkleNode* node, const char* packetName,
 							packet_size_class_t sizeClass = PacketSizeEqual);
+
+	/* a view which passes is valid for as long as its packet lives */
+	template<typename T> bool checkPacketSize(const WireView<T> &view,
+					SparkleNode* node, const char* packetName,
+							packet_size_class_t sizeClass = PacketSizeEqual) {
+		return checkPacketSize(view.bytes(), view.requiredSize(), node, packetName, sizeClass);
+	}
 	bool checkPacketExpection(SparkleNode* node, const char* packetName, join_step_t neededStep);
 
 	void sendProtocolVersionRequest(SparkleNode* node);
@@ -249,6 +677,12 @@ private:
 	void sendSessionKeyExchange(SparkleNode* node, bool needHisKey);
 	void handleSessionKeyExchange(QByteArray &payload, SparkleNode* node);
 
+	void sendRekey(SparkleNode* node);
+	void handleRekey(QByteArray &payload, SparkleNode* node);
+
+	void sendRekeyAck(SparkleNode* node, quint8 epoch);
+	void handleRekeyAck(QByteArray &payload, SparkleNode* node);
+
 	void sendLocalRewritePacket(SparkleNode* node);
 	void handleLocalRewritePacket(QByteArray &payload, SparkleNode* node);
 
@@ -269,16 +703,39 @@ private:
 	void sendPing(SparkleNode* node);
 	void handlePing(QByteArray &payload, SparkleNode* node);
 	void joinGotPinged();
+	void applyJoinRTT(int rtt);
 
 	void sendRegisterRequest(SparkleNode* node, bool isBehindNAT);
 	void handleRegisterRequest(QByteArray &payload, SparkleNode* node);
 
+	void admitRegistration(SparkleNode* node, const register_request_t* req);
+	void flushAnnouncements();
+
 	void sendRegisterReply(SparkleNode* node);
 	void handleRegisterReply(QByteArray &payload, SparkleNode* node);
 
+	void sendRegisterRetry(SparkleNode* node, int delay);
+	void handleRegisterRetry(QByteArray &payload, SparkleNode* node);
+	int queuedRetryDelay(int position);
+
 	void sendRoute(SparkleNode* node, SparkleNode* target, bool tunnelRequest = false);
 	void handleRoute(QByteArray &payload, SparkleNode* node);
 
+	void sendRouteBatch(SparkleNode* node, QList<SparkleNode*> targets);
+	void handleRouteBatch(QByteArray &payload, SparkleNode* node);
+
+	void sendRouteEntries(SparkleNode* node, QByteArray entries, packet_type_t type = RouteBatch);
+	void fillRoute(route_t* route, SparkleNode* target, bool tunnelRequest);
+	void applyRoute(const route_t* route);
+
+	void sendRouteDigest(SparkleNode* node, bool isReply);
+	void handleRouteDigest(QByteArray &payload, SparkleNode* node);
+	void sendRouteBuckets(SparkleNode* node, quint64 buckets);
+
+	SparkleNode* selectOwner(QByteArray addressPrefix);
+	void announceMaster(SparkleNode* master);
+	void rebalanceRoutes();
+
 	void sendRouteRequest(SparkleAddress mac);
 	void handleRouteRequest(QByteArray &payload, SparkleNode* node);
 
@@ -294,39 +751,242 @@ private:
 	void sendPlainKeepalive(SparkleNode* node);
 	void sendKeepalive(SparkleNode* node, bool skipTunnel = false);
 	void handleKeepalive(QByteArray &payload, SparkleNode* node);
+	void handlePlainKeepalive(QByteArray &payload, SparkleNode* node);
+	void sendKeepaliveReply(SparkleNode* node, const keepalive_t* probe);
+
+	int keepaliveInterval(SparkleNode* node);
+
+	void sendNATProbe(SparkleNode* node, quint32 delay);
+	void handleNATProbe(QByteArray &payload, SparkleNode* node);
+
+	void sendNATProbeReply(SparkleNode* node, quint32 delay);
+	void handleNATProbeReply(QByteArray &payload, SparkleNode* node);
+
+	void startNATProbe();
+	void finishNATProbe(bool arrived);
+
+	void measureLoad();
+	void sendLoadAdvertisement(SparkleNode* node);
+	void handleLoadAdvertisement(QByteArray &payload, SparkleNode* node);
 
 	void sendBacklinkRedirect(SparkleNode* node);
 	void handleBacklinkRedirect(QByteArray &payload, SparkleNode* node);
 
+	void classifyNAT(SparkleNode* node, QHostAddress observedIP, quint16 observedPort);
+
+	void sendPunchRequest(SparkleNode* node, SparkleNode* peer, quint32 nonce, int delay);
+	void handlePunchRequest(QByteArray &payload, SparkleNode* node);
+
+	void sendPunch(QHostAddress host, quint16 port, quint32 nonce, bool isReply);
+	void handlePunch(QByteArray &payload, SparkleNode* node);
+
+	void handleLANBeacon(QByteArray &payload, SparkleNode* node);
+	void sendLANChallenge(SparkleAddress mac, QByteArray key, QHostAddress host, quint16 port);
+	void handleLANChallenge(QByteArray &payload, SparkleNode* node);
+	void handleLANChallengeReply(QByteArray &payload, SparkleNode* node);
+	void releaseSpooledNode(SparkleNode* node, const char* reason);
+	void forgetNode(SparkleNode* node, const char* reason);
+	void removeRoute(SparkleNode* node, const char* reason);
+
+	void closeSession(SparkleNode* node);
+
+	SparkleNode* selectStandby();
+	SparkleNode* findSpooledNode(SparkleAddress mac);
+	void refreshStandby();
+	void replicateHomeSlave(SparkleNode* slave, bool removed);
+	void forgetHomeSlave(SparkleNode* node);
+	void adoptSlaves(SparkleAddress master);
+	void handleStandbyReplica(QByteArray &payload, SparkleNode* node);
+
+	void sendMasterSwitch(SparkleNode* node);
+	void handleMasterSwitch(QByteArray &payload, SparkleNode* node);
+
+	void countContact(SparkleAddress address, SparkleNode* node);
+	void trimContacts();
+	void startPrewarm();
+	void handleSessionClose(QByteArray &payload, SparkleNode* node);
+
+	qint64 failureSilence(SparkleNode* node);
+	void detectFailures();
+	void suspect(SparkleNode* node);
+	void refute(SparkleAddress mac);
+	void reap(SparkleNode* node);
+	void queueGossip(SparkleAddress mac, gossip_state_t state);
+	QByteArray takeGossip();
+	void handleGossip(const gossip_t* gossip, SparkleNode* node);
+
+	void sendIndirectProbe(SparkleNode* node, SparkleNode* target);
+	void handleIndirectProbe(QByteArray &payload, SparkleNode* node);
+
+	void sendIndirectProbeAck(SparkleNode* node, SparkleAddress target);
+	void handleIndirectProbeAck(QByteArray &payload, SparkleNode* node);
+	void answerIndirectProbes(SparkleNode* target);
+
 	void sendExitNotification(SparkleNode* node);
 	void handleExitNotification(QByteArray &payload, SparkleNode* node);
-	void reincarnateSomeone();
+
+	bool mastersInsufficient(int nodeCount);
+	void adaptNetworkDivisor();
+	int promotionScore(SparkleNode* node);
+	SparkleNode* selectPromotionCandidate();
+	bool isPromotionLeader();
+	void reincarnateSomeone(SparkleNode* target = NULL);
 
 	/* see sendDataPacket(...) on top */
 	void handleDataPacket(QByteArray &payload, SparkleNode* node);
+	void deliverDataPacket(QByteArray &packet, SparkleAddress source, SparkleNode* node);
+	void compressDataPacket(QByteArray &packet, SparkleNode* node);
+	void flushDeliveries();
+
+	int parityGroupSize(SparkleNode* node);
+	void sendProtectedDataPacket(QByteArray packet, SparkleNode* node);
+	void handleFECDataPacket(QByteArray &payload, SparkleNode* node);
+
+	void sendParityPacket(SparkleNode* node);
+	void handleFECParityPacket(QByteArray &payload, SparkleNode* node);
+
+	SparkleNode* selectRelay(SparkleNode* target);
+	void sendRelayedDataPacket(SparkleNode* target, QByteArray packet);
+	void handleRelayedDataPacket(QByteArray &payload, SparkleNode* node);
 
 	void cleanup();
 
 	RSAKeyPair &hostKeyPair;
 	Router &_router;
 	PacketTransport& transport;
+	EgressScheduler* egress;
+	CryptoPipeline* crypto;
 
 	QList<SparkleNode*> nodeSpool;
 	QList<SparkleNode*> awaitingNegotiation;
 	QHash<SparkleAddress, QList<QByteArray> > queuedData;
 	QHash<quint32, SparkleNode*> cookies;
 	QHash<ApplicationLayer::Encapsulation, ApplicationLayer*> appLayers;
+	QHash<ApplicationLayer::Encapsulation, QVector<ApplicationLayer::DataPacket> > pendingDeliveries;
+	int pendingDeliveryCount;
+	bool receivingBatch;
+
+	struct relay_t {
+		SparkleAddress	relay;
+		QElapsedTimer	lastUpgrade;
+	};
+
+	QHash<SparkleAddress, relay_t> relays;
+
+	/* Every master replicates the routes of slaves registered on it to its
+	 * standby, the next master by address; the standby adopts them when the
+	 * master is gone. A slave remembers the master it is homed on. */
+	QSet<SparkleAddress> homeSlaves;
+	SparkleAddress standbyMAC, homeMaster;
+	QHash<SparkleAddress, QHash<SparkleAddress, QByteArray> > standbyReplicas;
 
-	quint8 networkDivisor;
+	quint8 networkDivisor, effectiveDivisor;
+
+	/* 0 means every master holds every route */
+	quint8 replicationFactor;
 
 	bool joined;
 	join_step_t joinStep;
 
 	QTimer *pingTimer, *joinTimer, *natKeepaliveTimer;
+	QTimer *natProbeTimer, *natProbeReplyTimer, *loadTimer, *routeDigestTimer, *linkProbeTimer, *punchTimer, *lanBeaconTimer;
+	QTimer *sessionTimer, *prewarmTimer, *contactsTimer;
+	QTimer *rejoinTimer, *registerRetryTimer, *admissionTimer, *parityTimer;
 	SparkleNode* joinMaster;
 	unsigned joinPingsEmitted, joinPingsArrived;
 	ping_t joinPing;
-	bool forceBehindNAT, preparingForShutdown;
+	QHostAddress joinObservedIP;
+	quint16 joinObservedPort;
+	QTime joinRTTTimer;
+	int joinRTT, nodeNegotiationTimeout;
+	bool forceBehindNAT, preparingForShutdown, lanDiscovery, joinBehindNAT, compression, fec;
+
+	QHostAddress joinRemoteIP;
+	quint16 joinRemotePort;
+	int joinAttempt, joinRetries;
+
+	struct pending_registration_t {
+		QHostAddress		host;
+		quint16			port;
+		register_request_t	request;
+	};
+
+	QList<pending_registration_t> admissionQueue;
+	QHash<SparkleAddress, QList<SparkleAddress> > pendingAnnounces;
+	int admissionRate;
+
+	/* 0 means no limit */
+	int sessionLimit, sessionIdleTimeout;
+
+	QString contactsFile;
+	QHash<SparkleAddress, quint32> contacts;
+	QList<SparkleAddress> prewarmQueue;
+	QSet<SparkleAddress> prewarmRoutes;
+	int prewarmPeers;
+	qint64 prewarmTickAt;
+	clock_t prewarmCPUTime;
+
+	struct pending_nat_probe_t {
+		QHostAddress	host;
+		quint16		port;
+		quint32		delay;
+		qint64		due;
+	};
+
+	QElapsedTimer clock;
+	QList<pending_nat_probe_t> pendingNATProbes;
+
+	struct pending_punch_t {
+		SparkleAddress	peer;
+		QHostAddress	host;
+		quint16		port;
+		quint8		natType;
+		qint16		natPortDelta;
+		quint32		nonce;
+		int		attempts;
+		qint64		due;
+	};
+
+	QList<pending_punch_t> pendingPunches;
+
+	struct pending_lan_challenge_t {
+		SparkleAddress	peer;
+		QByteArray	key;
+		QHostAddress	host;
+		quint16		port;
+		quint32		nonce;
+		qint64		sent;
+	};
+
+	QList<pending_lan_challenge_t> pendingLANChallenges;
+	int lanChallengesAnswered;
+
+	/* clock.elapsed() when a peer became suspect or was last vouched for */
+	QHash<SparkleAddress, qint64> suspects, vouches;
+
+	struct pending_gossip_t {
+		SparkleAddress	node;
+		gossip_state_t	state;
+		int		transmissions;
+	};
+
+	QList<pending_gossip_t> pendingGossip;
+
+	struct pending_indirect_probe_t {
+		SparkleAddress	requester;
+		SparkleAddress	target;
+		qint64		since;
+	};
+
+	QList<pending_indirect_probe_t> pendingIndirectProbes;
+
+	quint32 packetCount;
+	qint64 loadMeasuredAt;
+	clock_t loadCPUTime;
+
+	SparkleNode* natProbeTarget;
+	bool natProbeInFlight;
+	int natProbeDelay, natTimeoutConfirmed, natTimeoutCeiling, natTimeoutEstimate;
 
 	static const packet_handler_t packetHandlers[];
 };
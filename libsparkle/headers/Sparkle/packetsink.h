@@ -0,0 +1,48 @@
+/*
+ * Sparkle - zero-configuration fully distributed self-organizing encrypting VPN
+ * Copyright (C) 2009 Sergey Gridassov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PACKET_SINK_H__
+#define __PACKET_SINK_H__
+
+#include <Sparkle/Sparkle>
+
+class QByteArray;
+
+namespace Sparkle {
+
+/* IPv4 endpoint as plain integers, so that nothing is allocated per datagram */
+struct Endpoint {
+	quint32		address;
+	quint16		port;
+};
+
+/* Receives datagrams from a transport by a plain virtual call. This is the
+ * data path; transports still emit receivedPacket() when no sink is set. */
+class SPARKLE_DECL PacketSink {
+public:
+	virtual ~PacketSink() { }
+
+	virtual void receivePacket(QByteArray &packet, const Endpoint &from) = 0;
+
+	/* called by the transport once no more datagrams are ready */
+	virtual void receiveBatchDone() { }
+};
+
+}
+
+#endif
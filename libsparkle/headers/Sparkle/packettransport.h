@@ -22,16 +22,19 @@
 #include <QHostAddress>
 #include <QObject>
 #include <Sparkle/Sparkle>
+#include <Sparkle/PacketSink>
 
 namespace Sparkle {
 
 class SPARKLE_DECL PacketTransport : public QObject {
 	Q_OBJECT
 public:
-	explicit PacketTransport(QObject *parent = 0) : QObject(parent) { }
+	explicit PacketTransport(QObject *parent = 0) : QObject(parent), sink(NULL) { }
 
 	virtual ~PacketTransport() { }
 
+	void setSink(PacketSink *_sink) { sink = _sink; }
+
 	virtual bool beginReceiving() = 0;
 	virtual quint16 port() = 0;
 
@@ -41,6 +44,9 @@ public slots:
 
 signals:
 	void receivedPacket(QByteArray &packet, QHostAddress host, quint16 port);
+
+protected:
+	PacketSink *sink;
 };
 
 }
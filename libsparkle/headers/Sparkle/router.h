@@ -22,6 +22,7 @@
 #include <QObject>
 #include <QHostAddress>
 #include <QFlags>
+#include <QHash>
 
 #include <Sparkle/Sparkle>
 #include <Sparkle/SparkleAddress>
@@ -50,6 +51,14 @@ public:
 
 	Q_DECLARE_FLAGS(NodeQueryFlags, NodeQueryFlag);
 
+	/* Partitioned networks place masters on a hash ring, each one at several
+	 * virtual points. Addresses are placed by their first RingKeySize bytes,
+	 * so that partial route lookups land on the same owners. */
+	enum {
+		RingKeySize		= 3,
+		RingVirtualNodes	= 8,
+	};
+
 	explicit Router(QObject *parent = 0);
 	virtual ~Router();
 
@@ -67,13 +76,32 @@ public:
 	QList<SparkleNode*> nodes() const;
 
 	SparkleNode* select(NodeQueryFlags flags, QHostAddress excludeIP = QHostAddress());
+	SparkleNode* selectLeastLoaded(NodeQueryFlags flags, QHostAddress excludeIP = QHostAddress());
 	QList<SparkleNode*> find(NodeQueryFlags flags, QHostAddress excludeIP = QHostAddress());
 	int count(NodeQueryFlags flags, QHostAddress excludeIP = QHostAddress());
 
+	QList<SparkleNode*> owners(QByteArray addressPrefix, int replicas);
+	bool isOwner(SparkleNode* master, QByteArray addressPrefix, int replicas);
+
 	void clear();
 
 	void notifyNodeUpdated(SparkleNode* node);
 
+	static quint32 loadScore(const SparkleNode* node);
+
+	quint32 nextRouteVersion();
+	void observeRouteVersion(quint32 version);
+
+	void addTombstone(SparkleAddress sparkleMAC, quint32 version, qint64 lifetime);
+	quint32 tombstoneVersion(SparkleAddress sparkleMAC) const;
+	qint64 tombstoneLifetime(SparkleAddress sparkleMAC) const;
+	QHash<SparkleAddress, quint32> tombstones() const;
+	void expireTombstones();
+
+	static int digestBucket(SparkleAddress sparkleMAC, int buckets);
+	bool isShared(SparkleNode* entry, SparkleNode* peer, int replicas);
+	void computeDigest(quint32* hashes, int buckets, SparkleNode* peer = NULL, int replicas = 0);
+
 signals:
 	void nodeAdded(SparkleNode* node);
 	void nodeRemoved(SparkleNode* node);
@@ -46,6 +46,9 @@ public:
 	QByteArray encrypt(QByteArray data);
 	QByteArray decrypt(QByteArray data);
 
+	QByteArray sign(QByteArray data);
+	bool verify(QByteArray data, QByteArray signature);
+
 protected:
 	RSAKeyPairPrivate * const d_ptr;
 };
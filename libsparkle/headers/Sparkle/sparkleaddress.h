@@ -26,29 +26,39 @@
 
 namespace Sparkle {
 
+/* The address is kept in a single word with the two spare bytes zeroed, so
+ * comparing and hashing never touch memory beyond it. */
 class SPARKLE_DECL SparkleAddress
 {	
 public:
-	SparkleAddress();
+	SparkleAddress() : _value(0) { }
 	explicit SparkleAddress(QByteArray);
 	SparkleAddress(const quint8[SPARKLE_ADDRESS_SIZE]);
 
-	bool isNull() const;
+	bool isNull() const { return _value == 0; }
 
 	const QByteArray bytes() const;
-	const quint8* rawBytes() const;
+	const quint8* rawBytes() const { return _bytes; }
 
-	bool operator==(SparkleAddress) const;
-	bool operator!=(SparkleAddress) const;
+	quint64 value() const { return _value; }
+
+	bool operator==(const SparkleAddress &other) const { return _value == other._value; }
+	bool operator!=(const SparkleAddress &other) const { return _value != other._value; }
 
 	QString pretty() const;
 	static QString makePrettyMAC(QByteArray mac);
 
 private:
-	quint8 _bytes[SPARKLE_ADDRESS_SIZE];
+	union {
+		quint8	_bytes[sizeof(quint64)];
+		quint64	_value;
+	};
 };
 
-uint SPARKLE_DECL qHash(const SparkleAddress &key);
+inline uint qHash(const SparkleAddress &key) {
+	return (uint) (key.value() ^ (key.value() >> 32));
+}
+
 }
 
 
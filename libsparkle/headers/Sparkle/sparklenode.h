@@ -32,6 +32,8 @@ class SparkleNodePrivate;
 class BlowfishKey;
 class Router;
 class RSAKeyPair;
+class ParityEncoder;
+class ParityDecoder;
 
 class SPARKLE_DECL SparkleNode : public QObject
 {
@@ -42,6 +44,12 @@ protected:
 	SparkleNode(SparkleNodePrivate &dd, QObject *parent);
 
 public:
+	enum NATType {
+		NATUnknown	= 0,
+		NATCone		= 1,
+		NATSymmetric	= 2,
+	};
+
 	SparkleNode(Router& router, QHostAddress realIP, quint16 realPort);
 	virtual ~SparkleNode();
 	
@@ -70,6 +78,12 @@ public:
 	const BlowfishKey *hisSessionKey() const;
 	const BlowfishKey *mySessionKey() const;
 
+	/* NULL unless epoch is the current or the previous one */
+	const BlowfishKey *hisSessionKey(quint8 epoch) const;
+
+	quint8 myKeyEpoch() const;
+	quint8 hisKeyEpoch() const;
+
 	const RSAKeyPair *authKey() const;
 
 	bool setAuthKey(const RSAKeyPair &keyPair);
@@ -78,9 +92,19 @@ public:
 	void configure();
 	static SparkleAddress addressFromKey(const RSAKeyPair *keyPair);
 
-	void setHisSessionKey(const QByteArray &keyBytes);
+	void setHisSessionKey(const QByteArray &keyBytes, quint8 epoch = 0);
+	void rotateHisSessionKey(const QByteArray &keyBytes, quint8 epoch);
 	bool areKeysNegotiated();
 
+	const BlowfishKey *startRekey();
+	bool finishRekey(quint8 epoch);
+	bool isRekeyPending() const;
+	qint64 msecsSinceRekey() const;
+
+	void countEncrypted(int bytes);
+	quint64 bytesUnderKey() const;
+	qint64 msecsUnderKey() const;
+
 	void cloneKeys(SparkleNode* node);
 
 	void setMaster(bool isMaster);
@@ -91,12 +115,71 @@ public:
 	QByteArray popQueue();
 	void flushQueue();
 
+	void setNegotiationTimeout(int msec);
+
+	bool hasSession() const;
+	void closeSession();
+
+	void touchUsed();
+	qint64 msecsSinceUsed() const;
+
+	void touchSent();
+	void touchReceived();
+	qint64 msecsSinceSent() const;
+	qint64 msecsSinceReceived() const;
+	qint64 msecsSinceActive() const;
+
+	int natTimeout() const;
+	void setNATTimeout(int msec);
+
+	NATType natType() const;
+	qint16 natPortDelta() const;
+	void setNATType(NATType type, qint16 portDelta = 0);
+
+	quint32 routeVersion() const;
+	void setRouteVersion(quint32 version);
+
+	qint64 msecsKnown() const;
+
+	quint32 failures() const;
+	void countFailure();
+
+	int rtt() const;
+	int rttVariance() const;
+	qreal lossRate() const;
+	void addRTTSample(int msec);
+	void startRTTSample();
+	void finishRTTSample();
+
+	quint32 startKeepaliveProbe(int lossTimeout);
+	void finishKeepaliveProbe(quint32 seq, int rtt);
+	qint64 msecsSinceProbe() const;
+
+	quint8 cpuCount() const;
+	void setCPUCount(quint8 count);
+
+	bool isLoadKnown() const;
+	quint32 loadPeers() const;
+	quint32 loadPPS() const;
+	quint8 loadCPU() const;
+	void setLoad(quint32 peers, quint32 pps, quint8 cpu);
+
+	quint8 features() const;
+	void setFeatures(quint8 features);
+
+	bool shouldCompress();
+	void countCompression(int original, int compressed);
+
+	ParityEncoder *parityEncoder();
+	ParityDecoder *parityDecoder();
+
 public slots:
 	void negotiationStart();
 	void negotiationFinished();
 
 signals:
 	void negotiationTimedOut(SparkleNode*);
+	void linkQualityChanged(SparkleNode*);
 
 private slots:
 	void negotiationTimeout();
@@ -0,0 +1,127 @@
+/*
+ * Sparkle - zero-configuration fully distributed self-organizing encrypting VPN
+ * Copyright (C) 2009 Sergey Gridassov, Peter Zotov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __WIRE_FORMAT__H__
+#define __WIRE_FORMAT__H__
+
+#include <QByteArray>
+#include <QtEndian>
+
+#include <string.h>
+
+namespace Sparkle {
+
+/* An integer kept in network byte order. It is read and assigned like the
+ * native type, so packet code never converts by hand; and as it is stored
+ * as bytes, structs made of these and quint8 have no alignment and carry
+ * no compiler padding on the wire. */
+template<typename T> class BigEndian {
+public:
+	BigEndian() { }
+	BigEndian(T value) { *this = value; }
+
+	BigEndian &operator=(T value) {
+		qToBigEndian<T>(value, bytes);
+		return *this;
+	}
+
+	operator T() const {
+		return qFromBigEndian<T>(bytes);
+	}
+
+private:
+	uchar bytes[sizeof(T)];
+};
+
+/* Grows a send buffer by one zeroed wire struct and returns it to be
+ * filled in place. The pointer is valid until the buffer is modified
+ * again. */
+template<typename T> T *wireAppend(QByteArray &buffer) {
+	int offset = buffer.size();
+	buffer.resize(offset + sizeof(T));
+
+	char *data = buffer.data() + offset;
+	memset(data, 0, sizeof(T));
+
+	return (T *) data;
+}
+
+/* Bounds-checked access to a wire struct inside a received packet */
+template<typename T> class WireView {
+public:
+	WireView(const QByteArray &packet, int offset = 0) : packet(packet), offset(offset) { }
+
+	bool isValid() const {
+		return packet.size() >= requiredSize();
+	}
+
+	/* bytes up to the end of the struct */
+	int requiredSize() const {
+		return offset + sizeof(T);
+	}
+
+	const QByteArray &bytes() const {
+		return packet;
+	}
+
+	const T *data() const {
+		Q_ASSERT(isValid());
+		return (const T *) (packet.constData() + offset);
+	}
+
+	const T *operator->() const {
+		return data();
+	}
+
+	/* whatever follows the struct */
+	QByteArray tail() const {
+		return packet.mid(offset + sizeof(T));
+	}
+
+private:
+	const QByteArray &packet;
+	int offset;
+};
+
+/* Bounds-checked access to a run of wire structs filling a packet from
+ * the given offset to its end */
+template<typename T> class WireArray {
+public:
+	WireArray(const QByteArray &packet, int offset = 0) : packet(packet), offset(offset) { }
+
+	bool isValid() const {
+		return packet.size() >= offset && (packet.size() - offset) % sizeof(T) == 0;
+	}
+
+	int count() const {
+		return isValid() ? (packet.size() - offset) / sizeof(T) : 0;
+	}
+
+	const T &operator[](int index) const {
+		Q_ASSERT(index >= 0 && index < count());
+		return ((const T *) (packet.constData() + offset))[index];
+	}
+
+private:
+	const QByteArray &packet;
+	int offset;
+};
+
+}
+
+#endif
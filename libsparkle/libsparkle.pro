@@ -32,6 +32,7 @@ HEADERS += headers/Sparkle/blowfishkey.h \
 	headers/Sparkle/linklayer.h \
 	headers/Sparkle/log.h \
 	headers/Sparkle/packettransport.h \
+	headers/Sparkle/packetsink.h \
 	SparkleRandom.h \
 	headers/Sparkle/router.h \
 	headers/Sparkle/rsakeypair.h \
@@ -41,7 +42,12 @@ HEADERS += headers/Sparkle/blowfishkey.h \
 	crypto/bn_mul.h \
 	crypto/rsa.h \
 	headers/Sparkle/applicationlayer.h \
-	headers/Sparkle/sparkleaddress.h
+	headers/Sparkle/sparkleaddress.h \
+	headers/Sparkle/wireformat.h \
+	EgressScheduler.h \
+	Compressor.h \
+	ParityCoder.h \
+	CryptoPipeline.h
 	
 SOURCES += BlowfishKey.cpp \
 	LinkLayer.cpp \
@@ -54,6 +60,10 @@ SOURCES += BlowfishKey.cpp \
 	crypto/bignum.c \
 	crypto/blowfish.c \
 	crypto/rsa.c \
-	SparkleAddress.cpp
+	SparkleAddress.cpp \
+	EgressScheduler.cpp \
+	Compressor.cpp \
+	ParityCoder.cpp \
+	CryptoPipeline.cpp
 
 RC_FILE = libsparkle.rc
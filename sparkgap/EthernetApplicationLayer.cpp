@@ -24,9 +24,9 @@
 #include <Sparkle/Log>
 #include <Sparkle/SparkleAddress>
 #include <Sparkle/SparkleNode>
+#include <Sparkle/WireFormat>
 
 #include "EthernetApplicationLayer.h"
-#include "TapInterface.h"
 
 using namespace Sparkle;
 
@@ -37,8 +37,8 @@ EthernetApplicationLayer::EthernetApplicationLayer(LinkLayer &_linkLayer, TapInt
 	linkLayer.attachApplicationLayer(Ethernet, this);
 	
 	if(tap) {
+		tap->setSink(this);
 		connect(tap, SIGNAL(havePacket(QByteArray)), SLOT(haveTapPacket(QByteArray)));
-		connect(this, SIGNAL(sendTapPacket(QByteArray)), tap, SLOT(sendPacket(QByteArray)));
 	}
 }
 
@@ -57,54 +57,64 @@ void EthernetApplicationLayer::initialize(SparkleNode *self) {
 }
 
 void EthernetApplicationLayer::handleDataPacket(QByteArray &packet, SparkleAddress mac) {
-	if((size_t) packet.length() <= sizeof(ethernet_header_t) + sizeof(ipv4_header_t)) {
+	if(isValidRemoteFrame(packet, mac) && tap)
+		tap->sendPacket(packet);
+}
+
+bool EthernetApplicationLayer::isValidRemoteFrame(const QByteArray &packet, SparkleAddress mac) {
+	WireView<ethernet_header_t> eth(packet);
+	WireView<ipv4_header_t> ip(packet, sizeof(ethernet_header_t));
+	if(packet.size() <= ip.requiredSize()) {
 		Log::warn("eth: malformed packet from %1") << mac.pretty();
-		return;
+		return false;
 	}
 
-	const ethernet_header_t* eth = (const ethernet_header_t*) packet.constData();
-
 	if(memcmp(eth->src, mac.rawBytes(), 6) != 0) {
 		Log::warn("ethernet: remote %1 packet with malformed source MAC") << mac.pretty();
-		return;
+		return false;
 	}
 
 	if(memcmp(eth->dest, selfMAC.rawBytes(), 6) != 0) {
 		Log::warn("ethernet: remote %1 packet with malformed destination MAC") << mac.pretty();
-		return;
+		return false;
 	}
 
 	if(qFromBigEndian<quint16>(eth->type) != 0x0800) { // IP
 		Log::warn("ethernet: remote %1 non-IP (%2) packet") << mac.pretty()
 			<< QString::number(qFromBigEndian<quint16>(eth->type), 16).rightJustified(4, '0');
-		return;
+		return false;
 	}
 
-	QByteArray payload = packet.right(packet.size() - sizeof(ethernet_header_t));
-	const ipv4_header_t* ip = (const ipv4_header_t*) payload.constData();
-
 	if(qFromBigEndian<quint32>(ip->src) != makeIPv4Address(mac).toIPv4Address()) {
 		Log::warn("eth: received IPv4 packet with malformed source address");
-		return;
+		return false;
 	}
 
 	if(qFromBigEndian<quint32>(ip->dest) != selfIPv4.toIPv4Address()) {
 		Log::warn("eth: received IPv4 packet with malformed destination address");
-		return;
+		return false;
 	}
 
-	emit sendTapPacket(packet);
+	return true;
 }
 
 void EthernetApplicationLayer::haveTapPacket(QByteArray packet) {
-	const ethernet_header_t* eth = (const ethernet_header_t*) packet.constData();
+	receiveFrame(packet);
+}
+
+void EthernetApplicationLayer::receiveFrame(QByteArray &packet) {
+	WireView<ethernet_header_t> eth(packet);
+	if(!eth.isValid()) {
+		Log::warn("eth: truncated local packet");
+		return;
+	}
 
 	if(memcmp(eth->src, selfMAC.rawBytes(), 6) != 0) {
 		Log::warn("ethernet: local packet from unknown source MAC");
 		return;
 	}
 
-	QByteArray payload = packet.right(packet.size() - sizeof(ethernet_header_t));
+	QByteArray payload = eth.tail();
 	switch(qFromBigEndian<quint16>(eth->type)) {
 		case 0x0806: { // ARP
 			if(memcmp(eth->dest, "\xFF\xFF\xFF\xFF\xFF\xFF", 6) != 0) {
@@ -112,8 +122,8 @@ void EthernetApplicationLayer::haveTapPacket(QByteArray packet) {
 				return;
 			}
 
-			const arp_packet_t* arp = (const arp_packet_t*) payload.constData();
-			if(!(qFromBigEndian<quint16>(arp->htype) == 1 /* ethernet */ && qFromBigEndian<quint16>(arp->ptype) == 0x0800 /* ipv4 */ &&
+			WireView<arp_packet_t> arp(payload);
+			if(!arp.isValid() || !(qFromBigEndian<quint16>(arp->htype) == 1 /* ethernet */ && qFromBigEndian<quint16>(arp->ptype) == 0x0800 /* ipv4 */ &&
 				arp->hlen == 6 && arp->plen == 4 &&
 					qFromBigEndian<quint32>(arp->spa) == selfIPv4.toIPv4Address() &&
 					!memcmp(arp->sha, eth->src, 6))) {
@@ -138,7 +148,12 @@ void EthernetApplicationLayer::haveTapPacket(QByteArray packet) {
 		}
 
 		case 0x0800: { // IPv4
-			const ipv4_header_t* ip = (const ipv4_header_t*) payload.constData();
+			WireView<ipv4_header_t> ip(payload);
+			if(!ip.isValid()) {
+				Log::warn("eth: truncated local IPv4 packet");
+				return;
+			}
+
 			if(qFromBigEndian<quint32>(ip->src) != selfIPv4.toIPv4Address()) {
 				Log::warn("eth: received local IPv4 packet with malformed source address");
 				return;
@@ -189,6 +204,6 @@ void EthernetApplicationLayer::sendARPReply(SparkleAddress mac) {
 	memcpy(arp->tha, eth->dest, 6);
 	arp->tpa = qToBigEndian<quint32>(selfIPv4.toIPv4Address());
 
-	emit sendTapPacket(packet);
+	if(tap)	tap->sendPacket(packet);
 }
 
@@ -24,14 +24,15 @@
 #include <Sparkle/SparkleAddress>
 #include <Sparkle/ApplicationLayer>
 
+#include "TapInterface.h"
+
 namespace Sparkle {
 	class Router;
 	class LinkLayer;
 	class SparkleNode;
 }
 
-class TapInterface;
-class EthernetApplicationLayer: public QObject, public Sparkle::ApplicationLayer {
+class EthernetApplicationLayer: public QObject, public Sparkle::ApplicationLayer, public TapSink {
 	Q_OBJECT
 
 public:
@@ -39,15 +40,14 @@ public:
 	virtual ~EthernetApplicationLayer();
 
 	virtual void handleDataPacket(QByteArray &packet, Sparkle::SparkleAddress address);
+	virtual void receiveFrame(QByteArray &frame);
 
 private slots:
 	void haveTapPacket(QByteArray packet);
 	void initialize(Sparkle::SparkleNode* self);
 
-signals:
-	void sendTapPacket(QByteArray packet);
-
 private:
+	bool isValidRemoteFrame(const QByteArray &packet, Sparkle::SparkleAddress mac);
 	void sendARPReply(Sparkle::SparkleAddress address);
 
 	static QHostAddress makeIPv4Address(Sparkle::SparkleAddress mac);
@@ -129,10 +129,11 @@ void LinuxTAP::setupInterface(SparkleAddress addr, QHostAddress ip) {
 void LinuxTAP::getPacket() {
 	int len = read(tun, framebuf, MTU);
 
-	emit havePacket(QByteArray((char *) framebuf, len));
+	QByteArray frame((char *) framebuf, len);
+	deliverFrame(frame);
 }
 
-void LinuxTAP::sendPacket(QByteArray data) {
-	if(write(tun, data.data(), data.size()) != data.size())
+void LinuxTAP::sendPacket(const QByteArray &data) {
+	if(write(tun, data.constData(), data.size()) != data.size())
 		Log::warn("tap: remote packet truncated");
 }
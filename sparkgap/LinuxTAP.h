@@ -44,14 +44,11 @@ public:
 
 public slots:
 	virtual void setupInterface(Sparkle::SparkleAddress ha, QHostAddress ip);
-	virtual void sendPacket(QByteArray packet);
+	virtual void sendPacket(const QByteArray &packet);
 
 private slots:
 	void getPacket();
 
-signals:
-	void havePacket(QByteArray packet);
-
 private:
 	QSocketNotifier *notify;
 
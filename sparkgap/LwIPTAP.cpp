@@ -57,19 +57,18 @@ void LwIPTAP::setupInterface(Sparkle::SparkleAddress ha, QHostAddress ip) {
 	Log::debug("Registered lwIP interface");
 }
 
-void LwIPTAP::sendPacket(QByteArray packet) {
+void LwIPTAP::sendPacket(const QByteArray &packet) {
 	/* We allocate a pbuf chain of pbufs from the pool. */
 	struct pbuf *p = pbuf_alloc(PBUF_RAW, packet.size(), PBUF_POOL);
   
 	if (p != NULL) {
 		/* We iterate over the pbuf chain until we have read the entire packet into the pbuf. */
+		int offset = 0;
 		for(struct pbuf *q = p; q != NULL; q = q->next) {
+			memcpy(q->payload, packet.constData() + offset, q->len);
 
-
-			memcpy(q->payload, packet.data(), q->len);
-	
-			packet = packet.right(packet.size() - q->len);
-		}		
+			offset += q->len;
+		}
 
 	
 		int ret = interface.input(p, &interface);
@@ -98,6 +97,7 @@ err_t LwIPTAP::if_output(struct netif *netif, struct pbuf *p) {
 }
 
 void LwIPTAP::receive(QByteArray data) {
+	// if_output runs on the lwIP thread; the queued signal takes it home
 	emit havePacket(data);
 }
 
@@ -32,10 +32,7 @@ public:
 
 public slots:
 	virtual void setupInterface(Sparkle::SparkleAddress ha, QHostAddress ip);
-	virtual void sendPacket(QByteArray packet);
-
-signals:
-	void havePacket(QByteArray packet);
+	virtual void sendPacket(const QByteArray &packet);
 
 private:
 	static err_t if_init(struct netif *netif);
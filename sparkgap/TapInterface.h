@@ -24,19 +24,41 @@
 #include <QHostAddress>
 #include <Sparkle/SparkleAddress>
 
+/* Takes frames read from the interface by a plain virtual call */
+class TapSink {
+public:
+	virtual ~TapSink() { }
+
+	virtual void receiveFrame(QByteArray &frame) = 0;
+};
+
 class TapInterface: public QObject {
 	Q_OBJECT
 
 public:
-	TapInterface(QObject *parent = 0) : QObject(parent) { }
+	TapInterface(QObject *parent = 0) : QObject(parent), sink(NULL) { }
 	virtual ~TapInterface() { }
 
+	void setSink(TapSink *_sink) { sink = _sink; }
+
 public slots:
 	virtual void setupInterface(Sparkle::SparkleAddress ha, QHostAddress ip) = 0;
-	virtual void sendPacket(QByteArray packet) = 0;
+	virtual void sendPacket(const QByteArray &packet) = 0;
 
 signals:
 	void havePacket(QByteArray packet);
+
+protected:
+	/* interfaces reading on the main thread deliver through here; others
+	 * must emit havePacket() to cross threads */
+	void deliverFrame(QByteArray &frame) {
+		if(sink)
+			sink->receiveFrame(frame);
+		else
+			emit havePacket(frame);
+	}
+
+	TapSink *sink;
 };
 
 #endif
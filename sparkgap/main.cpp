@@ -88,8 +88,11 @@ int main(int argc, char *argv[]) {
 	app.setApplicationName("sparkle");
 
 	QString profile = "default", configDir;
-	bool createNetwork = false, noTap = false, forceBehindNAT = false, useLwIP = false;
-	int networkDivisor = 10;
+	bool createNetwork = false, noTap = false, forceBehindNAT = false, useLwIP = false, lanDiscovery = true,
+		compression = true, fec = true;
+	int networkDivisor = 10, replicationFactor = 0, sessionLimit = 0, sessionIdleTimeout = 600, prewarmPeers = 8,
+		joinRetries = 8, admissionRate = 50, egressRate = 0, peerEgressRate = 0,
+		cryptoThreads = 0;
 	QHostAddress localAddress = QHostAddress::Any, remoteAddress, bindAddress = QHostAddress::Any;
 	quint16 localPort = 1801, remotePort = 1801;
 
@@ -100,7 +103,9 @@ int main(int argc, char *argv[]) {
 
 	{
 		QString createStr, joinStr, endpointStr, bindStr, keyLenStr, getPubkeyStr,
-			noTapStr, behindNatStr, daemonizeStr, lwipStr;
+			noTapStr, behindNatStr, daemonizeStr, lwipStr, partitionStr, noLanStr,
+			sessionLimitStr, sessionIdleStr, prewarmStr, retriesStr, admissionStr,
+			rateStr, peerRateStr, noCompressionStr, noFECStr, cryptoThreadsStr;
 
 		ArgumentParser parser(app.arguments());
 
@@ -110,6 +115,9 @@ int main(int argc, char *argv[]) {
 		parser.registerOption('c', "create", ArgumentParser::OptionalArgument, &createStr, NULL,
 			NULL, "create new network with divisor DIV (10 by default)", "DIV");
 
+		parser.registerOption(QChar::Null, "partition", ArgumentParser::RequiredArgument, &partitionStr, NULL,
+			NULL, "\n\t\tsplit routes between masters of created network, keeping K copies", "K");
+
 		parser.registerOption('j', "join", ArgumentParser::RequiredArgument, &joinStr, NULL,
 			NULL, "\n\t\tjoin existing network, PORT defaults to 1801", "HOST[:PORT]");
 
@@ -139,6 +147,39 @@ int main(int argc, char *argv[]) {
 		parser.registerOption(QChar::Null, "lwip", ArgumentParser::NoArgument,
 			&lwipStr, NULL, NULL, "\tuse usermode network stack", NULL);
 
+		parser.registerOption(QChar::Null, "no-lan-discovery", ArgumentParser::NoArgument,
+			&noLanStr, NULL, NULL, "do not look for peers on local network\n\t\t(found only if listening on 1801 or on our port)", NULL);
+
+		parser.registerOption(QChar::Null, "no-compression", ArgumentParser::NoArgument,
+			&noCompressionStr, NULL, NULL, "do not compress data sent to peers", NULL);
+
+		parser.registerOption(QChar::Null, "no-fec", ArgumentParser::NoArgument,
+			&noFECStr, NULL, NULL, "do not send parity packets over lossy links", NULL);
+
+		parser.registerOption(QChar::Null, "max-sessions", ArgumentParser::RequiredArgument,
+			&sessionLimitStr, NULL, NULL, "keep at most N sessions with slaves (unlimited by default)", "N");
+
+		parser.registerOption(QChar::Null, "session-idle", ArgumentParser::RequiredArgument,
+			&sessionIdleStr, NULL, NULL, "close sessions idle for SECS seconds (600 by default)", "SECS");
+
+		parser.registerOption(QChar::Null, "prewarm", ArgumentParser::RequiredArgument,
+			&prewarmStr, NULL, NULL, "\tnegotiate with N most contacted peers after joining (8 by default)", "N");
+
+		parser.registerOption(QChar::Null, "join-retries", ArgumentParser::RequiredArgument,
+			&retriesStr, NULL, NULL, "retry failed join N times with growing delays (8 by default)", "N");
+
+		parser.registerOption(QChar::Null, "admission-rate", ArgumentParser::RequiredArgument,
+			&admissionStr, NULL, NULL, "register at most N nodes per second as master (50 by default)", "N");
+
+		parser.registerOption(QChar::Null, "rate", ArgumentParser::RequiredArgument,
+			&rateStr, NULL, NULL, "\tsend data at most at KBPS kilobytes per second (unlimited by default)", "KBPS");
+
+		parser.registerOption(QChar::Null, "peer-rate", ArgumentParser::RequiredArgument,
+			&peerRateStr, NULL, NULL, "send data to each peer at most at KBPS kilobytes per second", "KBPS");
+
+		parser.registerOption(QChar::Null, "crypto-threads", ArgumentParser::RequiredArgument,
+			&cryptoThreadsStr, NULL, NULL, "encrypt data in N threads, 0 for main thread (default)", "N");
+
 		if(!parser.parse()) { // help was displayed
 			return 0;
 		}
@@ -173,6 +214,15 @@ int main(int argc, char *argv[]) {
 			}
 		}
 
+		if(!partitionStr.isNull()) {
+			if(!createNetwork)
+				Log::fatal("option --partition requires --create");
+
+			replicationFactor = partitionStr.toInt();
+			if(replicationFactor < 1 || replicationFactor > 16)
+				Log::fatal("impossible setting of replication factor");
+		}
+
 		if(!joinStr.isNull()) {
 			QStringList parts = joinStr.split(":");
 
@@ -232,6 +282,63 @@ int main(int argc, char *argv[]) {
 
 		if(!lwipStr.isNull())
 			useLwIP = true;
+
+		if(!noLanStr.isNull())
+			lanDiscovery = false;
+
+		if(!noCompressionStr.isNull())
+			compression = false;
+
+		if(!noFECStr.isNull())
+			fec = false;
+
+		if(!sessionLimitStr.isNull()) {
+			sessionLimit = sessionLimitStr.toInt();
+			if(sessionLimit < 1)
+				Log::fatal("impossible setting of session limit");
+		}
+
+		if(!sessionIdleStr.isNull()) {
+			sessionIdleTimeout = sessionIdleStr.toInt();
+			if(sessionIdleTimeout < 10)
+				Log::fatal("impossible setting of session idle timeout");
+		}
+
+		if(!prewarmStr.isNull()) {
+			prewarmPeers = prewarmStr.toInt();
+			if(prewarmPeers < 0)
+				Log::fatal("impossible setting of pre-warmed peer count");
+		}
+
+		if(!retriesStr.isNull()) {
+			joinRetries = retriesStr.toInt();
+			if(joinRetries < 0)
+				Log::fatal("impossible setting of join retries");
+		}
+
+		if(!admissionStr.isNull()) {
+			admissionRate = admissionStr.toInt();
+			if(admissionRate < 1 || admissionRate > 1000)
+				Log::fatal("impossible setting of admission rate");
+		}
+
+		if(!rateStr.isNull()) {
+			egressRate = rateStr.toInt();
+			if(egressRate < 1)
+				Log::fatal("impossible setting of rate");
+		}
+
+		if(!peerRateStr.isNull()) {
+			peerEgressRate = peerRateStr.toInt();
+			if(peerEgressRate < 1)
+				Log::fatal("impossible setting of peer rate");
+		}
+
+		if(!cryptoThreadsStr.isNull()) {
+			cryptoThreads = cryptoThreadsStr.toInt();
+			if(cryptoThreads < 0 || cryptoThreads > 16)
+				Log::fatal("impossible setting of crypto threads");
+		}
 	}
 
 	RSAKeyPair hostPair;
@@ -252,6 +359,16 @@ int main(int argc, char *argv[]) {
 	Router router;
 	UdpPacketTransport transport(bindAddress, localPort);
 	LinkLayer linkLayer(router, transport, hostPair);
+	linkLayer.setLANDiscoveryEnabled(lanDiscovery);
+	linkLayer.setCompressionEnabled(compression);
+	linkLayer.setFECEnabled(fec);
+	linkLayer.setCryptoWorkers(cryptoThreads);
+	linkLayer.setSessionLimits(sessionLimit, sessionIdleTimeout * 1000);
+	linkLayer.setPrewarmPeers(prewarmPeers);
+	linkLayer.setJoinRetries(joinRetries);
+	linkLayer.setAdmissionRate(admissionRate);
+	linkLayer.setEgressRates(egressRate * 1024, peerEgressRate * 1024);
+	linkLayer.setContactsFile(configDir + "/contacts");
 
 #ifdef Q_OS_UNIX
 	SignalHandler* sighandler = SignalHandler::getInstance();
@@ -293,7 +410,7 @@ int main(int argc, char *argv[]) {
 	new EthernetApplicationLayer(linkLayer, tapIf);
 
 	if(createNetwork) {
-		if(!linkLayer.createNetwork(localAddress, networkDivisor))
+		if(!linkLayer.createNetwork(localAddress, networkDivisor, replicationFactor))
 			Log::fatal("cannot create network");
 	} else {
 		if(!linkLayer.joinNetwork(remoteAddress, remotePort, forceBehindNAT))
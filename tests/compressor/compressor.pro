@@ -0,0 +1,13 @@
+TEMPLATE = app
+TARGET = tst_compressor
+
+DEPENDPATH += . ../../libsparkle ../../libsparkle/headers
+INCLUDEPATH += ../../libsparkle ../../libsparkle/headers
+
+QT -= gui
+CONFIG += qtestlib console
+
+HEADERS += ../../libsparkle/Compressor.h
+
+SOURCES += tst_compressor.cpp \
+	../../libsparkle/Compressor.cpp
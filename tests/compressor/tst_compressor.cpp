@@ -0,0 +1,128 @@
+/*
+ * Sparkle - zero-configuration fully distributed self-organizing encrypting VPN
+ * Copyright (C) 2009 Sergey Gridassov, Peter Zotov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QtTest>
+
+#include "Compressor.h"
+
+class TestCompressor : public QObject {
+	Q_OBJECT
+
+private slots:
+	void roundTripsRepetitiveData();
+	void roundTripsLongRuns();
+	void keepsIncompressibleDataRaw();
+	void refusesOversizedInput();
+	void rejectsTruncatedInput();
+	void rejectsBadOffsets();
+	void rejectsWrongLength();
+
+private:
+	static QByteArray frame();
+	static QByteArray noise(int size);
+};
+
+/* something like a burst of similar IP packets */
+QByteArray TestCompressor::frame() {
+	QByteArray data;
+	for(int i = 0; data.size() < 1400; i++)
+		data.append("GET /index.html HTTP/1.1\r\nHost: 14.1.2.").append(QByteArray::number(i % 7)).append("\r\n");
+
+	return data.left(1400);
+}
+
+QByteArray TestCompressor::noise(int size) {
+	QByteArray data(size, 0);
+
+	quint32 state = 12345;
+	for(int i = 0; i < size; i++) {
+		state = state * 1103515245 + 12345;
+		data[i] = (char) (state >> 24);
+	}
+
+	return data;
+}
+
+void TestCompressor::roundTripsRepetitiveData() {
+	QByteArray input = frame(), compressed, output;
+
+	QVERIFY(Compressor::compress(input, compressed));
+	QVERIFY(compressed.size() < input.size());
+
+	QVERIFY(Compressor::decompress(compressed, output));
+	QCOMPARE(output, input);
+}
+
+void TestCompressor::roundTripsLongRuns() {
+	// literal and match lengths both spill into several 255 bytes
+	QByteArray input = noise(700) + QByteArray(60000, 'z') + noise(300), compressed, output;
+
+	QVERIFY(Compressor::compress(input, compressed));
+	QVERIFY(Compressor::decompress(compressed, output));
+	QCOMPARE(output, input);
+}
+
+void TestCompressor::keepsIncompressibleDataRaw() {
+	QByteArray compressed;
+
+	QVERIFY(!Compressor::compress(noise(1400), compressed));
+}
+
+void TestCompressor::refusesOversizedInput() {
+	QByteArray compressed;
+
+	QVERIFY(!Compressor::compress(QByteArray(0x10000, 'z'), compressed));
+}
+
+void TestCompressor::rejectsTruncatedInput() {
+	QByteArray compressed, output;
+	QVERIFY(Compressor::compress(frame(), compressed));
+
+	for(int size = 0; size < compressed.size(); size++)
+		QVERIFY(!Compressor::decompress(compressed.left(size), output));
+}
+
+void TestCompressor::rejectsBadOffsets() {
+	QByteArray output;
+
+	// one literal, then a match reaching before the start of the output
+	QByteArray before("\x00\x05\x10" "a" "\x02\x00", 6);
+	QVERIFY(!Compressor::decompress(before, output));
+
+	QByteArray zero("\x00\x05\x10" "a" "\x00\x00", 6);
+	QVERIFY(!Compressor::decompress(zero, output));
+
+	// the same match with a valid offset expands to five bytes
+	QByteArray valid("\x00\x05\x10" "a" "\x01\x00", 6);
+	QVERIFY(Compressor::decompress(valid, output));
+	QCOMPARE(output, QByteArray("aaaaa"));
+}
+
+void TestCompressor::rejectsWrongLength() {
+	QByteArray compressed, output;
+	QVERIFY(Compressor::compress(frame(), compressed));
+
+	compressed[1] = (char) (compressed[1] + 1);
+	QVERIFY(!Compressor::decompress(compressed, output));
+
+	compressed[1] = (char) (compressed[1] - 2);
+	QVERIFY(!Compressor::decompress(compressed, output));
+}
+
+QTEST_MAIN(TestCompressor)
+#include "tst_compressor.moc"
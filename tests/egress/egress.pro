@@ -0,0 +1,18 @@
+TEMPLATE = app
+TARGET = tst_egress
+
+DEPENDPATH += . ../../libsparkle ../../libsparkle/headers
+INCLUDEPATH += ../../libsparkle ../../libsparkle/headers
+
+QT -= gui
+QT += network
+CONFIG += qtestlib console
+
+LIBS += -L../../output -lsparkle
+
+unix: QMAKE_LFLAGS += -Wl,-rpath ${PWD}/../../output
+
+HEADERS += ../../libsparkle/EgressScheduler.h
+
+SOURCES += tst_egress.cpp \
+	../../libsparkle/EgressScheduler.cpp
@@ -0,0 +1,201 @@
+/*
+ * Sparkle - zero-configuration fully distributed self-organizing encrypting VPN
+ * Copyright (C) 2009 Sergey Gridassov, Peter Zotov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QtTest>
+#include <QHostAddress>
+
+#include <Sparkle/PacketTransport>
+
+#include "EgressScheduler.h"
+
+using namespace Sparkle;
+
+/* keeps whatever the scheduler lets through, in order */
+class RecordingTransport : public PacketTransport {
+public:
+	struct sent_t {
+		QByteArray	data;
+		QHostAddress	host;
+		quint16		port;
+	};
+
+	bool beginReceiving() { return true; }
+	quint16 port() { return 1801; }
+
+	void endReceiving() { }
+
+	void sendPacket(QByteArray &packet, QHostAddress host, quint16 port) {
+		sent_t sent;
+		sent.data = packet;
+		sent.host = host;
+		sent.port = port;
+
+		packets.append(sent);
+	}
+
+	QList<sent_t> packets;
+};
+
+class TestEgressScheduler : public QObject {
+	Q_OBJECT
+
+private slots:
+	void unlimitedSendsAtOnce();
+	void controlJumpsQueuedData();
+	void roundRobinAcrossFlows();
+	void peerBucketsAreSeparate();
+	void fullFlowQueueDrops();
+	void clearForgetsQueuedData();
+
+private:
+	enum {
+		Port	= 1801,
+	};
+
+	static void overdraw(EgressScheduler &egress, QHostAddress host);
+	static void waitDrained(EgressScheduler &egress);
+};
+
+/* leaves the buckets of the node and of the peer in debt, so that
+ * the following data packets have to queue */
+void TestEgressScheduler::overdraw(EgressScheduler &egress, QHostAddress host) {
+	QByteArray bulk(70000, 'x');
+	egress.send(bulk, host, Port, EgressScheduler::Data, 0);
+}
+
+void TestEgressScheduler::waitDrained(EgressScheduler &egress) {
+	for(int i = 0; i < 100 && egress.queuedPackets() > 0; i++)
+		QTest::qWait(10);
+}
+
+void TestEgressScheduler::unlimitedSendsAtOnce() {
+	RecordingTransport transport;
+	EgressScheduler egress(transport);
+
+	QByteArray packet(1000, 'd');
+	for(int i = 0; i < 10; i++)
+		egress.send(packet, QHostAddress("10.0.0.1"), Port, EgressScheduler::Data, 1);
+
+	QCOMPARE(transport.packets.count(), 10);
+	QCOMPARE(egress.queuedPackets(), 0);
+}
+
+void TestEgressScheduler::controlJumpsQueuedData() {
+	RecordingTransport transport;
+	EgressScheduler egress(transport);
+	egress.setRates(1000, 0);
+
+	QHostAddress peer("10.0.0.1");
+	overdraw(egress, peer);
+
+	QByteArray data(100, 'd');
+	egress.send(data, peer, Port, EgressScheduler::Data, 1);
+	QCOMPARE(egress.queuedPackets(), 1);
+
+	QByteArray control(100, 'c');
+	egress.send(control, peer, Port);
+
+	QCOMPARE(transport.packets.count(), 2);
+	QCOMPARE(transport.packets.last().data, control);
+	QCOMPARE(egress.queuedPackets(), 1);
+}
+
+void TestEgressScheduler::roundRobinAcrossFlows() {
+	RecordingTransport transport;
+	EgressScheduler egress(transport);
+	egress.setRates(1000000, 0);
+
+	QHostAddress peer("10.0.0.1");
+	overdraw(egress, peer);
+
+	// one full-sized packet per round and flow, the first flow queued first
+	QByteArray first(1500, 'a'), second(1500, 'b');
+	for(int i = 0; i < 4; i++)
+		egress.send(first, peer, Port, EgressScheduler::Data, 1);
+	for(int i = 0; i < 4; i++)
+		egress.send(second, peer, Port, EgressScheduler::Data, 2);
+
+	QCOMPARE(egress.queuedPackets(), 8);
+
+	waitDrained(egress);
+	QCOMPARE(egress.queuedPackets(), 0);
+	QCOMPARE(transport.packets.count(), 9);
+
+	for(int i = 0; i < 8; i++)
+		QCOMPARE(transport.packets[1 + i].data.at(0), i % 2 == 0 ? 'a' : 'b');
+}
+
+void TestEgressScheduler::peerBucketsAreSeparate() {
+	RecordingTransport transport;
+	EgressScheduler egress(transport);
+	egress.setRates(0, 1000);
+
+	QHostAddress slow("10.0.0.1"), fast("10.0.0.2");
+	overdraw(egress, slow);
+
+	QByteArray data(1500, 'd');
+	egress.send(data, slow, Port, EgressScheduler::Data, 1);
+	egress.send(data, fast, Port, EgressScheduler::Data, 1);
+	QCOMPARE(egress.queuedPackets(), 2);
+
+	for(int i = 0; i < 50 && transport.packets.count() < 2; i++)
+		QTest::qWait(10);
+
+	// the slow peer repays its debt over seconds, the other one goes now
+	QCOMPARE(transport.packets.count(), 2);
+	QCOMPARE(transport.packets.last().host, fast);
+	QCOMPARE(egress.queuedPackets(), 1);
+}
+
+void TestEgressScheduler::fullFlowQueueDrops() {
+	RecordingTransport transport;
+	EgressScheduler egress(transport);
+	egress.setRates(1000, 0);
+
+	QHostAddress peer("10.0.0.1");
+	overdraw(egress, peer);
+
+	QByteArray data(100, 'd');
+	for(int i = 0; i < 300; i++)
+		egress.send(data, peer, Port, EgressScheduler::Data, 1);
+
+	QVERIFY(egress.droppedPackets() > 0);
+	QCOMPARE(egress.queuedPackets() + (int) egress.droppedPackets(), 300);
+}
+
+void TestEgressScheduler::clearForgetsQueuedData() {
+	RecordingTransport transport;
+	EgressScheduler egress(transport);
+	egress.setRates(1000000, 0);
+
+	QHostAddress peer("10.0.0.1");
+	overdraw(egress, peer);
+
+	QByteArray data(100, 'd');
+	egress.send(data, peer, Port, EgressScheduler::Data, 1);
+	QCOMPARE(egress.queuedPackets(), 1);
+
+	egress.clear();
+	QCOMPARE(egress.queuedPackets(), 0);
+
+	QTest::qWait(20);
+	QCOMPARE(transport.packets.count(), 1);
+}
+
+QTEST_MAIN(TestEgressScheduler)
+#include "tst_egress.moc"
@@ -0,0 +1,20 @@
+TEMPLATE = app
+TARGET = tst_parity
+
+DEPENDPATH += . ../../libsparkle ../../libsparkle/headers
+INCLUDEPATH += ../../libsparkle ../../libsparkle/headers
+
+QT -= gui
+CONFIG += qtestlib console
+
+LIBS += -L../../output -lsparkle
+win32: LIBS += advapi32.lib
+
+unix: QMAKE_LFLAGS += -Wl,-rpath ${PWD}/../../output
+
+HEADERS += ../../libsparkle/ParityCoder.h \
+	../../libsparkle/SparkleRandom.h
+
+SOURCES += tst_parity.cpp \
+	../../libsparkle/ParityCoder.cpp \
+	../../libsparkle/SparkleRandom.cpp
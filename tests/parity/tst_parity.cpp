@@ -0,0 +1,170 @@
+/*
+ * Sparkle - zero-configuration fully distributed self-organizing encrypting VPN
+ * Copyright (C) 2009 Sergey Gridassov, Peter Zotov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QtTest>
+
+#include "ParityCoder.h"
+
+using namespace Sparkle;
+
+class TestParityCoder : public QObject {
+	Q_OBJECT
+
+private slots:
+	void numbersPacketsAndGroups();
+	void recoversAnySingleLoss();
+	void recoversWhenParityComesFirst();
+	void cannotRecoverTwoLosses();
+	void completeGroupRecoversNothing();
+	void rejectsDuplicates();
+	void rejectsOversizedGroups();
+
+private:
+	struct group_t {
+		QList<QByteArray>	packets;
+		quint16			group;
+		QByteArray		parity;
+		quint16			lengths;
+	};
+
+	static group_t encodeGroup();
+};
+
+/* packets of different sizes, so that padding and lengths matter */
+TestParityCoder::group_t TestParityCoder::encodeGroup() {
+	static const int sizes[] = { 100, 1400, 60, 700 };
+
+	group_t g;
+	ParityEncoder encoder;
+	g.group = encoder.group();
+
+	for(int i = 0; i < 4; i++) {
+		QByteArray packet(sizes[i], 0);
+		for(int j = 0; j < packet.size(); j++)
+			packet[j] = (char) (i * 31 + j * 7);
+
+		g.packets.append(packet);
+		encoder.add(packet);
+	}
+
+	g.parity = encoder.finish(g.lengths);
+
+	return g;
+}
+
+void TestParityCoder::numbersPacketsAndGroups() {
+	ParityEncoder encoder;
+	quint16 group = encoder.group(), lengths;
+
+	QCOMPARE(encoder.add(QByteArray(10, 'a')), (quint8) 0);
+	QCOMPARE(encoder.add(QByteArray(20, 'b')), (quint8) 1);
+	QCOMPARE(encoder.count(), (quint8) 2);
+
+	QByteArray parity = encoder.finish(lengths);
+	QCOMPARE(parity.size(), 20);
+	QCOMPARE(lengths, (quint16) (10 ^ 20));
+
+	QCOMPARE(encoder.group(), (quint16) (group + 1));
+	QCOMPARE(encoder.count(), (quint8) 0);
+	QCOMPARE(encoder.add(QByteArray(10, 'c')), (quint8) 0);
+}
+
+void TestParityCoder::recoversAnySingleLoss() {
+	group_t g = encodeGroup();
+
+	for(int lost = 0; lost < g.packets.count(); lost++) {
+		ParityDecoder decoder;
+		QByteArray recovered;
+
+		for(int i = 0; i < g.packets.count(); i++) {
+			if(i != lost)
+				QVERIFY(decoder.add(g.group, i, g.packets[i], recovered));
+		}
+		QVERIFY(recovered.isEmpty());
+
+		QVERIFY(decoder.addParity(g.group, g.packets.count(), g.lengths, g.parity, recovered));
+		QCOMPARE(recovered, g.packets[lost]);
+	}
+}
+
+void TestParityCoder::recoversWhenParityComesFirst() {
+	group_t g = encodeGroup();
+	ParityDecoder decoder;
+	QByteArray recovered;
+
+	QVERIFY(!decoder.addParity(g.group, g.packets.count(), g.lengths, g.parity, recovered));
+
+	QVERIFY(decoder.add(g.group, 0, g.packets[0], recovered));
+	QVERIFY(decoder.add(g.group, 1, g.packets[1], recovered));
+	QVERIFY(recovered.isEmpty());
+
+	QVERIFY(decoder.add(g.group, 3, g.packets[3], recovered));
+	QCOMPARE(recovered, g.packets[2]);
+
+	// the rebuilt packet counts as received
+	QByteArray late;
+	QVERIFY(!decoder.add(g.group, 2, g.packets[2], late));
+}
+
+void TestParityCoder::cannotRecoverTwoLosses() {
+	group_t g = encodeGroup();
+	ParityDecoder decoder;
+	QByteArray recovered;
+
+	QVERIFY(decoder.add(g.group, 0, g.packets[0], recovered));
+	QVERIFY(decoder.add(g.group, 3, g.packets[3], recovered));
+
+	QVERIFY(!decoder.addParity(g.group, g.packets.count(), g.lengths, g.parity, recovered));
+	QVERIFY(recovered.isEmpty());
+}
+
+void TestParityCoder::completeGroupRecoversNothing() {
+	group_t g = encodeGroup();
+	ParityDecoder decoder;
+	QByteArray recovered;
+
+	for(int i = 0; i < g.packets.count(); i++)
+		QVERIFY(decoder.add(g.group, i, g.packets[i], recovered));
+
+	QVERIFY(!decoder.addParity(g.group, g.packets.count(), g.lengths, g.parity, recovered));
+	QVERIFY(recovered.isEmpty());
+}
+
+void TestParityCoder::rejectsDuplicates() {
+	group_t g = encodeGroup();
+	ParityDecoder decoder;
+	QByteArray recovered;
+
+	QVERIFY(decoder.add(g.group, 0, g.packets[0], recovered));
+	QVERIFY(!decoder.add(g.group, 0, g.packets[0], recovered));
+
+	decoder.addParity(g.group, g.packets.count(), g.lengths, g.parity, recovered);
+	QVERIFY(!decoder.addParity(g.group, g.packets.count(), g.lengths, g.parity, recovered));
+}
+
+void TestParityCoder::rejectsOversizedGroups() {
+	ParityDecoder decoder;
+	QByteArray recovered;
+
+	QVERIFY(!decoder.add(1, ParityDecoder::MaxGroupSize, QByteArray(10, 'a'), recovered));
+	QVERIFY(!decoder.addParity(1, 0, 10, QByteArray(10, 'a'), recovered));
+	QVERIFY(!decoder.addParity(1, ParityDecoder::MaxGroupSize + 1, 10, QByteArray(10, 'a'), recovered));
+}
+
+QTEST_MAIN(TestParityCoder)
+#include "tst_parity.moc"
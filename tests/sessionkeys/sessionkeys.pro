@@ -0,0 +1,15 @@
+TEMPLATE = app
+TARGET = tst_sessionkeys
+
+DEPENDPATH += . ../../libsparkle ../../libsparkle/headers
+INCLUDEPATH += ../../libsparkle ../../libsparkle/headers
+
+QT -= gui
+QT += network
+CONFIG += qtestlib console
+
+LIBS += -L../../output -lsparkle
+
+unix: QMAKE_LFLAGS += -Wl,-rpath ${PWD}/../../output
+
+SOURCES += tst_sessionkeys.cpp
@@ -0,0 +1,132 @@
+/*
+ * Sparkle - zero-configuration fully distributed self-organizing encrypting VPN
+ * Copyright (C) 2009 Sergey Gridassov, Peter Zotov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QtTest>
+#include <QHostAddress>
+
+#include <Sparkle/BlowfishKey>
+#include <Sparkle/Router>
+#include <Sparkle/SparkleNode>
+
+using namespace Sparkle;
+
+class TestSessionKeys : public QObject {
+	Q_OBJECT
+
+private slots:
+	void hisKeysFollowEpochs();
+	void repeatedRekeyIsIgnored();
+	void epochsWrapAround();
+	void myKeySwitchesOnAck();
+	void closeSessionForgetsKeys();
+
+private:
+	static QByteArray keyBytes(char fill);
+};
+
+QByteArray TestSessionKeys::keyBytes(char fill) {
+	return QByteArray(16, fill);
+}
+
+void TestSessionKeys::hisKeysFollowEpochs() {
+	Router router;
+	SparkleNode node(router, QHostAddress("10.0.0.1"), 1801);
+
+	node.setHisSessionKey(keyBytes('a'), 5);
+	QCOMPARE(node.hisKeyEpoch(), (quint8) 5);
+	QCOMPARE(node.hisSessionKey(5)->bytes(), keyBytes('a'));
+	QVERIFY(node.hisSessionKey(4) == NULL);
+
+	// packets sealed under the previous key are still accepted
+	node.rotateHisSessionKey(keyBytes('b'), 6);
+	QCOMPARE(node.hisSessionKey(6)->bytes(), keyBytes('b'));
+	QCOMPARE(node.hisSessionKey(5)->bytes(), keyBytes('a'));
+	QVERIFY(node.hisSessionKey(7) == NULL);
+
+	node.rotateHisSessionKey(keyBytes('c'), 7);
+	QCOMPARE(node.hisSessionKey(6)->bytes(), keyBytes('b'));
+	QVERIFY(node.hisSessionKey(5) == NULL);
+}
+
+void TestSessionKeys::repeatedRekeyIsIgnored() {
+	Router router;
+	SparkleNode node(router, QHostAddress("10.0.0.1"), 1801);
+
+	node.setHisSessionKey(keyBytes('a'), 0);
+	node.rotateHisSessionKey(keyBytes('b'), 1);
+	node.rotateHisSessionKey(keyBytes('x'), 1);
+
+	QCOMPARE(node.hisSessionKey(1)->bytes(), keyBytes('b'));
+	QCOMPARE(node.hisSessionKey(0)->bytes(), keyBytes('a'));
+}
+
+void TestSessionKeys::epochsWrapAround() {
+	Router router;
+	SparkleNode node(router, QHostAddress("10.0.0.1"), 1801);
+
+	node.setHisSessionKey(keyBytes('a'), 255);
+	node.rotateHisSessionKey(keyBytes('b'), 0);
+
+	QCOMPARE(node.hisSessionKey(0)->bytes(), keyBytes('b'));
+	QCOMPARE(node.hisSessionKey(255)->bytes(), keyBytes('a'));
+}
+
+void TestSessionKeys::myKeySwitchesOnAck() {
+	Router router;
+	SparkleNode node(router, QHostAddress("10.0.0.1"), 1801);
+	node.setHisSessionKey(keyBytes('a'));
+
+	QByteArray current = node.mySessionKey()->bytes();
+	QVERIFY(!node.isRekeyPending());
+
+	QByteArray next = node.startRekey()->bytes();
+	QVERIFY(node.isRekeyPending());
+	QCOMPARE(node.startRekey()->bytes(), next);
+
+	// the old key stays in use until the peer acknowledges the next epoch
+	QCOMPARE(node.mySessionKey()->bytes(), current);
+	QVERIFY(!node.finishRekey(2));
+	QCOMPARE(node.myKeyEpoch(), (quint8) 0);
+
+	QVERIFY(node.finishRekey(1));
+	QCOMPARE(node.myKeyEpoch(), (quint8) 1);
+	QCOMPARE(node.mySessionKey()->bytes(), next);
+	QVERIFY(!node.isRekeyPending());
+	QCOMPARE(node.bytesUnderKey(), (quint64) 0);
+
+	QVERIFY(!node.finishRekey(1));
+}
+
+void TestSessionKeys::closeSessionForgetsKeys() {
+	Router router;
+	SparkleNode node(router, QHostAddress("10.0.0.1"), 1801);
+
+	node.setHisSessionKey(keyBytes('a'), 3);
+	node.startRekey();
+	QVERIFY(node.hasSession());
+
+	node.closeSession();
+	QVERIFY(!node.hasSession());
+	QVERIFY(!node.isRekeyPending());
+	QVERIFY(node.hisSessionKey(3) == NULL);
+	QCOMPARE(node.hisKeyEpoch(), (quint8) 0);
+	QCOMPARE(node.myKeyEpoch(), (quint8) 0);
+}
+
+QTEST_MAIN(TestSessionKeys)
+#include "tst_sessionkeys.moc"
@@ -0,0 +1,14 @@
+TEMPLATE = app
+TARGET = tst_sparkleaddress
+
+DEPENDPATH += . ../../libsparkle ../../libsparkle/headers
+INCLUDEPATH += ../../libsparkle ../../libsparkle/headers
+
+QT -= gui
+CONFIG += qtestlib console
+
+LIBS += -L../../output -lsparkle
+
+unix: QMAKE_LFLAGS += -Wl,-rpath ${PWD}/../../output
+
+SOURCES += tst_sparkleaddress.cpp
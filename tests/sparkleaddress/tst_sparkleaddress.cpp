@@ -0,0 +1,96 @@
+/*
+ * Sparkle - zero-configuration fully distributed self-organizing encrypting VPN
+ * Copyright (C) 2009 Sergey Gridassov, Peter Zotov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QtTest>
+#include <QHash>
+
+#include <string.h>
+
+#include <Sparkle/SparkleAddress>
+
+using namespace Sparkle;
+
+class TestSparkleAddress : public QObject {
+	Q_OBJECT
+
+private slots:
+	void nullAndEquality();
+	void keepsSixBytes();
+	void wrongSizeLeavesSpareBytesZero();
+	void hashesByValue();
+	void prettyPrints();
+
+private:
+	static const quint8 sample[SPARKLE_ADDRESS_SIZE];
+};
+
+const quint8 TestSparkleAddress::sample[SPARKLE_ADDRESS_SIZE] = { 0x0e, 0x01, 0xab, 0xcd, 0xef, 0xff };
+
+void TestSparkleAddress::nullAndEquality() {
+	QVERIFY(SparkleAddress().isNull());
+	QVERIFY(SparkleAddress() == SparkleAddress(QByteArray(SPARKLE_ADDRESS_SIZE, 0)));
+
+	// only the last byte set still makes an address
+	quint8 last[SPARKLE_ADDRESS_SIZE] = { 0, 0, 0, 0, 0, 1 };
+	QVERIFY(!SparkleAddress(last).isNull());
+
+	QVERIFY(SparkleAddress(sample) == SparkleAddress(sample));
+	QVERIFY(SparkleAddress(sample) != SparkleAddress(last));
+	QVERIFY(!(SparkleAddress(sample) != SparkleAddress(sample)));
+}
+
+void TestSparkleAddress::keepsSixBytes() {
+	QByteArray bytes((const char*) sample, SPARKLE_ADDRESS_SIZE);
+	SparkleAddress address(bytes);
+
+	QCOMPARE(address.bytes(), bytes);
+	QVERIFY(memcmp(address.rawBytes(), sample, SPARKLE_ADDRESS_SIZE) == 0);
+	QCOMPARE(address.value(), SparkleAddress(sample).value());
+}
+
+void TestSparkleAddress::wrongSizeLeavesSpareBytesZero() {
+	QByteArray longer((const char*) sample, SPARKLE_ADDRESS_SIZE);
+	longer.append("\x55\x66");
+
+	SparkleAddress address(longer);
+	QVERIFY(address == SparkleAddress(sample));
+	QCOMPARE(address.value(), SparkleAddress(sample).value());
+}
+
+void TestSparkleAddress::hashesByValue() {
+	quint8 other[SPARKLE_ADDRESS_SIZE] = { 0x0e, 0x01, 0xab, 0xcd, 0xef, 0xfe };
+
+	QCOMPARE(qHash(SparkleAddress(sample)), qHash(SparkleAddress(QByteArray((const char*) sample, SPARKLE_ADDRESS_SIZE))));
+	QVERIFY(qHash(SparkleAddress(sample)) != qHash(SparkleAddress(other)));
+
+	QHash<SparkleAddress, int> table;
+	table[SparkleAddress(sample)] = 1;
+	table[SparkleAddress(other)] = 2;
+
+	QCOMPARE(table.count(), 2);
+	QCOMPARE(table.value(SparkleAddress(sample)), 1);
+	QCOMPARE(table.value(SparkleAddress(other)), 2);
+}
+
+void TestSparkleAddress::prettyPrints() {
+	QCOMPARE(SparkleAddress(sample).pretty(), QString("0E:01:AB:CD:EF:FF"));
+	QCOMPARE(SparkleAddress().pretty(), QString("00:00:00:00:00:00"));
+}
+
+QTEST_MAIN(TestSparkleAddress)
+#include "tst_sparkleaddress.moc"
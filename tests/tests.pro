@@ -0,0 +1,5 @@
+# Not part of the default build; run qmake on this file after building
+# libsparkle. Classes not exported from the library are compiled into
+# the tests that use them.
+TEMPLATE = subdirs
+SUBDIRS = egress compressor parity wireformat sparkleaddress sessionkeys
@@ -0,0 +1,117 @@
+/*
+ * Sparkle - zero-configuration fully distributed self-organizing encrypting VPN
+ * Copyright (C) 2009 Sergey Gridassov, Peter Zotov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QtTest>
+
+#include <Sparkle/WireFormat>
+
+using namespace Sparkle;
+
+class TestWireFormat : public QObject {
+	Q_OBJECT
+
+private slots:
+	void bigEndianStoresNetworkOrder();
+	void structsCarryNoPadding();
+	void wireAppendGrowsBuffer();
+	void viewChecksBounds();
+	void arrayCountsWholeEntries();
+
+private:
+	struct sample_t {
+		quint8			flags;
+		BigEndian<quint32>	address;
+		BigEndian<quint16>	port;
+	};
+};
+
+void TestWireFormat::bigEndianStoresNetworkOrder() {
+	BigEndian<quint16> port = 0x1234;
+	BigEndian<quint32> address = 0x0a000102;
+
+	QCOMPARE((int) sizeof(port), 2);
+	QCOMPARE(QByteArray((const char*) &port, sizeof(port)), QByteArray("\x12\x34", 2));
+	QCOMPARE(QByteArray((const char*) &address, sizeof(address)), QByteArray("\x0a\x00\x01\x02", 4));
+
+	QCOMPARE((quint16) port, (quint16) 0x1234);
+	QCOMPARE((quint32) address, (quint32) 0x0a000102);
+}
+
+void TestWireFormat::structsCarryNoPadding() {
+	QCOMPARE((int) sizeof(sample_t), 7);
+}
+
+void TestWireFormat::wireAppendGrowsBuffer() {
+	QByteArray buffer("ab");
+
+	wireAppend<sample_t>(buffer);
+	QCOMPARE(buffer, QByteArray("ab\0\0\0\0\0\0\0", 9));
+
+	buffer.truncate(2);
+	sample_t* sample = wireAppend<sample_t>(buffer);
+	sample->flags = 1;
+	sample->address = 0x0a000102;
+	sample->port = 1801;
+
+	QCOMPARE(buffer.size(), 2 + (int) sizeof(sample_t));
+	QCOMPARE(buffer, QByteArray("ab\x01\x0a\x00\x01\x02\x07\x09", 9));
+}
+
+void TestWireFormat::viewChecksBounds() {
+	QByteArray packet("xx\x01\x0a\x00\x01\x02\x07\x09" "tail", 13);
+
+	WireView<sample_t> view(packet, 2);
+	QVERIFY(view.isValid());
+	QCOMPARE(view.requiredSize(), 9);
+	QCOMPARE(view->flags, (quint8) 1);
+	QCOMPARE((quint32) view->address, (quint32) 0x0a000102);
+	QCOMPARE((quint16) view->port, (quint16) 1801);
+	QCOMPARE(view.tail(), QByteArray("tail"));
+
+	QByteArray truncated = packet.left(8);
+	QVERIFY(!WireView<sample_t>(truncated, 2).isValid());
+
+	QByteArray exact = packet.left(9);
+	QVERIFY(WireView<sample_t>(exact, 2).isValid());
+	QVERIFY(WireView<sample_t>(exact, 2).tail().isEmpty());
+}
+
+void TestWireFormat::arrayCountsWholeEntries() {
+	QByteArray packet("h");
+	for(int i = 0; i < 3; i++)
+		wireAppend<sample_t>(packet)->port = i;
+
+	WireArray<sample_t> entries(packet, 1);
+	QVERIFY(entries.isValid());
+	QCOMPARE(entries.count(), 3);
+	QCOMPARE((quint16) entries[2].port, (quint16) 2);
+
+	// a partial entry makes the whole run malformed
+	QByteArray ragged = packet;
+	ragged.append('x');
+	QVERIFY(!WireArray<sample_t>(ragged, 1).isValid());
+	QCOMPARE(WireArray<sample_t>(ragged, 1).count(), 0);
+
+	QVERIFY(!WireArray<sample_t>(packet, packet.size() + 1).isValid());
+
+	QVERIFY(WireArray<sample_t>(packet, packet.size()).isValid());
+	QCOMPARE(WireArray<sample_t>(packet, packet.size()).count(), 0);
+}
+
+QTEST_MAIN(TestWireFormat)
+#include "tst_wireformat.moc"
@@ -0,0 +1,10 @@
+TEMPLATE = app
+TARGET = tst_wireformat
+
+DEPENDPATH += . ../../libsparkle/headers
+INCLUDEPATH += ../../libsparkle/headers
+
+QT -= gui
+CONFIG += qtestlib console
+
+SOURCES += tst_wireformat.cpp